@@ -0,0 +1,216 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include "common.hpp"
+#include "file.hpp"
+#include "util.hpp"
+#include "elf.hpp"
+#include "stats.hpp"
+
+// A static library in the common Unix "ar" format (as written by GNU ar and
+// most PowerPC toolchains). The archive is mapped rather than read, and a
+// member is only parsed once a link asks for it, so linking against a big
+// library only costs the members that actually get used.
+class Archive
+{
+public:
+    struct Member
+    {
+        std::string name;
+        long headerOffset;
+        byte *data;
+        size_t length;
+        std::unique_ptr<Elf> elf;
+    };
+
+    std::string _path;
+    MappedFile _file;
+    // the whole archive: _file's mapping, or memory owned by whoever opened it
+    byte *_data = nullptr;
+    size_t _length = 0;
+    std::vector<Member> _members;
+    // symbol name -> index into _members
+    std::map<std::string, size_t> _index;
+    std::mutex _lock;
+
+    static bool IsArchive(const std::string &path)
+    {
+        char magic[8] = {};
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr)
+            return false;
+        size_t read = fread(magic, 1, 8, fp);
+        fclose(fp);
+        return read == 8 && memcmp(magic, "!<arch>\n", 8) == 0;
+    }
+
+    bool Open(const std::string &path)
+    {
+        if (!_file.Open(path))
+        {
+            writeline("cannot read archive %s", path.c_str());
+            return false;
+        }
+        return Open(path, _file.data, _file.length);
+    }
+
+    // An archive that is already in memory; the bytes have to outlive this object
+    bool Open(const std::string &path, byte *data, size_t length)
+    {
+        _path = path;
+        _data = data;
+        _length = length;
+        if (length < 8 || memcmp(data, "!<arch>\n", 8) != 0)
+        {
+            writeline("cannot read archive %s", path.c_str());
+            return false;
+        }
+
+        byte *symbolTable = nullptr, *longNames = nullptr;
+        size_t symbolTableLength = 0, longNamesLength = 0;
+
+        size_t offset = 8;
+        while (offset + 60 <= _length)
+        {
+            byte *header = _data + offset;
+            if (header[58] != '`' || header[59] != '\n')
+            {
+                writeline("archive %s: bad member header at offset 0x%zx", path.c_str(), offset);
+                return false;
+            }
+
+            std::string name((char *)header, 16);
+            name.erase(name.find_last_not_of(' ') + 1);
+            size_t length = std::strtoul(std::string((char *)header + 48, 10).c_str(), nullptr, 10);
+
+            byte *data = header + 60;
+            if (data + length > _data + _length)
+            {
+                writeline("archive %s: member %s runs past the end of the file", path.c_str(), name.c_str());
+                return false;
+            }
+
+            if (name == "/")
+            {
+                symbolTable = data;
+                symbolTableLength = length;
+            }
+            else if (name == "//")
+            {
+                longNames = data;
+                longNamesLength = length;
+            }
+            else if (name == "/SYM64/" || name.starts_with("__.SYMDEF"))
+            {
+                // index formats we don't read; the members get scanned instead
+            }
+            else
+            {
+                if (name.starts_with("#1/"))
+                {
+                    // BSD: the name is stored in front of the data
+                    size_t nameLength = std::strtoul(name.c_str() + 3, nullptr, 10);
+                    nameLength = std::min(nameLength, length);
+                    name = std::string((char *)data, strnlen((char *)data, nameLength));
+                    data += nameLength;
+                    length -= nameLength;
+                }
+                else if (name.starts_with("/") && longNames != nullptr)
+                {
+                    // GNU: an offset into the long name table, names end with "/\n"
+                    size_t start = std::strtoul(name.c_str() + 1, nullptr, 10);
+                    size_t end = start;
+                    while (end < longNamesLength && longNames[end] != '\n')
+                        end++;
+                    name = std::string((char *)longNames + std::min(start, longNamesLength), (char *)longNames + end);
+                    if (name.ends_with("/"))
+                        name.pop_back();
+                }
+                else if (name.ends_with("/"))
+                    name.pop_back();
+
+                _members.push_back(Member{.name = name, .headerOffset = (long)offset, .data = data, .length = length});
+            }
+
+            // members are 2-byte aligned
+            offset += 60 + length + (length & 1);
+        }
+
+        if (symbolTable != nullptr)
+            ReadSymbolTable(symbolTable, symbolTableLength);
+        else
+            ScanMembers();
+
+        Stats::Count("archive.symbols", _index.size());
+        return true;
+    }
+
+    // The SysV/GNU index: a count, that many member header offsets, then the names
+    void ReadSymbolTable(byte *table, size_t length)
+    {
+        if (length < 4)
+            return;
+
+        uint count = Util::ExtractUInt32(table, 0);
+        if (4 + ((size_t)count * 4) > length)
+            return;
+
+        std::map<long, size_t> byOffset;
+        for (size_t i = 0; i < _members.size(); i++)
+            byOffset[_members[i].headerOffset] = i;
+
+        char *name = (char *)table + 4 + (count * 4);
+        char *end = (char *)table + length;
+        for (uint i = 0; i < count && name < end; i++)
+        {
+            std::string symbol(name, strnlen(name, end - name));
+            name += symbol.length() + 1;
+
+            auto member = byOffset.find(Util::ExtractUInt32(table, 4 + (i * 4)));
+            if (member != byOffset.end())
+                _index.try_emplace(symbol, member->second);
+        }
+    }
+
+    // Without an index, every member has to be parsed up front to find out what it defines
+    void ScanMembers()
+    {
+        for (size_t i = 0; i < _members.size(); i++)
+        {
+            Elf *elf = GetMember(i);
+            if (elf == nullptr)
+                continue;
+
+            std::vector<std::string> defined, undefined;
+            elf->ListGlobalSymbols(&defined, &undefined);
+            for (const std::string &symbol : defined)
+                _index.try_emplace(symbol, i);
+        }
+    }
+
+    // The member defining a symbol, or -1 if there is none
+    long FindDefinition(const std::string &symbol) const
+    {
+        auto entry = _index.find(symbol);
+        return (entry == _index.end()) ? -1 : (long)entry->second;
+    }
+
+    // Parses a member the first time it is asked for; nullptr if it isn't an object
+    Elf *GetMember(size_t index)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+
+        Member &member = _members[index];
+        if (member.elf == nullptr)
+        {
+            if (member.length < 4 || Util::ExtractUInt32(member.data, 0) != 0x7F454C46) // "\x7F" "ELF"
+                return nullptr;
+
+            Stats::Scope scope("ParseElf", _path + "(" + member.name + ")");
+            member.elf = std::make_unique<Elf>(member.data);
+            member.elf->_name = _path + "(" + member.name + ")";
+        }
+        return member.elf.get();
+    }
+};
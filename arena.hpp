@@ -0,0 +1,65 @@
+#pragma once
+
+#include <memory_resource>
+#include <type_traits>
+#include <string.h>
+#include "common.hpp"
+
+// Monotonic allocator that owns everything created during one link.
+// Objects are never freed individually; the whole arena is released in one
+// go (running any destructors in reverse order) when it is destroyed.
+class Arena
+{
+public:
+    std::pmr::monotonic_buffer_resource _resource;
+
+    struct Finalizer
+    {
+        void *object;
+        void (*destroy)(void *);
+    };
+    std::vector<Finalizer> _finalizers;
+
+    Arena(size_t initialSize = 64 * 1024) : _resource(initialSize) {}
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena()
+    {
+        for (auto it = _finalizers.rbegin(); it != _finalizers.rend(); it++)
+            it->destroy(it->object);
+    }
+
+    template <typename T, typename... Args>
+    T *New(Args &&...args)
+    {
+        void *memory = _resource.allocate(sizeof(T), alignof(T));
+        T *object = new (memory) T(std::forward<Args>(args)...);
+
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            _finalizers.push_back(Finalizer{.object = object, .destroy = [](void *p)
+                                            { ((T *)p)->~T(); }});
+
+        return object;
+    }
+
+    template <typename T>
+    T *NewArray(size_t count)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena arrays cannot hold types with destructors");
+
+        T *array = (T *)_resource.allocate(sizeof(T) * count, alignof(T));
+        for (size_t i = 0; i < count; i++)
+            new (array + i) T();
+        return array;
+    }
+
+    // Zero-filled scratch memory that lives as long as the arena
+    byte *Allocate(size_t size)
+    {
+        byte *memory = (byte *)_resource.allocate(size, 16);
+        memset(memory, 0, size);
+        return memory;
+    }
+};
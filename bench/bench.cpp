@@ -0,0 +1,301 @@
+// Per-phase microbenchmarks over synthetic objects from ElfGenerator.
+//
+// Build from the repository root with `make bench`, which gives kamek-bench.
+// The SIMD table decoders need their instruction set passed through, e.g.
+//   make bench CXXFLAGS="-std=c++23 -O2 -mssse3"
+//
+// Run without arguments to sweep 1k..1M symbols, or use -generate=out.o to
+// just write a synthetic object (plus -externals-out=file.txt for Kamek).
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#include "../common.hpp"
+#include "../elf.hpp"
+#include "../version_info.hpp"
+#include "../linker.hpp"
+#include "../kamek_file.hpp"
+#include "../thread_pool.hpp"
+#include "elf_generator.hpp"
+
+double MinTime = 0.25;
+
+void Measure(const char *name, uint symbols, double items, double bytes, std::function<void()> setup, std::function<void()> run)
+{
+    using clock = std::chrono::steady_clock;
+
+    double total = 0;
+    uint iterations = 0;
+    auto wallStart = clock::now();
+
+    // keep going until the timed part adds up to MinTime, but don't let slow
+    // setups (a full link at 1M symbols) run away with the wall clock either
+    while (iterations == 0 || (total < MinTime && iterations < 10000 && std::chrono::duration<double>(clock::now() - wallStart).count() < MinTime * 20))
+    {
+        if (setup)
+            setup();
+
+        auto start = clock::now();
+        run();
+        total += std::chrono::duration<double>(clock::now() - start).count();
+        iterations++;
+    }
+
+    double perRun = total / iterations;
+    writeline("%-24s %9u %6u %12.3f ms %12.2f Mitem/s %10.1f MB/s", name, symbols, iterations,
+              perRun * 1000.0, (items / perRun) / 1e6, (bytes / perRun) / (1024.0 * 1024.0));
+}
+
+ElfGenerator::Options OptionsForSize(uint symbols, bool longNames)
+{
+    ElfGenerator::Options o;
+    o.symbols = symbols;
+    o.textSections = std::max(16U, symbols / 1000);
+    o.externals = std::max(1U, symbols / 10);
+    o.hooks = std::max(2U, symbols / 100);
+    o.longNames = longNames;
+    o.addr32 = symbols / 2;
+    o.addr16Ha = symbols;
+    o.addr16Lo = symbols;
+    o.addr16Hi = symbols / 8;
+    o.rel24 = symbols;
+    return o;
+}
+
+void RunSize(uint symbols, bool longNames)
+{
+    const uint baseAddress = 0x80001900;
+
+    ElfGenerator::Options o = OptionsForSize(symbols, longNames);
+    ElfGenerator generator(o);
+    sized_array input = generator.Generate();
+    std::map<std::string, uint> externals = generator.Externals();
+    double relocs = o.addr32 + o.addr16Ha + o.addr16Lo + o.addr16Hi + o.rel24 + (o.hooks + 1) / 2;
+
+    Elf elf(input.data);
+    elf._name = "synthetic.o";
+
+    Measure("Elf", symbols, elf._sections.size(), input.length, nullptr, [&]()
+            { Elf parsed(input.data); });
+
+    std::vector<Elf::ElfSection *> symtabs, relas;
+    double symtabBytes = 0, relaBytes = 0;
+    for (Elf::ElfSection *s : elf._sections)
+    {
+        if (s->sh_type == Elf::ElfSection::Type::SHT_SYMTAB)
+        {
+            symtabs.push_back(s);
+            symtabBytes += s->data->length;
+        }
+        else if (s->sh_type == Elf::ElfSection::Type::SHT_RELA)
+        {
+            relas.push_back(s);
+            relaBytes += s->data->length;
+        }
+    }
+
+    Measure("Elf::DecodeSymbols", symbols, symtabBytes / 16, symtabBytes, nullptr, [&]()
+            {
+                for (Elf::ElfSection *s : symtabs)
+                    Elf::DecodeSymbols(s->data); });
+    Measure("Elf::DecodeRelas", symbols, relaBytes / 12, relaBytes, nullptr, [&]()
+            {
+                for (Elf::ElfSection *s : relas)
+                    Elf::DecodeRelas(s->data); });
+
+    std::unique_ptr<Arena> arena;
+    std::unique_ptr<Linker> linker;
+    auto freshLinker = [&]()
+    {
+        linker.reset();
+        arena = std::make_unique<Arena>();
+        linker = std::make_unique<Linker>(nullptr, arena.get());
+        linker->AddModule(&elf);
+        linker->_baseAddress = {WordType::AbsoluteAddr, baseAddress};
+    };
+
+    Measure("CollectSections", symbols, elf._sections.size(), input.length, freshLinker, [&]()
+            { linker->CollectSections(); });
+
+    Measure("BuildSymbolTables", symbols, symbols + o.externals + o.hooks, 0, [&]()
+            { freshLinker(); linker->CollectSections(); },
+            [&]()
+            { linker->BuildSymbolTables(); });
+
+    AddressMapper base, mapper;
+    for (uint i = 0; i < 8; i++)
+    {
+        base.AddMapping(0x80000000 + (i * 0x100000), 0x800FFFFF + (i * 0x100000), (i + 1) * 0x20);
+        mapper.AddMapping(0x80000000 + (i * 0x100000), 0x800FFFFF + (i * 0x100000), -(int)(i * 0x10));
+    }
+    mapper.Base = &base;
+
+    Measure("ProcessRelaSection", symbols, relocs, 0, [&]()
+            {
+                freshLinker();
+                linker->Mapper = &mapper;
+                linker->_externalSymbols = &externals;
+                linker->CollectSections();
+                linker->BuildSymbolTables(); },
+            [&]()
+            { linker->ProcessRelocations(); });
+
+    Measure("AddressMapper::Remap", symbols, symbols, 0, nullptr, [&]()
+            {
+                volatile uint sink = 0;
+                for (uint i = 0; i < symbols; i++)
+                    sink = sink + mapper.Remap(0x80000000 + ((i * 2654435761U) & 0x7FFFFC));
+            });
+
+    // The packers only read the linked file, so one link per mode is enough
+    {
+        Arena dynamicArena;
+        Linker dynamicLinker(&mapper, &dynamicArena);
+        dynamicLinker.AddModule(&elf);
+        dynamicLinker.LinkDynamic(externals);
+
+        KamekFile kf;
+        kf.LoadFromLinker(&dynamicLinker);
+        std::vector<byte> packed;
+
+        // relative command addresses only have 24 bits
+        if (kf._codeBlob->length > 0xFFFFFF)
+            writeline("%-24s %9u skipped: the blob is too big for a dynamic Kamek binary", "KamekFile::Pack", symbols);
+        else
+            Measure("KamekFile::Pack", symbols, kf._commands.size(), kf._codeBlob->length, nullptr, [&]()
+                    { kf.Pack(&packed); });
+    }
+    {
+        Arena staticArena;
+        Linker staticLinker(&mapper, &staticArena);
+        staticLinker.AddModule(&elf);
+        staticLinker.LinkStatic(baseAddress, externals);
+
+        KamekFile kf;
+        kf.LoadFromLinker(&staticLinker);
+
+        Measure("PackRiivolution", symbols, kf._commands.size(), kf._codeBlob->length, nullptr, [&]()
+                { kf.PackRiivolution(); });
+        Measure("PackDolphin", symbols, kf._commands.size(), kf._codeBlob->length, nullptr, [&]()
+                { kf.PackDolphin(); });
+        Measure("PackGeckoCodes", symbols, kf._commands.size(), kf._codeBlob->length, nullptr, [&]()
+                { kf.PackGeckoCodes(); });
+        Measure("PackActionReplayCodes", symbols, kf._commands.size(), kf._codeBlob->length, nullptr, [&]()
+                { kf.PackActionReplayCodes(); });
+        Measure("PackText (all four)", symbols, kf._commands.size(), kf._codeBlob->length, nullptr, [&]()
+                {
+                    std::string riiv, dolphin, gecko, ar;
+                    kf.PackText(KamekFile::TextOutputs{.riivolution = &riiv, .dolphin = &dolphin, .gecko = &gecko, .actionReplay = &ar}); });
+    }
+}
+
+// A link of many modules, split the same way as a real project; the total
+// is spread over the modules so every thread count does the same work
+void RunModules(uint modules, uint symbols, uint maxThreads)
+{
+    std::vector<sized_array> inputs;
+    std::vector<std::unique_ptr<Elf>> elves;
+    std::map<std::string, uint> externals;
+    for (uint i = 0; i < modules; i++)
+    {
+        ElfGenerator::Options o = OptionsForSize(std::max(1U, symbols / modules), false);
+        o.textSections = 4;
+        o.hooks = 1;
+        o.seed = i + 1;
+        o.prefix = std::format("m{0}_", i);
+
+        ElfGenerator generator(o);
+        inputs.push_back(generator.Generate());
+        elves.push_back(std::make_unique<Elf>(inputs.back().data));
+        externals.merge(generator.Externals());
+    }
+
+    for (uint threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        std::string name = std::format("Link {0}x{1}", modules, threads);
+        Measure(name.c_str(), symbols, symbols, 0, nullptr, [&]()
+                {
+                    Arena arena;
+                    AddressMapper mapper;
+                    Linker linker(&mapper, &arena);
+                    linker.Threads = threads;
+                    for (auto &elf : elves)
+                        linker.AddModule(elf.get());
+                    linker.LinkStatic(0x80001900, externals); });
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint maxSymbols = 1000000;
+    bool longNames = false;
+
+    std::string generatePath = "", externalsPath = "";
+    ElfGenerator::Options o;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.starts_with("-max-symbols="))
+            maxSymbols = std::stoul(arg.substr(13));
+        else if (arg.starts_with("-min-time="))
+            MinTime = std::stod(arg.substr(10));
+        else if (arg == "-long-names")
+            longNames = o.longNames = true;
+        else if (arg.starts_with("-generate="))
+            generatePath = arg.substr(10);
+        else if (arg.starts_with("-externals-out="))
+            externalsPath = arg.substr(15);
+        else if (arg.starts_with("-sections="))
+            o.textSections = std::stoul(arg.substr(10));
+        else if (arg.starts_with("-symbols="))
+            o.symbols = std::stoul(arg.substr(9));
+        else if (arg.starts_with("-externals="))
+            o.externals = std::stoul(arg.substr(11));
+        else if (arg.starts_with("-hooks="))
+            o.hooks = std::stoul(arg.substr(7));
+        else if (arg.starts_with("-addr32="))
+            o.addr32 = std::stoul(arg.substr(8));
+        else if (arg.starts_with("-addr16lo="))
+            o.addr16Lo = std::stoul(arg.substr(10));
+        else if (arg.starts_with("-addr16hi="))
+            o.addr16Hi = std::stoul(arg.substr(10));
+        else if (arg.starts_with("-addr16ha="))
+            o.addr16Ha = std::stoul(arg.substr(10));
+        else if (arg.starts_with("-rel24="))
+            o.rel24 = std::stoul(arg.substr(7));
+        else if (arg.starts_with("-seed="))
+            o.seed = std::stoul(arg.substr(6));
+        else
+        {
+            writeline("unrecognised argument: %s", arg.c_str());
+            return 1;
+        }
+    }
+
+    if (generatePath != "")
+    {
+        ElfGenerator generator(o);
+        sized_array output = generator.Generate();
+        File::WriteAllBytes(generatePath, &output);
+
+        if (externalsPath != "")
+        {
+            std::string text;
+            for (auto &pair : generator.Externals())
+                text += std::format("{0}=0x{1:08X}\n", pair.first, pair.second);
+            File::WriteAllText(externalsPath, text);
+        }
+        return 0;
+    }
+
+    writeline("%-24s %9s %6s %15s %20s %15s", "benchmark", "symbols", "runs", "time/run", "throughput", "bandwidth");
+    for (uint symbols = 1000; symbols <= maxSymbols; symbols *= 10)
+        RunSize(symbols, longNames);
+
+    // per-module parallelism: "Link MxT" is M modules on T threads
+    RunModules(300, std::min(maxSymbols, 300000U), ThreadPool::DefaultThreads());
+
+    return 0;
+}
@@ -0,0 +1,349 @@
+#pragma once
+
+#include "../common.hpp"
+#include "../util.hpp"
+#include "../elf.hpp"
+
+// Writes synthetic big-endian PowerPC relocatable objects that look like
+// what a mod's compiler would hand to Kamek: functions spread over a
+// configurable number of .text sections, a .data table of pointers, a .bss
+// block, _kHook records in .kamek, and RELA tables for all of them.
+class ElfGenerator
+{
+public:
+    struct Options
+    {
+        uint textSections = 16;
+        uint symbols = 1000;
+        // undefined symbols, resolved through Externals()
+        uint externals = 100;
+        // pads every symbol name out to a long Itanium-style mangled name
+        bool longNames = false;
+        uint hooks = 10;
+        uint seed = 1;
+        // put in front of every defined symbol, so several objects can be linked together
+        std::string prefix = "";
+
+        // how many RELA entries of each Elf::Reloc type to emit
+        uint addr32 = 1000;
+        uint addr16Lo = 1000;
+        uint addr16Hi = 0;
+        uint addr16Ha = 1000;
+        uint rel24 = 1000;
+    };
+
+    Options _options;
+    std::vector<byte> _out;
+    uint _random;
+
+    ElfGenerator(const Options &options)
+    {
+        _options = options;
+        _random = options.seed;
+    }
+
+    // Addresses for every external symbol the generated object references
+    std::map<std::string, uint> Externals()
+    {
+        std::map<std::string, uint> externals;
+        for (uint i = 0; i < _options.externals; i++)
+            externals[SymbolName("ext", i)] = 0x80200000 + (i * 0x10);
+        return externals;
+    }
+
+    std::string SymbolName(const std::string &kind, uint index)
+    {
+        if (!_options.longNames)
+            return std::format("{0}_{1}", kind, index);
+
+        // roughly the shape (and length) of a templated C++ member function
+        std::string scope = std::format("{0}{1}", kind, index);
+        return std::format("_ZN5Kamek9Generated{0}{1}18SyntheticNamespace22LongMangledMemberNameIN2nw4r3g3d12ScnMdlSimpleEE7ExecuteERKNS_11CalcContextEPvj", scope.length(), scope);
+    }
+
+    uint NextRandom()
+    {
+        // xorshift32, so every run with the same seed produces the same object
+        _random ^= _random << 13;
+        _random ^= _random >> 17;
+        _random ^= _random << 5;
+        return _random;
+    }
+
+    void Put8(byte value) { _out.push_back(value); }
+    void Put16(ushort value)
+    {
+        Put8((byte)(value >> 8));
+        Put8((byte)value);
+    }
+    void Put32(uint value)
+    {
+        Put16((ushort)(value >> 16));
+        Put16((ushort)value);
+    }
+    void Align(uint alignment)
+    {
+        while (_out.size() % alignment)
+            Put8(0);
+    }
+
+    struct Section
+    {
+        std::string name;
+        Elf::ElfSection::Type type;
+        uint flags, link, info, addralign, entsize;
+        std::vector<byte> data;
+        uint size; // only used for SHT_NOBITS
+    };
+
+    struct Rela
+    {
+        uint offset;
+        uint symbol;
+        Elf::Reloc type;
+    };
+
+    static void Append32(std::vector<byte> &data, uint value)
+    {
+        data.push_back((byte)(value >> 24));
+        data.push_back((byte)(value >> 16));
+        data.push_back((byte)(value >> 8));
+        data.push_back((byte)value);
+    }
+
+    static std::vector<byte> EncodeRelas(const std::vector<Rela> &relas)
+    {
+        std::vector<byte> data;
+        data.reserve(relas.size() * 12);
+        for (const Rela &rela : relas)
+        {
+            Append32(data, rela.offset);
+            Append32(data, (rela.symbol << 8) | rela.type);
+            Append32(data, 0);
+        }
+        return data;
+    }
+
+    sized_array Generate()
+    {
+        const Options &o = _options;
+        uint textSections = std::max(o.textSections, 1U);
+        uint functions = std::max(o.symbols, textSections);
+
+        // Every text relocation needs its own instruction, plus one blr per function
+        uint textRelocs = o.addr16Lo + o.addr16Hi + o.addr16Ha + o.rel24;
+        uint wordsPerFunction = std::max(4U, (textRelocs + functions - 1) / functions + 1);
+
+        // Section indices: null, text..., .data, .bss, .kamek, rela..., .symtab, .strtab, .shstrtab
+        std::vector<Section> sections;
+        sections.push_back(Section{.name = ""});
+        for (uint i = 0; i < textSections; i++)
+            sections.push_back(Section{.name = std::format(".text.gen{0}", i), .type = Elf::ElfSection::SHT_PROGBITS, .flags = Elf::ElfSection::SHF_ALLOC | Elf::ElfSection::SHF_EXECINSTR, .addralign = 4});
+        uint dataIndex = sections.size();
+        sections.push_back(Section{.name = ".data", .type = Elf::ElfSection::SHT_PROGBITS, .flags = Elf::ElfSection::SHF_ALLOC | Elf::ElfSection::SHF_WRITE, .addralign = 4});
+        sections.push_back(Section{.name = ".bss", .type = Elf::ElfSection::SHT_NOBITS, .flags = Elf::ElfSection::SHF_ALLOC | Elf::ElfSection::SHF_WRITE, .addralign = 4, .size = std::max(o.symbols, 1U) * 4});
+        uint kamekIndex = sections.size();
+        sections.push_back(Section{.name = ".kamek", .type = Elf::ElfSection::SHT_PROGBITS, .flags = Elf::ElfSection::SHF_ALLOC, .addralign = 4});
+
+        // Symbols: null, _kHook locals, then defined functions, then externals
+        std::vector<std::string> symbolNames{""};
+        std::vector<uint> symbolValues{0}, symbolSizes{0};
+        std::vector<ushort> symbolSections{0};
+        std::vector<byte> symbolInfo{0};
+
+        for (uint i = 0, offset = 0; i < o.hooks; i++)
+        {
+            // kmCall records are 16 bytes, kmWrite32 records 20 (see below)
+            uint size = ((i % 2) == 0) ? 16 : 20;
+            symbolNames.push_back(std::format("_kHook{0}", i));
+            symbolValues.push_back(offset);
+            symbolSizes.push_back(size);
+            offset += size;
+            symbolSections.push_back(kamekIndex);
+            symbolInfo.push_back((Elf::STB_LOCAL << 4) | Elf::STT_OBJECT);
+        }
+        uint firstGlobal = symbolNames.size();
+
+        uint firstFunction = symbolNames.size();
+        std::vector<uint> functionOffsets;
+        for (uint i = 0; i < functions; i++)
+        {
+            uint section = 1 + (i % textSections);
+            uint offset = sections[section].data.size();
+            for (uint w = 0; w < wordsPerFunction - 1; w++)
+                Append32(sections[section].data, 0x60000000); // nop
+            Append32(sections[section].data, 0x4E800020);     // blr
+
+            symbolNames.push_back(SymbolName(_options.prefix + "func", i));
+            symbolValues.push_back(offset);
+            symbolSizes.push_back(wordsPerFunction * 4);
+            symbolSections.push_back(section);
+            symbolInfo.push_back((Elf::STB_GLOBAL << 4) | Elf::STT_FUNC);
+            functionOffsets.push_back(offset);
+        }
+
+        uint firstExternal = symbolNames.size();
+        for (uint i = 0; i < o.externals; i++)
+        {
+            symbolNames.push_back(SymbolName("ext", i));
+            symbolValues.push_back(0);
+            symbolSizes.push_back(0);
+            symbolSections.push_back(0);
+            symbolInfo.push_back((Elf::STB_GLOBAL << 4) | Elf::STT_NOTYPE);
+        }
+
+        auto randomTarget = [&]()
+        {
+            uint pick = NextRandom() % (functions + o.externals);
+            return (pick < functions) ? firstFunction + pick : firstExternal + (pick - functions);
+        };
+
+        // Text relocations: hand out instruction slots function by function
+        std::vector<std::vector<Rela>> textRelas(textSections);
+        uint slot = 0;
+        auto emitText = [&](Elf::Reloc type, uint count, uint insn)
+        {
+            for (uint i = 0; i < count; i++, slot++)
+            {
+                uint function = slot % functions;
+                uint word = slot / functions;
+                uint section = 1 + (function % textSections);
+                uint offset = functionOffsets[function] + (word * 4);
+
+                Util::InjectUInt32(sections[section].data.data(), offset, insn);
+                uint relocOffset = (type == Elf::R_PPC_REL24) ? offset : offset + 2;
+                textRelas[section - 1].push_back(Rela{.offset = relocOffset, .symbol = randomTarget(), .type = type});
+            }
+        };
+        emitText(Elf::R_PPC_ADDR16_HA, o.addr16Ha, 0x3C600000); // lis r3, X@ha
+        emitText(Elf::R_PPC_ADDR16_HI, o.addr16Hi, 0x3C600000); // lis r3, X@h
+        emitText(Elf::R_PPC_ADDR16_LO, o.addr16Lo, 0x38630000); // addi r3, r3, X@l
+        emitText(Elf::R_PPC_REL24, o.rel24, 0x48000001);        // bl X
+
+        // .data is a table of pointers
+        std::vector<Rela> dataRelas;
+        for (uint i = 0; i < o.addr32; i++)
+        {
+            Append32(sections[dataIndex].data, 0);
+            dataRelas.push_back(Rela{.offset = i * 4, .symbol = randomTarget(), .type = Elf::R_PPC_ADDR32});
+        }
+
+        // Hooks alternate between kmCall (pointer argument) and kmWrite32
+        std::vector<Rela> kamekRelas;
+        for (uint i = 0; i < o.hooks; i++)
+        {
+            auto &kamek = sections[kamekIndex].data;
+            uint base = kamek.size();
+            uint site = 0x81700000 + (i * 4); // clear of the blob even at 1M symbols
+            if ((i % 2) == 0)
+            {
+                Append32(kamek, 2); // argc
+                Append32(kamek, 4); // kmCall
+                Append32(kamek, site);
+                Append32(kamek, 0);
+                kamekRelas.push_back(Rela{.offset = base + 12, .symbol = firstFunction + (NextRandom() % functions), .type = Elf::R_PPC_ADDR32});
+            }
+            else
+            {
+                Append32(kamek, 3); // argc
+                Append32(kamek, 1); // kmWrite
+                Append32(kamek, 2); // WriteCommand::Type::Value32
+                Append32(kamek, site);
+                Append32(kamek, 0x38600000 | (i & 0xFFFF)); // li r3, i
+            }
+        }
+
+        uint symtabIndex = sections.size() + textSections + 2;
+
+        for (uint i = 0; i < textSections; i++)
+            sections.push_back(Section{.name = ".rela" + sections[1 + i].name, .type = Elf::ElfSection::SHT_RELA, .link = symtabIndex, .info = 1 + i, .addralign = 4, .entsize = 12, .data = EncodeRelas(textRelas[i])});
+        sections.push_back(Section{.name = ".rela.data", .type = Elf::ElfSection::SHT_RELA, .link = symtabIndex, .info = dataIndex, .addralign = 4, .entsize = 12, .data = EncodeRelas(dataRelas)});
+        sections.push_back(Section{.name = ".rela.kamek", .type = Elf::ElfSection::SHT_RELA, .link = symtabIndex, .info = kamekIndex, .addralign = 4, .entsize = 12, .data = EncodeRelas(kamekRelas)});
+
+        // String table and symbol table
+        std::vector<byte> strtab{0};
+        std::vector<byte> symtab;
+        for (uint i = 0; i < symbolNames.size(); i++)
+        {
+            uint nameOffset = 0;
+            if (!symbolNames[i].empty())
+            {
+                nameOffset = strtab.size();
+                strtab.insert(strtab.end(), symbolNames[i].begin(), symbolNames[i].end());
+                strtab.push_back(0);
+            }
+            Append32(symtab, nameOffset);
+            Append32(symtab, symbolValues[i]);
+            Append32(symtab, symbolSizes[i]);
+            symtab.push_back(symbolInfo[i]);
+            symtab.push_back(0);
+            symtab.push_back((byte)(symbolSections[i] >> 8));
+            symtab.push_back((byte)symbolSections[i]);
+        }
+
+        uint strtabIndex = symtabIndex + 1;
+        sections.push_back(Section{.name = ".symtab", .type = Elf::ElfSection::SHT_SYMTAB, .link = strtabIndex, .info = firstGlobal, .addralign = 4, .entsize = 16, .data = std::move(symtab)});
+        sections.push_back(Section{.name = ".strtab", .type = Elf::ElfSection::SHT_STRTAB, .addralign = 1, .data = std::move(strtab)});
+
+        uint shstrtabIndex = sections.size();
+        sections.push_back(Section{.name = ".shstrtab", .type = Elf::ElfSection::SHT_STRTAB, .addralign = 1});
+        std::vector<uint> sectionNames;
+        std::vector<byte> shstrtab{0};
+        for (Section &s : sections)
+        {
+            sectionNames.push_back(s.name.empty() ? 0 : shstrtab.size());
+            if (!s.name.empty())
+            {
+                shstrtab.insert(shstrtab.end(), s.name.begin(), s.name.end());
+                shstrtab.push_back(0);
+            }
+        }
+        sections[shstrtabIndex].data = std::move(shstrtab);
+
+        // Header, then section contents, then the section header table
+        _out.clear();
+        _out.resize(52);
+        std::vector<uint> offsets;
+        for (Section &s : sections)
+        {
+            Align(std::max(s.addralign, 1U));
+            offsets.push_back(_out.size());
+            _out.insert(_out.end(), s.data.begin(), s.data.end());
+        }
+        Align(4);
+        uint shoff = _out.size();
+
+        for (uint i = 0; i < sections.size(); i++)
+        {
+            Section &s = sections[i];
+            Put32(sectionNames[i]);
+            Put32(s.type);
+            Put32(s.flags);
+            Put32(0); // sh_addr
+            Put32(i == 0 ? 0 : offsets[i]);
+            Put32(s.type == Elf::ElfSection::SHT_NOBITS ? s.size : s.data.size());
+            Put32(s.link);
+            Put32(s.info);
+            Put32(s.addralign);
+            Put32(s.entsize);
+        }
+
+        byte *h = _out.data();
+        Util::InjectUInt32(h, 0, 0x7F454C46);
+        h[4] = 1; // ELFCLASS32
+        h[5] = 2; // ELFDATA2MSB
+        h[6] = 1; // EV_CURRENT
+        Util::InjectUInt16(h, 16, 1);    // ET_REL
+        Util::InjectUInt16(h, 18, 0x14); // EM_PPC
+        Util::InjectUInt32(h, 20, 1);    // e_version
+        Util::InjectUInt32(h, 32, shoff);
+        Util::InjectUInt16(h, 40, 52); // e_ehsize
+        Util::InjectUInt16(h, 46, 40); // e_shentsize
+        Util::InjectUInt16(h, 48, sections.size());
+        Util::InjectUInt16(h, 50, shstrtabIndex);
+
+        sized_array result(_out.size());
+        memcpy(result.data, _out.data(), _out.size());
+        return result;
+    }
+};
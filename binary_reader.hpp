@@ -2,6 +2,7 @@
 
 #include <string.h>
 #include "common.hpp"
+#include "endian.hpp"
 
 class BinaryReader
 {
@@ -10,12 +11,27 @@ public:
 
     unsigned char *data;
 
-    unsigned int ReadBigUInt32() { return __builtin_bswap32(*((unsigned int *)(data + (position += 4)))); }
+    unsigned int ReadBigUInt32()
+    {
+        unsigned int value = Endian::Load<uint>(data + position);
+        position += 4;
+        return value;
+    }
     unsigned char ReadByte() { return *((unsigned char *)(data + (position++))); }
-    unsigned int ReadBigUInt16() { return __builtin_bswap16(*((unsigned short *)(data + (position += 2)))); }
-    unsigned int ReadBigInt32() { return __builtin_bswap32(*((int *)(data + (position += 2)))); }
+    unsigned int ReadBigUInt16()
+    {
+        unsigned short value = Endian::Load<ushort>(data + position);
+        position += 2;
+        return value;
+    }
+    int ReadBigInt32() { return (int)ReadBigUInt32(); }
 
-    unsigned char *ReadBytes(int size) { return data + position; };
+    unsigned char *ReadBytes(int size)
+    {
+        unsigned char *bytes = data + position;
+        position += size;
+        return bytes;
+    };
 
     BinaryReader(unsigned char *input) { data = input; };
 };
@@ -28,9 +44,21 @@ public:
     unsigned char *data;
 
     void Write(byte x) { data[position++] = x; };
-    void Write(sized_array* x) { memcpy(data, x->data, x->length); };
-    void WriteBE(ushort x) { data[position += 2] = __builtin_bswap16(x); };
-    void WriteBE(uint x) { data[position += 4] = __builtin_bswap32(x); };
+    void Write(sized_array *x)
+    {
+        memcpy(data + position, x->data, x->length);
+        position += x->length;
+    };
+    void WriteBE(ushort x)
+    {
+        Endian::Store(data + position, x);
+        position += 2;
+    };
+    void WriteBE(uint x)
+    {
+        Endian::Store(data + position, x);
+        position += 4;
+    };
 
     BinaryWriter(unsigned char *_d) { data = _d; };
-};
\ No newline at end of file
+};
@@ -0,0 +1,691 @@
+#pragma once
+
+#include <memory>
+#include "common.hpp"
+#include "kamek.hpp"
+#include "stats.hpp"
+#include "output_writer.hpp"
+#include "thread_pool.hpp"
+#include "hash.hpp"
+#include "size_report.hpp"
+
+#define reterr return -__COUNTER__
+
+// Everything one link needs, from the command line or from a manifest job
+struct BuildOptions
+{
+    std::string name; // only set for manifest jobs
+
+    std::vector<std::string> inputPaths;
+    std::vector<std::string> externalsPaths;
+    std::string versionsPath = "";
+    std::vector<std::string> selectedVersions;
+
+    uint baseAddress = 0;
+    std::optional<uint> prelinkAddress;
+    bool geckoRunOnce = false;
+    bool alignTextToCacheLines = false;
+    bool relax = false;
+    bool instrumentHooks = false;
+    bool loaderBlockWrites = false;
+    std::string symbolOrderPath = ""; // see Kamek::ParseSymbolOrder
+    // threads for parsing the inputs and for the per-module linker phases
+    uint threads = 1;
+
+    // every version's Kamek binary in one file; see MultiVersionPacker
+    std::string outputKamekMultiPath = "";
+    std::string outputKamekPath = "", outputRiivPath = "", outputDolphinPath = "", outputGeckoPath = "", outputARPath = "", outputCodePath = "", outputMapPath = "";
+    std::string outputHookCountersPath = ""; // see KamekFile::PackHookCounters
+    std::string outputSizeReportPath = "";   // see SizeReport
+    // an earlier size report to compare with, and limits to fail the build on
+    std::string sizeBaselinePath = "", sizeBudgetPath = "";
+    std::string inputDolPath = "", outputDolPath = "";
+
+    // see RunBuild
+    std::string cacheDir = "", depfilePath = "";
+};
+
+// Every per-version output a build can have: the name cache entries know it
+// by and the option holding its path
+struct OutputKind
+{
+    const char *name;
+    std::string BuildOptions::*path;
+};
+static const std::vector<OutputKind> OutputKinds = {
+    {"kamek", &BuildOptions::outputKamekPath},
+    {"kamek-multi", &BuildOptions::outputKamekMultiPath}, // collected into one file, see MultiVersionPacker
+    {"code", &BuildOptions::outputCodePath},
+    {"map", &BuildOptions::outputMapPath},
+    {"hook-counters", &BuildOptions::outputHookCountersPath},
+    {"size-report", &BuildOptions::outputSizeReportPath},
+    {"riiv", &BuildOptions::outputRiivPath},
+    {"dolphin", &BuildOptions::outputDolphinPath},
+    {"gecko", &BuildOptions::outputGeckoPath},
+    {"ar", &BuildOptions::outputARPath},
+    {"dol", &BuildOptions::outputDolPath},
+};
+
+void ReadExternals(std::map<std::string, uint> &dict, const std::string &path)
+{
+    Kamek::ParseExternals(File::ReadAllLines(path), &dict);
+}
+
+// Substitutes the $KV$ placeholder in an output path with the version name
+std::string VersionPath(std::string path, const std::string &version)
+{
+    for (size_t pos = path.find("$KV$"); pos != std::string::npos; pos = path.find("$KV$", pos + version.length()))
+        path.replace(pos, 4, version);
+    return path;
+}
+
+// Input files shared by every build in the process. Each one is read and
+// parsed the first time a build asks for it; builds running at the same time
+// wait for that instead of loading their own copy. Nothing here is modified
+// by linking, so the results are handed out to several builds at once.
+class BuildCache
+{
+public:
+    struct Module
+    {
+        std::once_flag loaded;
+        sized_array bytes; // the sections point straight into this
+        std::unique_ptr<Elf> elf;
+    };
+
+    struct Library
+    {
+        std::once_flag loaded;
+        std::unique_ptr<Archive> archive;
+    };
+
+    struct Externals
+    {
+        std::once_flag loaded;
+        bool exists = false;
+        std::map<std::string, uint> symbols;
+    };
+
+    struct Versions
+    {
+        std::once_flag loaded;
+        std::unique_ptr<VersionInfo> info;
+    };
+
+    struct Digest
+    {
+        std::once_flag loaded;
+        bool exists = false;
+        std::string digest;
+    };
+
+    std::mutex _lock;
+    std::map<std::string, std::unique_ptr<Module>> _modules;
+    std::map<std::string, std::unique_ptr<Library>> _libraries;
+    std::map<std::string, std::unique_ptr<Externals>> _externals;
+    std::map<std::string, std::unique_ptr<Versions>> _versions;
+    std::map<std::string, std::unique_ptr<Digest>> _digests;
+
+    template <typename T>
+    T *Entry(std::map<std::string, std::unique_ptr<T>> &entries, const std::string &path)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        auto &entry = entries[path];
+        if (entry == nullptr)
+            entry = std::make_unique<T>();
+        return entry.get();
+    }
+
+    // nullptr if the file could not be read
+    Elf *GetModule(const std::string &path)
+    {
+        Module *module = Entry(_modules, path);
+        std::call_once(module->loaded, [&]()
+                       {
+            if (!std::filesystem::is_regular_file(path))
+                return;
+
+            writeline("adding %s as object..\n", path.c_str());
+            Stats::Scope scope("ParseElf", path);
+            module->bytes = File::ReadAllBytes(path);
+            module->elf = std::make_unique<Elf>(module->bytes.data);
+            module->elf->_name = path; });
+        return module->elf.get();
+    }
+
+    // nullptr if the archive could not be read
+    Archive *GetArchive(const std::string &path)
+    {
+        Library *library = Entry(_libraries, path);
+        std::call_once(library->loaded, [&]()
+                       {
+            writeline("adding %s as library..\n", path.c_str());
+            Stats::Scope scope("ReadArchive", path);
+            auto archive = std::make_unique<Archive>();
+            if (archive->Open(path))
+                library->archive = std::move(archive); });
+        return library->archive.get();
+    }
+
+    const std::map<std::string, uint> *GetExternals(const std::string &path)
+    {
+        Externals *externals = Entry(_externals, path);
+        std::call_once(externals->loaded, [&]()
+                       {
+            externals->exists = std::filesystem::is_regular_file(path);
+            if (externals->exists)
+                ReadExternals(externals->symbols, path); });
+        return externals->exists ? &externals->symbols : nullptr;
+    }
+
+    // An empty path gives the single "default" version with no remapping
+    VersionInfo *GetVersions(const std::string &path)
+    {
+        Versions *versions = Entry(_versions, path);
+        std::call_once(versions->loaded, [&]()
+                       {
+            if (path == "")
+                versions->info = std::make_unique<VersionInfo>();
+            else if (std::filesystem::is_regular_file(path))
+                versions->info = std::make_unique<VersionInfo>(path); });
+        return versions->info.get();
+    }
+
+    // A hash of the file's contents; nullptr if it could not be read
+    const std::string *GetDigest(const std::string &path)
+    {
+        Digest *digest = Entry(_digests, path);
+        std::call_once(digest->loaded, [&]()
+                       {
+            Stats::Scope scope("HashInput", path);
+            MappedFile file;
+            if (!std::filesystem::is_regular_file(path) || !file.Open(path))
+                return;
+
+            Hasher hasher;
+            hasher.Update(file.data, file.length);
+            digest->digest = hasher.Digest();
+            digest->exists = true; });
+        return digest->exists ? &digest->digest : nullptr;
+    }
+
+    // Cache entries hold every output one version produced, by kind:
+    // 'KmC1', a count, then for each a length-prefixed kind and contents
+    static std::string PackEntry(const std::vector<std::pair<std::string, std::string>> &outputs)
+    {
+        std::string entry = "KmC1";
+        auto appendLength = [&](size_t length)
+        {
+            byte word[4];
+            Util::InjectUInt32(word, 0, (uint)length);
+            entry.append((char *)word, 4);
+        };
+
+        appendLength(outputs.size());
+        for (auto &output : outputs)
+        {
+            appendLength(output.first.size());
+            entry += output.first;
+            appendLength(output.second.size());
+            entry += output.second;
+        }
+        return entry;
+    }
+
+    // false (and no outputs) if the entry is missing or damaged
+    static bool ReadEntry(const std::string &path, std::vector<std::pair<std::string, std::string>> *outputs)
+    {
+        MappedFile file;
+        if (!std::filesystem::is_regular_file(path) || !file.Open(path) || file.length < 8 || memcmp(file.data, "KmC1", 4) != 0)
+            return false;
+
+        size_t position = 4;
+        auto readString = [&](std::string *output)
+        {
+            if (position + 4 > file.length)
+                return false;
+            size_t length = Util::ExtractUInt32(file.data, position);
+            position += 4;
+            if (position + length > file.length)
+                return false;
+            output->assign((char *)file.data + position, length);
+            position += length;
+            return true;
+        };
+
+        uint count = Util::ExtractUInt32(file.data, position);
+        position += 4;
+        for (uint i = 0; i < count; i++)
+        {
+            std::pair<std::string, std::string> output;
+            if (!readString(&output.first) || !readString(&output.second))
+            {
+                outputs->clear();
+                return false;
+            }
+            outputs->push_back(std::move(output));
+        }
+        return count > 0;
+    }
+};
+
+// The rule a Make or Ninja depfile needs: every output depends on every input
+std::string MakeDepfile(const std::vector<std::string> &targets, const std::vector<std::string> &dependencies)
+{
+    auto escape = [](const std::string &path)
+    {
+        std::string escaped;
+        for (char c : path)
+        {
+            if (c == ' ' || c == '#')
+                escaped += '\\';
+            else if (c == '$')
+                escaped += '$';
+            escaped += c;
+        }
+        return escaped;
+    };
+
+    std::string text;
+    for (size_t i = 0; i < targets.size(); i++)
+        text += (i == 0 ? "" : " ") + escape(targets[i]);
+    text += ":";
+    for (const std::string &dependency : dependencies)
+        text += " \\\n  " + escape(dependency);
+    text += "\n";
+    return text;
+}
+
+// Links and writes out one build for every selected version; 0 on success.
+//
+// With a cache directory, each version's outputs are also stored there under
+// a hash of everything they depend on: the contents of every input, the
+// options, and the version. A version whose hash is already there isn't
+// linked at all, and the inputs are only parsed once some version needs it.
+// Outputs that come out the same as what's on disk are never rewritten.
+int RunBuild(const BuildOptions &options, BuildCache *cache)
+{
+    // Can we build a thing?
+    if (options.inputPaths.size() == 0)
+    {
+        writeline("no input files specified");
+        reterr;
+    }
+    if (std::none_of(OutputKinds.begin(), OutputKinds.end(), [&](const OutputKind &kind)
+                     { return options.*kind.path != ""; }))
+    {
+        writeline("no output path(s) specified");
+        reterr;
+    }
+    if (options.outputDolPath != "" && options.inputDolPath == "")
+    {
+        writeline("input dol path not specified");
+        reterr;
+    }
+    if (options.prelinkAddress.has_value() && options.baseAddress != 0)
+    {
+        writeline("-prelink only applies to dynamically linked binaries");
+        reterr;
+    }
+    if ((options.sizeBaselinePath != "" || options.sizeBudgetPath != "") && options.outputSizeReportPath == "")
+    {
+        writeline("-size-baseline and -size-budget need -output-size-report");
+        reterr;
+    }
+
+    Json sizeBudget;
+    if (options.sizeBudgetPath != "")
+    {
+        std::string error;
+        if (!std::filesystem::is_regular_file(options.sizeBudgetPath))
+        {
+            writeline("cannot read size budget %s", options.sizeBudgetPath.c_str());
+            reterr;
+        }
+        if (!Json::Parse(File::ReadAllText(options.sizeBudgetPath), &sizeBudget, &error))
+        {
+            writeline("size budget %s: %s", options.sizeBudgetPath.c_str(), error.c_str());
+            reterr;
+        }
+    }
+    bool overBudget = false;
+
+    VersionInfo *versions = cache->GetVersions(options.versionsPath);
+    if (versions == nullptr)
+    {
+        writeline("cannot read versions file %s", options.versionsPath.c_str());
+        reterr;
+    }
+
+    // Do safety checks
+    if (versions->_mappers.size() > 1 && options.selectedVersions.size() != 1)
+    {
+        bool ambiguousOutputPath = false;
+        for (const OutputKind &kind : OutputKinds)
+        {
+            const std::string &path = options.*kind.path;
+            if (path != "" && kind.path != &BuildOptions::outputKamekMultiPath && !path.contains("$KV$"))
+                ambiguousOutputPath = true;
+        }
+        if (ambiguousOutputPath)
+        {
+            writeline("ERROR: this configuration builds for multiple game versions, and some of the outputs will be overwritten");
+            writeline("add the $KV$ placeholder to your output paths, or use -select-version=.. to only build one version");
+            reterr;
+        }
+    }
+
+    // Everything that goes into the cache key apart from the version itself
+    Hasher inputs;
+    if (options.cacheDir != "")
+    {
+        inputs.Update(std::string("kamek-cache-1"));
+        std::vector<std::string> files = options.inputPaths;
+        files.insert(files.end(), options.externalsPaths.begin(), options.externalsPaths.end());
+        if (options.versionsPath != "")
+            files.push_back(options.versionsPath);
+        if (options.symbolOrderPath != "")
+            files.push_back(options.symbolOrderPath);
+
+        for (const std::string &path : files)
+        {
+            const std::string *digest = cache->GetDigest(path);
+            if (digest == nullptr)
+            {
+                writeline("cannot read %s", path.c_str());
+                reterr;
+            }
+            inputs.Update(*digest);
+        }
+
+        // the size report names modules after their paths (and archive members
+        // after the archive's), so a renamed input has to miss the cache too
+        inputs.Update((ulong)options.inputPaths.size());
+        for (const std::string &path : options.inputPaths)
+            inputs.Update(path);
+        inputs.Update((ulong)options.baseAddress);
+        inputs.Update((ulong)options.prelinkAddress.has_value());
+        inputs.Update((ulong)options.prelinkAddress.value_or(0));
+        inputs.Update((ulong)options.geckoRunOnce);
+        inputs.Update((ulong)options.alignTextToCacheLines);
+        inputs.Update((ulong)options.relax);
+        inputs.Update((ulong)options.instrumentHooks);
+        inputs.Update((ulong)options.loaderBlockWrites);
+        for (const std::string &mask : Linker::FixedUndefinedSymbols)
+            inputs.Update(mask);
+        for (const OutputKind &kind : OutputKinds)
+            inputs.Update(std::string(options.*kind.path != "" ? kind.name : ""));
+
+        std::error_code error;
+        std::filesystem::create_directories(options.cacheDir, error);
+    }
+
+    Kamek kamek;
+    std::vector<std::string> symbolOrder;
+    bool loaded = false;
+    auto load = [&]() -> int
+    {
+        // parse the objects at the same time, but add them in the order they were given
+        std::vector<bool> isArchive(options.inputPaths.size());
+        std::vector<Elf *> modules(options.inputPaths.size());
+        std::vector<std::function<void()>> loads;
+        for (size_t i = 0; i < options.inputPaths.size(); i++)
+        {
+            isArchive[i] = Archive::IsArchive(options.inputPaths[i]);
+            if (!isArchive[i])
+                loads.push_back([&, i]()
+                                { modules[i] = cache->GetModule(options.inputPaths[i]); });
+        }
+        ThreadPool::Run(loads, options.threads);
+
+        for (size_t i = 0; i < options.inputPaths.size(); i++)
+        {
+            const std::string &path = options.inputPaths[i];
+            if (isArchive[i])
+            {
+                Archive *archive = cache->GetArchive(path);
+                if (archive == nullptr)
+                    reterr;
+                kamek.AddArchive(archive);
+                continue;
+            }
+
+            Elf *module = modules[i];
+            if (module == nullptr)
+            {
+                writeline("cannot read object %s", path.c_str());
+                reterr;
+            }
+            kamek.AddModule(module);
+        }
+
+        for (const std::string &path : options.externalsPaths)
+        {
+            const std::map<std::string, uint> *symbols = cache->GetExternals(path);
+            if (symbols == nullptr)
+            {
+                writeline("cannot read externals file %s", path.c_str());
+                reterr;
+            }
+            kamek.AddExternals(symbols);
+        }
+
+        kamek.SetVersions(versions);
+
+        if (options.symbolOrderPath != "")
+        {
+            if (!std::filesystem::is_regular_file(options.symbolOrderPath))
+            {
+                writeline("cannot read symbol order %s", options.symbolOrderPath.c_str());
+                reterr;
+            }
+            Kamek::ParseSymbolOrder(File::ReadAllLines(options.symbolOrderPath), &symbolOrder);
+        }
+        return 0;
+    };
+
+    OutputWriter writer;
+    MultiVersionPacker multiVersion;
+    std::vector<std::string> targets, dependencies = options.inputPaths;
+    dependencies.insert(dependencies.end(), options.externalsPaths.begin(), options.externalsPaths.end());
+    if (options.versionsPath != "")
+        dependencies.push_back(options.versionsPath);
+    if (options.symbolOrderPath != "")
+        dependencies.push_back(options.symbolOrderPath);
+
+    for (auto version : versions->_mappers)
+    {
+        const auto &selected = options.selectedVersions;
+        if (selected.size() > 0 && std::find(selected.begin(), selected.end(), version.first) == selected.end())
+        {
+            writeline("(skipping version %s as it's not selected)", version.first.c_str());
+            continue;
+        }
+
+        if (options.name == "")
+        {
+            writeline("linking version %s...", version.first.c_str());
+            Stats::CurrentVersion = version.first;
+        }
+        else
+        {
+            writeline("linking %s for version %s...", options.name.c_str(), version.first.c_str());
+            Stats::CurrentVersion = options.name + "/" + version.first;
+        }
+        Stats::Scope versionScope("version", Stats::CurrentVersion);
+
+        std::string inputDol = VersionPath(options.inputDolPath, version.first);
+        if (options.outputDolPath != "")
+            dependencies.push_back(inputDol);
+
+        // kind name -> contents
+        std::vector<std::pair<std::string, std::string>> outputs;
+        std::string entryPath = "";
+        if (options.cacheDir != "")
+        {
+            Hasher key = inputs;
+            key.Update(version.first);
+            if (options.outputDolPath != "")
+            {
+                const std::string *digest = cache->GetDigest(inputDol);
+                key.Update(digest != nullptr ? *digest : std::string(""));
+            }
+            entryPath = (std::filesystem::path(options.cacheDir) / key.Digest()).string();
+
+            if (BuildCache::ReadEntry(entryPath, &outputs))
+            {
+                writeline("(version %s is up to date)", version.first.c_str());
+                Stats::Count("cache.hits");
+            }
+        }
+
+        if (outputs.size() == 0)
+        {
+            if (!loaded)
+            {
+                int error = load();
+                if (error != 0)
+                    return error;
+                loaded = true;
+            }
+
+            auto result = kamek.Link(version.first, Kamek::LinkOptions{.baseAddress = options.baseAddress, .prelinkAddress = options.prelinkAddress, .threads = options.threads, .alignTextToCacheLines = options.alignTextToCacheLines, .symbolOrder = &symbolOrder, .relax = options.relax, .instrumentHooks = options.instrumentHooks, .loaderBlockWrites = options.loaderBlockWrites});
+            if (result == nullptr)
+                reterr;
+            KamekFile *kf = &result->file;
+
+            if (options.outputKamekPath != "" || options.outputKamekMultiPath != "")
+            {
+                std::vector<byte> packed;
+                kf->Pack(&packed);
+                std::string bytes((const char *)packed.data(), packed.size());
+                if (options.outputKamekPath != "")
+                    outputs.push_back({"kamek", bytes});
+                if (options.outputKamekMultiPath != "")
+                    outputs.push_back({"kamek-multi", std::move(bytes)});
+            }
+            if (options.outputCodePath != "")
+                outputs.push_back({"code", std::string((const char *)kf->_codeBlob->data, kf->_codeBlob->length)});
+            if (options.outputMapPath != "")
+                outputs.push_back({"map", kf->PackSymbolMap()});
+            if (options.outputHookCountersPath != "")
+                outputs.push_back({"hook-counters", kf->PackHookCounters()});
+
+            // every requested text format comes out of a single walk over the commands
+            std::string riivText, dolphinText, geckoText, arText;
+            KamekFile::TextOutputs text;
+            text.geckoRunOnce = options.geckoRunOnce;
+            if (options.outputRiivPath != "")
+                text.riivolution = &riivText;
+            if (options.outputDolphinPath != "")
+                text.dolphin = &dolphinText;
+            if (options.outputGeckoPath != "")
+                text.gecko = &geckoText;
+            if (options.outputARPath != "")
+                text.actionReplay = &arText;
+
+            if (text.riivolution != nullptr || text.dolphin != nullptr || text.gecko != nullptr || text.actionReplay != nullptr)
+            {
+                kf->PackText(text);
+
+                if (text.riivolution != nullptr)
+                    outputs.push_back({"riiv", std::move(riivText)});
+                if (text.dolphin != nullptr)
+                    outputs.push_back({"dolphin", std::move(dolphinText)});
+                if (text.gecko != nullptr)
+                    outputs.push_back({"gecko", std::move(geckoText)});
+                if (text.actionReplay != nullptr)
+                    outputs.push_back({"ar", std::move(arText)});
+            }
+
+            if (options.outputDolPath != "")
+            {
+                if (!std::filesystem::is_regular_file(inputDol))
+                {
+                    writeline("cannot read dol %s", inputDol.c_str());
+                    reterr;
+                }
+                sized_array dolBytes = File::ReadAllBytes(inputDol);
+
+                std::vector<byte> output;
+                if (!result->PatchDol(std::span<const byte>(dolBytes.data, dolBytes.length), &output))
+                    reterr;
+                outputs.push_back({"dol", std::string(output.begin(), output.end())});
+            }
+
+            if (options.outputSizeReportPath != "")
+                outputs.push_back({"size-report", SizeReport::Build(kf, version.first)});
+
+            if (entryPath != "")
+            {
+                writer.Submit(entryPath, BuildCache::PackEntry(outputs));
+                Stats::Count("cache.misses");
+            }
+        }
+
+        // cached or not, the report is checked against the baseline and budget
+        if (options.sizeBaselinePath != "" || options.sizeBudgetPath != "")
+        {
+            auto report = std::find_if(outputs.begin(), outputs.end(), [](const auto &output)
+                                       { return output.first == "size-report"; });
+            Json parsed, baseline;
+            std::string error;
+            if (report == outputs.end() || !Json::Parse(report->second, &parsed, &error))
+            {
+                writeline("cannot read back the size report for version %s", version.first.c_str());
+                reterr;
+            }
+
+            bool hasBaseline = false;
+            std::string baselinePath = VersionPath(options.sizeBaselinePath, version.first);
+            if (baselinePath != "")
+            {
+                if (!std::filesystem::is_regular_file(baselinePath))
+                    writeline("warning: no size baseline at %s to compare version %s with", baselinePath.c_str(), version.first.c_str());
+                else if (!Json::Parse(File::ReadAllText(baselinePath), &baseline, &error))
+                    writeline("warning: ignoring size baseline %s: %s", baselinePath.c_str(), error.c_str());
+                else
+                    hasBaseline = true;
+            }
+
+            if (!SizeReport::Check(version.first, parsed, hasBaseline ? &baseline : nullptr, options.sizeBudgetPath != "" ? &sizeBudget : nullptr))
+                overBudget = true;
+        }
+
+        for (auto &output : outputs)
+        {
+            auto kind = std::find_if(OutputKinds.begin(), OutputKinds.end(), [&](const OutputKind &kind)
+                                     { return output.first == kind.name; });
+            if (kind == OutputKinds.end())
+                continue;
+
+            if (kind->path == &BuildOptions::outputKamekMultiPath)
+                multiVersion.Add(version.first, std::vector<byte>(output.second.begin(), output.second.end()));
+            else
+            {
+                std::string path = VersionPath(options.*kind->path, version.first);
+                targets.push_back(path);
+                writer.Submit(path, std::move(output.second));
+            }
+        }
+    }
+    Stats::CurrentVersion = "";
+
+    if (options.outputKamekMultiPath != "")
+    {
+        std::vector<byte> container = multiVersion.Pack();
+        targets.push_back(options.outputKamekMultiPath);
+        writer.Submit(options.outputKamekMultiPath, std::string(container.begin(), container.end()));
+    }
+
+    if (options.depfilePath != "")
+        writer.SubmitText(options.depfilePath, MakeDepfile(targets, dependencies));
+
+    // wait for the last outputs to hit the disk
+    if (!writer.Finish())
+        reterr;
+    // the outputs (and reports) are still written, so the overage can be looked at
+    if (overBudget)
+        reterr;
+    return 0;
+}
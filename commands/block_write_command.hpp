@@ -0,0 +1,161 @@
+#include "common.hpp"
+#include "command.hpp"
+#include "write_command.hpp"
+
+// A run of unconditional writes to consecutive addresses, merged into one
+// command carrying their bytes. KamekFile::CoalesceWrites builds these out of
+// WriteCommands once everything that could be applied statically has been.
+//
+// In the loader binary it is command 39 (see Command::Ids), which older
+// loaders don't know; unless KamekFile::_loaderBlockWrites is set, Pack
+// writes it out as separate writes instead. The text formats and DOL
+// patching always take it as it is.
+class BlockWriteCommand : public Command
+{
+public:
+    std::vector<byte> Bytes;
+
+    BlockWriteCommand(Word address) : Command(Ids::WriteBlock, address) {}
+
+    // Whether a write can go into a block: it has to be unconditional, and its
+    // value has to be final already (the loader relocates pointers into the
+    // blob, so those stay as they are)
+    static bool CanMerge(WriteCommand *cmd)
+    {
+        if (cmd->Original.HasValue())
+            return false;
+        if (cmd->ValueType == WriteCommand::Type::Pointer)
+            return cmd->Value.IsAbsolute();
+        return cmd->Value.IsValue();
+    }
+
+    void Append(WriteCommand *cmd)
+    {
+        uint size = cmd->PatchSize();
+        for (uint i = 0; i < size; i++)
+            Bytes.push_back((byte)(cmd->Value.Value >> ((size - 1 - i) * 8)));
+    }
+
+    Word End()
+    {
+        return _Address + (long)Bytes.size();
+    }
+
+    // Splits the block into the widest naturally aligned writes (4, 2 or 1
+    // bytes), for the formats that can only write one value at a time
+    template <typename F>
+    void ForEachPiece(F &&callback)
+    {
+        for (size_t i = 0; i < Bytes.size();)
+        {
+            uint address = _Address.Value + (uint)i;
+            size_t left = Bytes.size() - i;
+            uint size = ((address & 3) == 0 && left >= 4) ? 4 : ((address & 1) == 0 && left >= 2) ? 2 : 1;
+
+            uint value = 0;
+            for (uint j = 0; j < size; j++)
+                value = (value << 8) | Bytes[i + j];
+            callback(address, size, value);
+            i += size;
+        }
+    }
+
+    void WriteArguments(BinaryWriter *bw) override
+    {
+        bw->WriteBE((uint)Bytes.size());
+        for (byte b : Bytes)
+            bw->Write(b);
+        for (size_t i = Bytes.size(); (i % 4) != 0; i++)
+            bw->Write((byte)0);
+    }
+    uint ArgumentsSize() override { return 4 + (((uint)Bytes.size() + 3) & ~3U); }
+    uint PatchSize() override { return (uint)Bytes.size(); }
+
+    void PackForRiivolution(std::string &output) override
+    {
+        _Address.AssertAbsolute();
+
+        std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='", _Address.Value);
+        for (byte b : Bytes)
+            std::format_to(std::back_inserter(output), "{0:02X}", b);
+        output += "' />\n";
+    }
+
+    void PackForDolphin(std::string &output) override
+    {
+        _Address.AssertAbsolute();
+
+        ForEachPiece([&](uint address, uint size, uint value)
+                     {
+            switch (size)
+            {
+            case 1:
+                std::format_to(std::back_inserter(output), "0x{0:08X}:byte:0x000000{1:02X}\n", address, value);
+                break;
+            case 2:
+                std::format_to(std::back_inserter(output), "0x{0:08X}:word:0x0000{1:04X}\n", address, value);
+                break;
+            default:
+                std::format_to(std::back_inserter(output), "0x{0:08X}:dword:0x{1:08X}\n", address, value);
+                break;
+            } });
+    }
+
+    static ulong PieceCode(uint address, uint size, uint value)
+    {
+        ulong code = ((ulong)(address & 0x1FFFFFF) << 32) | value;
+        if (size == 2)
+            code |= 0x2000000ULL << 32;
+        else if (size == 4)
+            code |= 0x4000000ULL << 32;
+        return code;
+    }
+
+    void PackGeckoCodes(std::vector<ulong> &codes) override
+    {
+        _Address.AssertAbsolute();
+        if (_Address.Value >= 0x90000000)
+            writeline("MEM2 writes not yet supported for gecko");
+
+        size_t pieces = 0;
+        ForEachPiece([&](uint, uint, uint)
+                     { pieces++; });
+
+        // A string write (06) costs a header line plus one line per 8 bytes;
+        // use it whenever that is shorter than one code per piece
+        size_t lines = 1 + ((Bytes.size() + 7) / 8);
+        if (lines >= pieces)
+        {
+            ForEachPiece([&](uint address, uint size, uint value)
+                         { codes.push_back(PieceCode(address, size, value)); });
+            return;
+        }
+
+        codes.push_back(((0x06000000ULL | (_Address.Value & 0x1FFFFFF)) << 32) | Bytes.size());
+        for (size_t i = 0; i < Bytes.size(); i += 8)
+        {
+            ulong bits = 0;
+            for (size_t j = 0; j < 8 && i + j < Bytes.size(); j++)
+                bits |= (ulong)Bytes[i + j] << (56 - (j * 8));
+            codes.push_back(bits);
+        }
+    }
+
+    void PackActionReplayCodes(std::vector<ulong> &codes) override
+    {
+        _Address.AssertAbsolute();
+        if (_Address.Value >= 0x90000000)
+            writeline("MEM2 writes not yet supported for action replay");
+
+        ForEachPiece([&](uint address, uint size, uint value)
+                     { codes.push_back(PieceCode(address, size, value)); });
+    }
+
+    void ApplyToDol(Dol *dol) override
+    {
+        _Address.AssertAbsolute();
+
+        for (size_t i = 0; i < Bytes.size(); i++)
+            dol->WriteByte(_Address.Value + (uint)i, Bytes[i]);
+    }
+};
@@ -17,31 +17,32 @@ public:
     {
         bw->WriteBE(Target.Value);
     }
+    uint ArgumentsSize() override { return 4; }
 
-    std::string PackForRiivolution() override
+    void PackForRiivolution(std::string &output) override
     {
-        return std::format("<memory offset=\'0x{0:8X}\' value=\'{1:8X}\' />", _Address.Value, GenerateInstruction());
+        std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='{1:08X}' />\n", _Address.Value, GenerateInstruction());
     }
 
-    std::string PackForDolphin() override
+    void PackForDolphin(std::string &output) override
     {
-        return std::format("0x{0:8X}:dword:0x{1:8X}", _Address.Value, GenerateInstruction());
+        std::format_to(std::back_inserter(output), "0x{0:08X}:dword:0x{1:08X}\n", _Address.Value, GenerateInstruction());
     }
 
-    std::vector<ulong> PackGeckoCodes() override
+    void PackGeckoCodes(std::vector<ulong> &codes) override
     {
         ulong code = ((ulong)(_Address.Value & 0x1FFFFFF) << 32) | GenerateInstruction();
         code |= 0x4000000ULL << 32;
 
-        return std::vector<ulong>({code});
+        codes.push_back(code);
     }
 
-    std::vector<ulong> PackActionReplayCodes() override
+    void PackActionReplayCodes(std::vector<ulong> &codes) override
     {
         ulong code = ((ulong)(_Address.Value & 0x1FFFFFF) << 32) | GenerateInstruction();
         code |= 0x4000000ULL << 32;
 
-        return std::vector<ulong>({code});
+        codes.push_back(code);
     }
 
     bool Apply(void *_f) override
@@ -68,6 +69,4 @@ public:
         insn |= ((uint)delta & 0x3FFFFFC);
         return insn;
     }
-
-    void CalculateAddress(void* f) {_Address = {WordType::AbsoluteAddr, 0};};
 };
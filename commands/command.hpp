@@ -7,6 +7,10 @@
 class Command
 {
 public:
+    // In the loader binary every command starts with its id and address (see
+    // KamekFile::WriteCommandHeader), followed by its arguments: the target
+    // for relocations and branches, the value for writes, and for conditional
+    // writes the original value after it
     enum Ids : byte
     {
         Null = 0,
@@ -27,11 +31,54 @@ public:
         CondWrite32 = 36,
         CondWrite16 = 37,
         CondWrite8 = 38,
+        // the length in bytes, then the bytes, padded to a multiple of 4; only
+        // packed with -loader-block-writes, as older loaders don't know it
+        WriteBlock = 39,
 
         Branch = 64,
         BranchLink = 65,
     };
 
+    static const char *IdName(Ids id)
+    {
+        switch (id)
+        {
+        case Ids::Null:
+            return "Null";
+        case Ids::Addr32:
+            return "Addr32/WritePointer";
+        case Ids::Addr16Lo:
+            return "Addr16Lo";
+        case Ids::Addr16Hi:
+            return "Addr16Hi";
+        case Ids::Addr16Ha:
+            return "Addr16Ha";
+        case Ids::Rel24:
+            return "Rel24";
+        case Ids::Write32:
+            return "Write32";
+        case Ids::Write16:
+            return "Write16";
+        case Ids::Write8:
+            return "Write8";
+        case Ids::CondWritePointer:
+            return "CondWritePointer";
+        case Ids::CondWrite32:
+            return "CondWrite32";
+        case Ids::CondWrite16:
+            return "CondWrite16";
+        case Ids::CondWrite8:
+            return "CondWrite8";
+        case Ids::WriteBlock:
+            return "WriteBlock";
+        case Ids::Branch:
+            return "Branch";
+        case Ids::BranchLink:
+            return "BranchLink";
+        }
+        return "Unknown";
+    }
+
     Ids Id;
 
     Word _Address;
@@ -43,13 +90,18 @@ public:
     }
 
     virtual void WriteArguments(BinaryWriter *bw){};
+    // How many bytes WriteArguments writes
+    virtual uint ArgumentsSize() { return 0; };
+    // How many bytes this patches, starting at _Address
+    virtual uint PatchSize() { return 4; };
     virtual bool Apply(void *file) { return false; };
-    virtual std::string PackForRiivolution() { return ""; };
-    virtual std::string PackForDolphin() { return ""; };
-    virtual std::vector<ulong> PackGeckoCodes() { return std::vector<ulong>(); };
-    virtual std::vector<ulong> PackActionReplayCodes() { return std::vector<ulong>(); };
+    // The packers append this command's lines (or codes) to the output being built
+    virtual void PackForRiivolution(std::string &output){};
+    virtual void PackForDolphin(std::string &output){};
+    virtual void PackGeckoCodes(std::vector<ulong> &codes){};
+    virtual void PackActionReplayCodes(std::vector<ulong> &codes){};
     virtual void ApplyToDol(Dol *dol){};
-    virtual void CalculateAddress(void *f) { _Address = {WordType::AbsoluteAddr, 0}; };
+    virtual void CalculateAddress(void *f){};
 
     void AssertAddressNonNull()
     {
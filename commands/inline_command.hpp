@@ -0,0 +1,259 @@
+#include "common.hpp"
+#include "command.hpp"
+#include "kamek_file_def.hpp"
+#include "stats.hpp"
+
+// Copies a short function from the blob over the game's code instead of
+// branching to it, so the game doesn't pay for the hop there and back.
+//
+// As a branch (kmInlineBranch), the whole function including its blr goes
+// over the start of the game function being replaced. As a call
+// (kmInlineCall), the hook's whole region is replaced: the body without its
+// blr goes at the start, execution carries on after it, and the rest of the
+// region is filled with nops.
+//
+// Either way it falls back to the plain branch whenever inlining isn't
+// possible: a dynamic link, a body larger than the region the hook allows,
+// an outside branch the new location can't reach, or code that needs to
+// know where it is running. A call still replaces its region then: the bl
+// comes first, followed by the same nops, so the game instructions in the
+// region never run whichever way it went.
+class InlineCommand : public BranchCommand
+{
+public:
+    static constexpr uint Blr = 0x4E800020;
+    static constexpr uint Nop = 0x60000000;
+
+    uint MaxBytes;
+
+    std::vector<uint> _words; // empty if this ended up as a branch
+    uint _fillBytes = 0;      // nops after the branch, if a call fell back to one
+
+    InlineCommand(Word source, Word target, bool isLink, uint maxBytes)
+        : BranchCommand(source, target, isLink)
+    {
+        MaxBytes = maxBytes & ~3U;
+    }
+
+    // What goes over the game's code; empty until Resolve has run, and if it
+    // fell back to a branch
+    const std::vector<uint> &Words() const
+    {
+        return _words;
+    }
+
+    // Decides whether to inline, once the blob's own relocations have been
+    // applied; KamekFile::ResolveInlines runs this for every inline hook
+    void Resolve(KamekFile *file)
+    {
+        std::string reason;
+        if (Inline(file, &reason))
+        {
+            Stats::Count("hooks.inlined");
+            return;
+        }
+
+        writeline("warning: cannot inline the function at 0x%08X into 0x%08X (%s); branching to it instead", Target.Value, _Address.Value, reason.c_str());
+        _words.clear();
+
+        // the rest of a call's region goes all the same, up to whatever else
+        // patches it
+        if (Id == Ids::BranchLink && _Address.IsAbsolute())
+        {
+            uint end = _Address.Value + std::max(MaxBytes, 4U);
+            auto other = file->_commands.upper_bound(_Address);
+            if (other != file->_commands.end() && other->first.Type == _Address.Type && other->first.Value < end)
+                end = std::max(other->first.Value & ~3U, _Address.Value + 4);
+            _fillBytes = end - (_Address.Value + 4);
+        }
+    }
+
+    // The addresses of the nops that follow the branch when a call couldn't
+    // be inlined
+    template <typename F>
+    void ForEachFill(F &&callback)
+    {
+        for (uint offset = 0; offset < _fillBytes; offset += 4)
+            callback(_Address.Value + 4 + offset);
+    }
+
+    bool Inline(KamekFile *file, std::string *reason)
+    {
+        bool isLink = (Id == Ids::BranchLink);
+        if (file == nullptr || !file->_baseAddress.IsAbsolute())
+        {
+            *reason = "only static links can inline";
+            return false;
+        }
+        if (!_Address.IsAbsolute() || file->Contains(_Address) || !Target.IsAbsolute() || !file->Contains(Target))
+        {
+            *reason = "the function has to be in the blob and the hook in game code";
+            return false;
+        }
+
+        uint size = file->QuerySymbolSize(Target);
+        if (size < 4 || (size % 4) != 0 || !file->Contains(Target + (size - 4)) || file->ReadUInt32(Target + (size - 4)) != Blr)
+        {
+            *reason = "the function's size is unknown, or it doesn't end in blr";
+            return false;
+        }
+
+        uint length = isLink ? size - 4 : size;
+        if (length > MaxBytes)
+        {
+            *reason = std::format("the body is {0} bytes and the hook allows {1}", length, MaxBytes);
+            return false;
+        }
+
+        // nothing else may patch the instructions this will overwrite: not
+        // the next command, nor the one before reaching into them (a block
+        // write can start well before the hook)
+        uint region = isLink ? std::max(MaxBytes, 4U) : std::max(length, 4U);
+        auto other = file->_commands.upper_bound(_Address);
+        if (other != file->_commands.end() && other->first.Type == _Address.Type && other->first.Value < _Address.Value + region)
+        {
+            *reason = "another hook patches the same instructions";
+            return false;
+        }
+        auto self = file->_commands.find(_Address);
+        if (self != file->_commands.begin())
+        {
+            Command *before = std::prev(self)->second;
+            if (before->_Address.Type == _Address.Type && before->_Address.Value + before->PatchSize() > _Address.Value)
+            {
+                *reason = "another hook patches the same instructions";
+                return false;
+            }
+        }
+
+        for (uint i = 0; i < length; i += 4)
+        {
+            uint insn = file->ReadUInt32(Target + i);
+            uint opcode = insn >> 26;
+            uint from = Target.Value + i, to = _Address.Value + i;
+
+            if (isLink && (insn & 0xFC0007FE) == 0x4C000020)
+            {
+                *reason = "it returns partway through";
+                return false;
+            }
+            if (insn == 0x429F0005) // bcl 20,31,$+4, for reading the PC
+            {
+                *reason = "it reads its own address";
+                return false;
+            }
+
+            // Relative branches out of the body have to be re-aimed from the
+            // new location; the ones within it can stay as they are
+            bool relative = ((insn & 2) == 0) && (opcode == 18 || opcode == 16);
+            if (relative)
+            {
+                uint mask = (opcode == 18) ? 0x3FFFFFC : 0xFFFC;
+                int range = (opcode == 18) ? 0x2000000 : 0x8000;
+                int displacement = (int)(insn & mask);
+                if (displacement & range)
+                    displacement -= range * 2;
+
+                uint dest = from + displacement;
+                if (dest - Target.Value >= size)
+                {
+                    int moved = (int)(dest - to);
+                    if (moved < -range || moved >= range)
+                    {
+                        *reason = std::format("a branch to 0x{0:08X} is out of range from the game", dest);
+                        return false;
+                    }
+                    insn = (insn & ~mask) | ((uint)moved & mask);
+                }
+            }
+            _words.push_back(insn);
+        }
+
+        // a call's region is replaced whole
+        while (isLink && _words.size() * 4 < region)
+            _words.push_back(Nop);
+        return true;
+    }
+
+    uint PatchSize() override
+    {
+        return _words.empty() ? 4 + _fillBytes : (uint)_words.size() * 4;
+    }
+
+    void PackForRiivolution(std::string &output) override
+    {
+        if (Words().empty())
+        {
+            BranchCommand::PackForRiivolution(output);
+            if (_fillBytes > 0)
+            {
+                std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='", _Address.Value + 4);
+                ForEachFill([&](uint)
+                            { output += "60000000"; });
+                output += "' />\n";
+            }
+            return;
+        }
+
+        std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='", _Address.Value);
+        for (uint word : _words)
+            std::format_to(std::back_inserter(output), "{0:08X}", word);
+        output += "' />\n";
+    }
+
+    void PackForDolphin(std::string &output) override
+    {
+        if (Words().empty())
+        {
+            BranchCommand::PackForDolphin(output);
+            ForEachFill([&](uint address)
+                        { std::format_to(std::back_inserter(output), "0x{0:08X}:dword:0x{1:08X}\n", address, Nop); });
+            return;
+        }
+
+        for (size_t i = 0; i < _words.size(); i++)
+            std::format_to(std::back_inserter(output), "0x{0:08X}:dword:0x{1:08X}\n", _Address.Value + (uint)(i * 4), _words[i]);
+    }
+
+    void PackGeckoCodes(std::vector<ulong> &codes) override
+    {
+        if (Words().empty())
+        {
+            BranchCommand::PackGeckoCodes(codes);
+            ForEachFill([&](uint address)
+                        { codes.push_back(((ulong)((address & 0x1FFFFFF) | 0x4000000) << 32) | Nop); });
+            return;
+        }
+
+        for (size_t i = 0; i < _words.size(); i++)
+            codes.push_back(((ulong)(((_Address.Value + i * 4) & 0x1FFFFFF) | 0x4000000) << 32) | _words[i]);
+    }
+
+    void PackActionReplayCodes(std::vector<ulong> &codes) override
+    {
+        if (Words().empty())
+        {
+            BranchCommand::PackActionReplayCodes(codes);
+            ForEachFill([&](uint address)
+                        { codes.push_back(((ulong)((address & 0x1FFFFFF) | 0x4000000) << 32) | Nop); });
+            return;
+        }
+
+        for (size_t i = 0; i < _words.size(); i++)
+            codes.push_back(((ulong)(((_Address.Value + i * 4) & 0x1FFFFFF) | 0x4000000) << 32) | _words[i]);
+    }
+
+    void ApplyToDol(Dol *dol) override
+    {
+        if (Words().empty())
+        {
+            BranchCommand::ApplyToDol(dol);
+            ForEachFill([&](uint address)
+                        { dol->WriteUInt32(address, Nop); });
+            return;
+        }
+
+        for (size_t i = 0; i < _words.size(); i++)
+            dol->WriteUInt32(_Address.Value + (uint)(i * 4), _words[i]);
+    }
+};
@@ -20,6 +20,7 @@ public:
         Target.AssertNotAmbiguous();
         bw->WriteBE(Target.Value);
     }
+    uint ArgumentsSize() override { return 4; }
 
     void CalculateAddress(void *_f) override
     {
@@ -29,12 +30,12 @@ public:
         auto functionSize = file->QuerySymbolSize(FunctionStart);
         if (functionSize < 4)
         {
-            writeline("Function too small!");
+            writeline("Function %s too small!", file->_symbolIndex->Describe(FunctionStart).c_str());
         }
         auto functionEnd = FunctionStart + (functionSize - 4);
         if (file->ReadUInt32(functionEnd) != 0x4E800020)
         {
-            writeline("Function does not end in blr");
+            writeline("Function %s does not end in blr", file->_symbolIndex->Describe(FunctionStart).c_str());
         }
 
         // Just to be extra sure, are there any other returns in this function?
@@ -43,17 +44,17 @@ public:
             auto insn = file->ReadUInt32(check);
             if ((insn & 0xFC00FFFF) == 0x4C000020)
             {
-                writeline("Function contains a return partway through");
+                writeline("Function %s contains a return partway through, at %s", file->_symbolIndex->Describe(FunctionStart).c_str(), file->_symbolIndex->Describe(check).c_str());
             }
         }
 
         _Address = functionEnd;
     }
 
-    std::string PackForRiivolution() { return ""; };
-    std::string PackForDolphin() { return ""; };
-    std::vector<ulong> PackGeckoCodes() { return std::vector<ulong>(); };
-    std::vector<ulong> PackActionReplayCodes() { return std::vector<ulong>(); };
+    void PackForRiivolution(std::string &output) override {};
+    void PackForDolphin(std::string &output) override {};
+    void PackGeckoCodes(std::vector<ulong> &codes) override {};
+    void PackActionReplayCodes(std::vector<ulong> &codes) override {};
     void ApplyToDol(Dol *dol) {};
 
     bool Apply(void *_f) override
@@ -19,12 +19,12 @@ public:
         Target.AssertNotAmbiguous();
         bw->WriteBE(Target.Value);
     }
+    uint ArgumentsSize() override { return 4; }
 
-    std::string PackForRiivolution() { return ""; };
-    std::string PackForDolphin() { return ""; };
-    std::vector<ulong> PackGeckoCodes() { return std::vector<ulong>(); };
-    std::vector<ulong> PackActionReplayCodes() { return std::vector<ulong>(); };
-    void CalculateAddress(void *f) { _Address = {WordType::AbsoluteAddr, 0}; };
+    void PackForRiivolution(std::string &output) override {};
+    void PackForDolphin(std::string &output) override {};
+    void PackGeckoCodes(std::vector<ulong> &codes) override {};
+    void PackActionReplayCodes(std::vector<ulong> &codes) override {};
 
     void ApplyToDol(Dol *dol) override
     {
@@ -79,8 +79,10 @@ public:
             bw->WriteBE(Original.Value);
         }
     }
+    uint ArgumentsSize() override { return Original.HasValue() ? 8 : 4; }
+    uint PatchSize() override { return (ValueType == Type::Value8) ? 1 : (ValueType == Type::Value16) ? 2 : 4; }
 
-    std::string PackForRiivolution() override
+    void PackForRiivolution(std::string &output) override
     {
         _Address.AssertAbsolute();
         if (ValueType == Type::Pointer)
@@ -95,12 +97,15 @@ public:
             switch (ValueType)
             {
             case Type::Value8:
-                return std::format("<memory offset='0x{0:8X}' value='{1:2X}' original='{2:2X}' />", _Address.Value, Value.Value, Original.Value);
+                std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='{1:02X}' original='{2:02X}' />\n", _Address.Value, Value.Value, Original.Value);
+                break;
             case Type::Value16:
-                return std::format("<memory offset='0x{0:8X}' value='{1:4X}' original='{2:4X}' />", _Address.Value, Value.Value, Original.Value);
+                std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='{1:04X}' original='{2:04X}' />\n", _Address.Value, Value.Value, Original.Value);
+                break;
             case Type::Value32:
             case Type::Pointer:
-                return std::format("<memory offset='0x{0:8X}' value='{1:8X}' original='{2:8X}' />", _Address.Value, Value.Value, Original.Value);
+                std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='{1:08X}' original='{2:08X}' />\n", _Address.Value, Value.Value, Original.Value);
+                break;
             }
         }
         else
@@ -108,19 +113,20 @@ public:
             switch (ValueType)
             {
             case Type::Value8:
-                return std::format("<memory offset='0x{0:8X}' value='{1:2X}' />", _Address.Value, Value.Value);
+                std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='{1:02X}' />\n", _Address.Value, Value.Value);
+                break;
             case Type::Value16:
-                return std::format("<memory offset='0x{0:8X}' value='{1:4X}' />", _Address.Value, Value.Value);
+                std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='{1:04X}' />\n", _Address.Value, Value.Value);
+                break;
             case Type::Value32:
             case Type::Pointer:
-                return std::format("<memory offset='0x{0:8X}' value='{1:8X}' />", _Address.Value, Value.Value);
+                std::format_to(std::back_inserter(output), "<memory offset='0x{0:08X}' value='{1:08X}' />\n", _Address.Value, Value.Value);
+                break;
             }
         }
-
-        return "";
     }
 
-    std::string PackForDolphin() override
+    void PackForDolphin(std::string &output) override
     {
         _Address.AssertAbsolute();
         if (ValueType == Type::Pointer)
@@ -131,18 +137,19 @@ public:
         switch (ValueType)
         {
         case Type::Value8:
-            return std::format("0x{0:8X}:byte:0x000000{1:2X}", _Address.Value, Value.Value);
+            std::format_to(std::back_inserter(output), "0x{0:08X}:byte:0x000000{1:02X}\n", _Address.Value, Value.Value);
+            break;
         case Type::Value16:
-            return std::format("0x{0:8X}:word:0x0000{1:4X}", _Address.Value, Value.Value);
+            std::format_to(std::back_inserter(output), "0x{0:08X}:word:0x0000{1:04X}\n", _Address.Value, Value.Value);
+            break;
         case Type::Value32:
         case Type::Pointer:
-            return std::format("0x{0:8X}:dword:0x{1:8X}", _Address.Value, Value.Value);
+            std::format_to(std::back_inserter(output), "0x{0:08X}:dword:0x{1:08X}\n", _Address.Value, Value.Value);
+            break;
         }
-
-        return "";
     }
 
-    std::vector<ulong> PackGeckoCodes() override
+    void PackGeckoCodes(std::vector<ulong> &codes) override
     {
         _Address.AssertAbsolute();
         if (ValueType == Type::Pointer)
@@ -193,7 +200,7 @@ public:
                 uint inst7 = 0x98030000;           // stb r0, 0(r3)
                 uint inst8 = 0x4E800020;           // @end: blr
 
-                return std::vector<ulong>({(0xC0000000ULL << 32) | 4, // "4" for four lines of instruction data below
+                codes.insert(codes.end(), {(0xC0000000ULL << 32) | 4, // "4" for four lines of instruction data below
                                            ((ulong)inst1 << 32) | inst2,
                                            ((ulong)inst3 << 32) | inst4,
                                            ((ulong)inst5 << 32) | inst6,
@@ -218,16 +225,16 @@ public:
 
                 ulong if_end = 0xE2000001ULL << 32;
 
-                return std::vector<ulong>({if_start, code, if_end});
+                codes.insert(codes.end(), {if_start, code, if_end});
             }
         }
         else
         {
-            return std::vector<ulong>({code});
+            codes.push_back(code);
         }
     }
 
-    std::vector<ulong> PackActionReplayCodes() override
+    void PackActionReplayCodes(std::vector<ulong> &codes) override
     {
         _Address.AssertAbsolute();
         if (ValueType == Type::Pointer)
@@ -272,11 +279,11 @@ public:
                 break;
             }
 
-            return std::vector<ulong>({if_start, code});
+            codes.insert(codes.end(), {if_start, code});
         }
         else
         {
-            return std::vector<ulong>({code});
+            codes.push_back(code);
         }
     }
 
@@ -327,6 +334,4 @@ public:
     {
         return false;
     }
-
-    void CalculateAddress(void *f) { _Address = {WordType::AbsoluteAddr, 0}; };
 };
@@ -1,11 +1,23 @@
 #pragma once
 
+#include <cstddef>
 #include "common.hpp"
 #include "util.hpp"
+#include "endian.hpp"
 
 class Dol
 {
 public:
+    // The 0x100-byte header at the start of every DOL: 7 text and 11 data sections
+    struct DolHeader
+    {
+        be<uint> sectionOffsets[18];
+        be<uint> sectionAddresses[18];
+        be<uint> sectionSizes[18];
+        be<uint> bssAddress, bssSize, entryPoint;
+        byte padding[0x1C];
+    };
+
     struct Section
     {
         uint LoadAddress;
@@ -31,52 +43,72 @@ public:
         delete[] Sections;
     }
 
+    // Whether a buffer of this length holds a complete DOL header and sections
+    static bool IsValid(const byte *input, size_t length)
+    {
+        if (length < sizeof(DolHeader))
+            return false;
+
+        const DolHeader *header = (const DolHeader *)input;
+        for (int i = 0; i < 18; i++)
+        {
+            if ((uint64_t)header->sectionOffsets[i] + header->sectionSizes[i] > length)
+                return false;
+        }
+        return true;
+    }
+
+    // The sections are views into the input, so patches are applied to it in place
     Dol(byte *input)
     {
         Sections = new Section[18];
-        BinaryReader *br = new BinaryReader(input);
-
-        uint *fields = new uint[3 * 18];
-        for (int i = 0; i < 3 * 18; i++)
-            fields[i] = br->ReadBigUInt32();
+        const DolHeader *header = (const DolHeader *)input;
 
         for (int i = 0; i < 18; i++)
         {
-            uint fileOffset = fields[i];
-            uint size = fields[36 + i];
-            Sections[i].LoadAddress = fields[18 + i];
-            Sections[i].Data = new sized_array(br->ReadBytes((int)size), size);
+            uint size = header->sectionSizes[i];
+            Sections[i].LoadAddress = header->sectionAddresses[i];
+            Sections[i].Data = new sized_array(input + header->sectionOffsets[i], size);
         }
 
-        BssAddress = br->ReadBigUInt32();
-        BssSize = br->ReadBigUInt32();
-        EntryPoint = br->ReadBigUInt32();
+        BssAddress = header->bssAddress;
+        BssSize = header->bssSize;
+        EntryPoint = header->entryPoint;
+    }
+
+    // How many bytes Write will produce
+    uint64_t Size()
+    {
+        uint64_t size = sizeof(DolHeader);
+        for (int i = 0; i < 18; i++)
+            size += (Sections[i].Data->length + 0x1F) & ~0x1F;
+        return size;
     }
 
     uint64_t Write(byte *output)
     {
-        auto bw = new BinaryWriter(output);
+        BinaryWriter writer(output);
+        BinaryWriter *bw = &writer;
 
         // Generate the header
-        auto fields = new uint[3 * 18];
-        uint position = 0x100;
+        DolHeader header = {};
+        uint position = sizeof(DolHeader);
         for (int i = 0; i < 18; i++)
         {
             if (Sections[i].Data->length > 0)
             {
-                fields[i] = position;
-                fields[i + 18] = Sections[i].LoadAddress;
-                fields[i + 36] = (uint)Sections[i].Data->length;
+                header.sectionOffsets[i] = position;
+                header.sectionAddresses[i] = Sections[i].LoadAddress;
+                header.sectionSizes[i] = (uint)Sections[i].Data->length;
                 position += (uint)((Sections[i].Data->length + 0x1F) & ~0x1F);
             }
         }
+        header.bssAddress = BssAddress;
+        header.bssSize = BssSize;
+        header.entryPoint = EntryPoint;
 
-        for (int i = 0; i < (3 * 18); i++)
-            bw->WriteBE(fields[i]);
-        bw->WriteBE(BssAddress);
-        bw->WriteBE(BssSize);
-        bw->WriteBE(EntryPoint);
-        bw->Write(new sized_array(0x100 - 0xE4));
+        sized_array headerBytes((byte *)&header, sizeof(DolHeader));
+        bw->Write(&headerBytes);
 
         // Write all sections
         for (int i = 0; i < 18; i++)
@@ -86,7 +118,10 @@ public:
             int paddedLength = ((Sections[i].Data->length + 0x1F) & ~0x1F);
             int padding = paddedLength - Sections[i].Data->length;
             if (padding > 0)
-                bw->Write(new sized_array(padding));
+            {
+                sized_array sectionPadding(padding);
+                bw->Write(&sectionPadding);
+            }
         }
 
         return bw->position;
@@ -94,7 +129,7 @@ public:
 
     bool ResolveAddress(uint address, int* sectionID, uint* offset)
     {
-        for (int i = 0; i < Sections->Data->length; i++)
+        for (int i = 0; i < 18; i++)
         {
             if (address >= Sections[i].LoadAddress && address < Sections[i].EndAddress())
             {
@@ -168,4 +203,8 @@ public:
 
         Sections[sectionID].Data->data[offset] = value;
     }
-};
\ No newline at end of file
+};
+
+static_assert(sizeof(Dol::DolHeader) == 0x100);
+static_assert(offsetof(Dol::DolHeader, sectionAddresses) == 0x48 && offsetof(Dol::DolHeader, sectionSizes) == 0x90);
+static_assert(offsetof(Dol::DolHeader, bssAddress) == 0xD8 && offsetof(Dol::DolHeader, entryPoint) == 0xE0);
@@ -1,11 +1,94 @@
 #pragma once
 
+#include <cstddef>
 #include "common.hpp"
 #include "util.hpp"
+#include "arena.hpp"
+#include "endian.hpp"
 
 class Elf
 {
 public:
+    // The structures as they are laid out in the file. They can be overlaid
+    // directly on the object's bytes; fields are converted when read.
+    struct Elf32_Ehdr
+    {
+        be<uint> ei_mag;
+        byte ei_class, ei_data, ei_version, ei_osabi, ei_abiversion;
+        byte ei_pad[7];
+        be<ushort> e_type, e_machine;
+        be<uint> e_version, e_entry, e_phoff, e_shoff, e_flags;
+        be<ushort> e_ehsize, e_phentsize, e_phnum, e_shentsize, e_shnum, e_shstrndx;
+    };
+
+    struct Elf32_Shdr
+    {
+        be<uint> sh_name, sh_type, sh_flags, sh_addr, sh_offset, sh_size;
+        be<uint> sh_link, sh_info, sh_addralign, sh_entsize;
+    };
+
+    struct Elf32_Sym
+    {
+        be<uint> st_name, st_value, st_size;
+        byte st_info, st_other;
+        be<ushort> st_shndx;
+    };
+
+    struct Elf32_Rela
+    {
+        be<uint> r_offset, r_info;
+        be<int> r_addend;
+    };
+
+    // Host-order copies of the symbol and relocation tables, for loops that
+    // visit every entry; see DecodeSymbols and DecodeRelas
+    struct Symbol
+    {
+        uint st_name, st_value, st_size;
+        byte st_info, st_other;
+        ushort st_shndx;
+    };
+
+    struct Rela
+    {
+        uint r_offset, r_info;
+        int r_addend;
+    };
+
+    // Byte-swaps a whole symbol table in one pass: one 16-byte shuffle per symbol
+    static std::vector<Symbol> DecodeSymbols(const sized_array *symtab)
+    {
+        static const byte SwapSymbol[16] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 12, 13, 15, 14};
+
+        std::vector<Symbol> symbols(symtab->length / sizeof(Elf32_Sym));
+        if constexpr (Endian::HostIsBig)
+            memcpy(symbols.data(), symtab->data, symbols.size() * sizeof(Symbol));
+        else if constexpr (Endian::HasShuffle)
+            Endian::ShuffleBlocks(symtab->data, (byte *)symbols.data(), symbols.size(), SwapSymbol);
+        else
+        {
+            const Elf32_Sym *raw = (const Elf32_Sym *)symtab->data;
+            for (size_t i = 0; i < symbols.size(); i++)
+            {
+                symbols[i].st_name = Endian::Load<uint>(raw[i].st_name.bytes);
+                symbols[i].st_value = Endian::Load<uint>(raw[i].st_value.bytes);
+                symbols[i].st_size = Endian::Load<uint>(raw[i].st_size.bytes);
+                symbols[i].st_info = raw[i].st_info;
+                symbols[i].st_other = raw[i].st_other;
+                symbols[i].st_shndx = Endian::Load<ushort>(raw[i].st_shndx.bytes);
+            }
+        }
+        return symbols;
+    }
+
+    // Relocations are nothing but 32-bit words, so they decode as a flat run of them
+    static std::vector<Rela> DecodeRelas(const sized_array *relocs)
+    {
+        std::vector<Rela> relas(relocs->length / sizeof(Elf32_Rela));
+        Endian::DecodeWords(relocs->data, (uint *)relas.data(), relas.size() * 3);
+        return relas;
+    }
+
     class ElfHeader
     {
     public:
@@ -15,50 +98,48 @@ public:
         uint e_version, e_entry, e_phoff, e_shoff, e_flags;
         ushort e_ehsize, e_phentsize, e_phnum, e_shentsize, e_shnum, e_shstrndx;
 
-        static ElfHeader *Read(BinaryReader *reader)
+        static ElfHeader Read(const Elf32_Ehdr *raw)
         {
-            ElfHeader *h = new ElfHeader();
+            ElfHeader header;
+            ElfHeader *h = &header;
 
-            h->ei_mag = reader->ReadBigUInt32();
+            h->ei_mag = raw->ei_mag;
             if (h->ei_mag != 0x7F454C46) // "\x7F" "ELF"
                 writeline("Incorrect ELF header");
 
-            h->ei_class = reader->ReadByte();
+            h->ei_class = raw->ei_class;
             if (h->ei_class != 1)
                 writeline("Only 32-bit ELF files are supported");
 
-            h->ei_data = reader->ReadByte();
+            h->ei_data = raw->ei_data;
             if (h->ei_data != 2)
                 writeline("Only big-endian ELF files are supported");
 
-            h->ei_version = reader->ReadByte();
+            h->ei_version = raw->ei_version;
             if (h->ei_version != 1)
                 writeline("Only ELF version 1 is supported [a]");
 
-            h->ei_osabi = reader->ReadByte();
-            h->ei_abiversion = reader->ReadByte();
+            h->ei_osabi = raw->ei_osabi;
+            h->ei_abiversion = raw->ei_abiversion;
 
-            // reader->BaseStream.Seek(7, SeekOrigin.Current);
-            reader->position += 7;
-
-            h->e_type = reader->ReadBigUInt16();
-            h->e_machine = reader->ReadBigUInt16();
-            h->e_version = reader->ReadBigUInt32();
+            h->e_type = raw->e_type;
+            h->e_machine = raw->e_machine;
+            h->e_version = raw->e_version;
             if (h->e_version != 1)
                 writeline("Only ELF version 1 is supported [b]");
 
-            h->e_entry = reader->ReadBigUInt32();
-            h->e_phoff = reader->ReadBigUInt32();
-            h->e_shoff = reader->ReadBigUInt32();
-            h->e_flags = reader->ReadBigUInt32();
-            h->e_ehsize = reader->ReadBigUInt16();
-            h->e_phentsize = reader->ReadBigUInt16();
-            h->e_phnum = reader->ReadBigUInt16();
-            h->e_shentsize = reader->ReadBigUInt16();
-            h->e_shnum = reader->ReadBigUInt16();
-            h->e_shstrndx = reader->ReadBigUInt16();
-
-            return h;
+            h->e_entry = raw->e_entry;
+            h->e_phoff = raw->e_phoff;
+            h->e_shoff = raw->e_shoff;
+            h->e_flags = raw->e_flags;
+            h->e_ehsize = raw->e_ehsize;
+            h->e_phentsize = raw->e_phentsize;
+            h->e_phnum = raw->e_phnum;
+            h->e_shentsize = raw->e_shentsize;
+            h->e_shnum = raw->e_shnum;
+            h->e_shstrndx = raw->e_shstrndx;
+
+            return header;
         }
     };
 
@@ -105,37 +186,25 @@ public:
 
         std::string name;
 
-        sized_array *data;
+        // view into the object file's bytes
+        sized_array *data = nullptr;
 
-        ~ElfSection()
+        static ElfSection *Read(const Elf32_Shdr *raw, byte *file, Arena *arena)
         {
-            delete data;
-        }
-
-        static ElfSection *Read(BinaryReader *reader)
-        {
-            ElfSection *s = new ElfSection();
-
-            s->sh_name = reader->ReadBigUInt32();
-            s->sh_type = (Type)reader->ReadBigUInt32();
-            s->sh_flags = (Flags)reader->ReadBigUInt32();
-            s->sh_addr = reader->ReadBigUInt32();
-            uint sh_offset = reader->ReadBigUInt32();
-            s->sh_size = reader->ReadBigUInt32();
-            s->sh_link = reader->ReadBigUInt32();
-            s->sh_info = reader->ReadBigUInt32();
-            s->sh_addralign = reader->ReadBigUInt32();
-            s->sh_entsize = reader->ReadBigUInt32();
+            ElfSection *s = arena->New<ElfSection>();
+
+            s->sh_name = raw->sh_name;
+            s->sh_type = (Type)raw->sh_type.get();
+            s->sh_flags = (Flags)raw->sh_flags.get();
+            s->sh_addr = raw->sh_addr;
+            s->sh_size = raw->sh_size;
+            s->sh_link = raw->sh_link;
+            s->sh_info = raw->sh_info;
+            s->sh_addralign = raw->sh_addralign;
+            s->sh_entsize = raw->sh_entsize;
 
             if (s->sh_type != Type::SHT_NULL && s->sh_type != Type::SHT_NOBITS)
-            {
-                long savePos = reader->position;
-                reader->position = sh_offset;
-
-                s->data = new sized_array(reader->data + reader->position, s->sh_size);
-
-                reader->position = savePos;
-            }
+                s->data = arena->New<sized_array>(file + raw->sh_offset, s->sh_size);
 
             return s;
         }
@@ -166,33 +235,41 @@ public:
         R_PPC_ADDR16_LO = 4,
         R_PPC_ADDR16_HI = 5,
         R_PPC_ADDR16_HA = 6,
-        R_PPC_REL24 = 10
+        R_PPC_REL24 = 10,
+
+        // offsets from the small data bases in r13 and r2; see Linker::ApplySmallDataReloc
+        R_PPC_SDAREL16 = 32,
+        R_PPC_EMB_SDA2REL = 108,
+        R_PPC_EMB_SDA21 = 109
     };
 
-    ElfHeader *_header;
+    ElfHeader _header;
+    // where this module came from, for diagnostics
+    std::string _name;
 
+    // owns the sections; their data stays a view into the caller's input,
+    // which has to outlive this object
+    Arena _arena{4 * 1024};
     std::vector<ElfSection *> _sections;
 
     Elf(unsigned char *input)
     {
-        BinaryReader *reader = new BinaryReader(input);
-
-        _header = ElfHeader::Read(reader);
+        _header = ElfHeader::Read((const Elf32_Ehdr *)input);
 
-        if (_header->e_type != 1)
+        if (_header.e_type != 1)
             writeline("Only relocatable objects are supported");
-        if (_header->e_machine != 0x14)
+        if (_header.e_machine != 0x14)
             writeline("Only PowerPC is supported");
-            
-        input += _header->e_shoff;
-        for (int i = 0; i < _header->e_shnum; i++)
+
+        const Elf32_Shdr *headers = (const Elf32_Shdr *)(input + _header.e_shoff);
+        for (int i = 0; i < _header.e_shnum; i++)
         {
-            _sections.push_back(ElfSection::Read(reader));
+            _sections.push_back(ElfSection::Read(&headers[i], input, &_arena));
         }
 
-        if (_header->e_shstrndx > 0 && _header->e_shstrndx < _sections.size())
+        if (_header.e_shstrndx > 0 && _header.e_shstrndx < _sections.size())
         {
-            ElfSection *section = _sections[_header->e_shstrndx];
+            ElfSection *section = _sections[_header.e_shstrndx];
             sized_array *table = section->data;
 
             for (int i = 0; i < _sections.size(); i++)
@@ -201,4 +278,46 @@ public:
             }
         }
     }
-};
\ No newline at end of file
+
+    // Names of the global and weak symbols this module defines, and of the
+    // ones it references without defining; used to decide which archive
+    // members a link needs before any of them are linked
+    void ListGlobalSymbols(std::vector<std::string> *defined, std::vector<std::string> *undefined) const
+    {
+        for (ElfSection *symtab : _sections)
+        {
+            if (symtab->sh_type != ElfSection::Type::SHT_SYMTAB || symtab->data == nullptr)
+                continue;
+            if (symtab->sh_link <= 0 || symtab->sh_link >= _sections.size() || _sections[symtab->sh_link]->data == nullptr)
+                continue;
+
+            sized_array *strtab = _sections[symtab->sh_link]->data;
+            const Elf32_Sym *symbols = (const Elf32_Sym *)symtab->data->data;
+            uint count = symtab->data->length / sizeof(Elf32_Sym);
+
+            // always ignore the first symbol
+            for (uint i = 1; i < count; i++)
+            {
+                uint bind = symbols[i].st_info >> 4;
+                if (bind != SymBind::STB_GLOBAL && bind != SymBind::STB_WEAK)
+                    continue;
+
+                std::string name = Util::ExtractNullTerminatedString(strtab->data, strtab->length, (int)symbols[i].st_name);
+                if (name.length() == 0)
+                    continue;
+
+                ushort st_shndx = symbols[i].st_shndx;
+                (st_shndx == 0 ? undefined : defined)->push_back(name);
+            }
+        }
+    }
+};
+
+static_assert(sizeof(Elf::Elf32_Ehdr) == 52 && offsetof(Elf::Elf32_Ehdr, e_type) == 16 && offsetof(Elf::Elf32_Ehdr, e_shoff) == 32 && offsetof(Elf::Elf32_Ehdr, e_shstrndx) == 50);
+static_assert(sizeof(Elf::Elf32_Shdr) == 40 && offsetof(Elf::Elf32_Shdr, sh_offset) == 16 && offsetof(Elf::Elf32_Shdr, sh_entsize) == 36);
+static_assert(sizeof(Elf::Elf32_Sym) == 16 && offsetof(Elf::Elf32_Sym, st_info) == 12 && offsetof(Elf::Elf32_Sym, st_shndx) == 14);
+static_assert(sizeof(Elf::Elf32_Rela) == 12 && offsetof(Elf::Elf32_Rela, r_addend) == 8);
+
+// the decoders rely on the host copies lining up field for field with the file layout
+static_assert(sizeof(Elf::Symbol) == sizeof(Elf::Elf32_Sym) && offsetof(Elf::Symbol, st_info) == 12 && offsetof(Elf::Symbol, st_shndx) == 14);
+static_assert(sizeof(Elf::Rela) == sizeof(Elf::Elf32_Rela) && offsetof(Elf::Rela, r_addend) == 8);
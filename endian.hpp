@@ -0,0 +1,126 @@
+#pragma once
+
+#include <bit>
+#include <type_traits>
+#include <string.h>
+#include "common.hpp"
+
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>
+#define KAMEK_SIMD_SSSE3
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define KAMEK_SIMD_NEON
+#endif
+
+// A big-endian integer as it is stored in a file. It has no alignment
+// requirement, so structs built out of these can be laid directly over the
+// file's bytes and read field by field; conversion happens on access.
+template <typename T>
+struct be
+{
+    static_assert(std::is_integral_v<T>, "be<T> only holds integers");
+
+    byte bytes[sizeof(T)];
+
+    constexpr T get() const
+    {
+        std::make_unsigned_t<T> value = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+            value = (std::make_unsigned_t<T>)((value << 8) | bytes[i]);
+        return (T)value;
+    }
+
+    constexpr void set(T value)
+    {
+        auto bits = (std::make_unsigned_t<T>)value;
+        for (size_t i = 0; i < sizeof(T); i++)
+            bytes[sizeof(T) - 1 - i] = (byte)(bits >> (i * 8));
+    }
+
+    constexpr operator T() const { return get(); }
+    constexpr be &operator=(T value)
+    {
+        set(value);
+        return *this;
+    }
+};
+
+static_assert(sizeof(be<uint>) == 4 && alignof(be<uint>) == 1);
+static_assert(sizeof(be<ushort>) == 2 && alignof(be<ushort>) == 1);
+static_assert(be<uint>{{0x12, 0x34, 0x56, 0x78}}.get() == 0x12345678);
+static_assert(be<int>{{0xFF, 0xFF, 0xFF, 0xFE}}.get() == -2);
+
+class Endian
+{
+public:
+    static constexpr bool HostIsBig = (std::endian::native == std::endian::big);
+#if defined(KAMEK_SIMD_SSSE3) || defined(KAMEK_SIMD_NEON)
+    static constexpr bool HasShuffle = true;
+#else
+    // without a byte shuffle instruction, plain per-field byte swaps are faster than ShuffleBlocks
+    static constexpr bool HasShuffle = false;
+#endif
+
+    template <typename T>
+    static T Load(const byte *source)
+    {
+        T value;
+        memcpy(&value, source, sizeof(T));
+        if constexpr (!HostIsBig && sizeof(T) > 1)
+            value = std::byteswap(value);
+        return value;
+    }
+
+    template <typename T>
+    static void Store(byte *destination, T value)
+    {
+        if constexpr (!HostIsBig && sizeof(T) > 1)
+            value = std::byteswap(value);
+        memcpy(destination, &value, sizeof(T));
+    }
+
+    // Shuffles each 16-byte block of the source by the same pattern: the
+    // output's byte i is the input's byte pattern[i]. Byte-swapping a table
+    // of fixed-size records is one of these per 16 bytes.
+    static void ShuffleBlocks(const byte *source, byte *destination, size_t blocks, const byte pattern[16])
+    {
+#if defined(KAMEK_SIMD_SSSE3)
+        __m128i mask = _mm_loadu_si128((const __m128i *)pattern);
+        for (size_t i = 0; i < blocks; i++)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i *)(source + (i * 16)));
+            _mm_storeu_si128((__m128i *)(destination + (i * 16)), _mm_shuffle_epi8(block, mask));
+        }
+#elif defined(KAMEK_SIMD_NEON)
+        uint8x16_t mask = vld1q_u8(pattern);
+        for (size_t i = 0; i < blocks; i++)
+            vst1q_u8(destination + (i * 16), vqtbl1q_u8(vld1q_u8(source + (i * 16)), mask));
+#else
+        for (size_t i = 0; i < blocks; i++)
+        {
+            byte block[16];
+            memcpy(block, source + (i * 16), 16);
+            for (int j = 0; j < 16; j++)
+                destination[(i * 16) + j] = block[pattern[j]];
+        }
+#endif
+    }
+
+    // Converts a run of big-endian 32-bit words into host order
+    static void DecodeWords(const byte *source, uint *destination, size_t count)
+    {
+        static const byte SwapWords[16] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12};
+
+        if constexpr (HostIsBig)
+        {
+            memcpy(destination, source, count * 4);
+            return;
+        }
+
+        size_t blocks = HasShuffle ? (count / 4) : 0;
+        ShuffleBlocks(source, (byte *)destination, blocks, SwapWords);
+        for (size_t i = blocks * 4; i < count; i++)
+            destination[i] = Load<uint>(source + (i * 4));
+    }
+};
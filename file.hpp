@@ -1,45 +1,159 @@
+#pragma once
+
 #include "sized_array.hpp"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 class File
 {
 public:
-    static std::vector<std::string> ReadAllLines(std::string file)
+    static std::vector<std::string> ReadAllLines(const std::string &file)
     {
         std::ifstream myFile(file);
         std::vector<std::string> myLines;
-        std::copy(std::istream_iterator<std::string>(myFile),
-                  std::istream_iterator<std::string>(),
-                  std::back_inserter(myLines));
+        for (std::string line; std::getline(myFile, line);)
+            myLines.push_back(line);
         return myLines;
     }
 
-    static void WriteAllBytes(std::string path, sized_array *bytes)
+    static std::string ReadAllText(const std::string &file)
     {
-        FILE *fp = fopen(path.c_str(), "w");
+        std::ifstream myFile(file, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(myFile), std::istreambuf_iterator<char>());
+    }
+
+    // The same lines as ReadAllLines, from text already in memory
+    static std::vector<std::string> SplitLines(std::string_view text)
+    {
+        std::vector<std::string> lines;
+        while (text.length() > 0)
+        {
+            size_t end = text.find('\n');
+            lines.emplace_back(text.substr(0, end));
+            if (end == std::string_view::npos)
+                break;
+            text.remove_prefix(end + 1);
+        }
+        return lines;
+    }
+
+    static void WriteAllBytes(const std::string &path, const sized_array *bytes)
+    {
+        FILE *fp = fopen(path.c_str(), "wb");
         fwrite(bytes->data, 1, bytes->length, fp);
         fclose(fp);
     }
 
-    static void WriteAllText(std::string path, std::string text)
+    static void WriteAllText(const std::string &path, const std::string &text)
     {
         FILE *fp = fopen(path.c_str(), "w");
         fwrite(text.data(), 1, text.length(), fp);
         fclose(fp);
     }
 
-    static uint64_t GetFileSize(std::string path)
+    static uint64_t GetFileSize(const std::string &path)
     {
         return std::filesystem::file_size(path.c_str());
     }
 
-    static sized_array *ReadAllBytes(std::string path)
+    static sized_array ReadAllBytes(const std::string &path)
     {
-        sized_array *arr = new sized_array(GetFileSize(path));
+        sized_array arr(GetFileSize(path));
 
-        FILE *fp = fopen(path.c_str(), "r");
-        fread(arr->data, 1, arr->length, fp);
+        FILE *fp = fopen(path.c_str(), "rb");
+        fread(arr.data, 1, arr.length, fp);
         fclose(fp);
 
         return arr;
     }
-};
\ No newline at end of file
+};
+
+// Read-only view of a whole file, paged in on demand instead of read up front
+class MappedFile
+{
+public:
+    byte *data = nullptr;
+    size_t length = 0;
+
+#ifdef _WIN32
+    HANDLE _file = INVALID_HANDLE_VALUE, _mapping = nullptr;
+#endif
+
+    MappedFile() {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() { Close(); }
+
+    bool Open(const std::string &path)
+    {
+        Close();
+
+#ifdef _WIN32
+        _file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (_file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(_file, &size))
+            return false;
+        length = (size_t)size.QuadPart;
+        if (length == 0)
+            return true;
+
+        _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (_mapping == nullptr)
+            return false;
+        data = (byte *)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+        return data != nullptr;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        length = (size_t)info.st_size;
+
+        if (length > 0)
+        {
+            void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = (mapping == MAP_FAILED) ? nullptr : (byte *)mapping;
+        }
+        close(fd);
+        return length == 0 || data != nullptr;
+#endif
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (data != nullptr)
+            UnmapViewOfFile(data);
+        if (_mapping != nullptr)
+            CloseHandle(_mapping);
+        if (_file != INVALID_HANDLE_VALUE)
+            CloseHandle(_file);
+        _mapping = nullptr;
+        _file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr)
+            munmap(data, length);
+#endif
+        data = nullptr;
+        length = 0;
+    }
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <bit>
+#include <string.h>
+#include "common.hpp"
+
+// A fast 128-bit content hash for telling whether build inputs changed. Not
+// cryptographic; it only has to make accidental collisions vanishingly rare.
+// Two independent 64-bit lanes each take every 8-byte word, and are mixed
+// together at the end.
+class Hasher
+{
+public:
+    static const ulong Prime1 = 0x9E3779B185EBCA87ULL;
+    static const ulong Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static const ulong Prime3 = 0x165667B19E3779F9ULL;
+    static const ulong Prime4 = 0x85EBCA77C2B2AE63ULL;
+
+    ulong _a = Prime1, _b = Prime2;
+    ulong _length = 0;
+
+    void Update(const void *data, size_t length)
+    {
+        const byte *bytes = (const byte *)data;
+        _length += length;
+
+        size_t i = 0;
+        for (; i + 8 <= length; i += 8)
+        {
+            ulong word;
+            memcpy(&word, bytes + i, 8);
+            Mix(word);
+        }
+
+        if (i < length)
+        {
+            // the tail is padded with its length, so "ab" and "ab\0" differ
+            ulong word = (ulong)(length - i) << 56;
+            memcpy(&word, bytes + i, length - i);
+            Mix(word);
+        }
+    }
+
+    // Strings are length-prefixed, so a sequence of them hashes unambiguously
+    void Update(const std::string &text)
+    {
+        Update((ulong)text.length());
+        Update(text.data(), text.length());
+    }
+
+    void Update(ulong value)
+    {
+        Update(&value, sizeof(value));
+    }
+
+    std::string Digest() const
+    {
+        ulong a = Final(_a ^ _length), b = Final(_b ^ std::rotl(_length, 32));
+        a += b;
+        b += a;
+        return std::format("{0:016x}{1:016x}", a, b);
+    }
+
+    void Mix(ulong word)
+    {
+        _a = std::rotl(_a ^ (word * Prime3), 31) * Prime1;
+        _b = std::rotl(_b + (word * Prime4), 29) * Prime2;
+    }
+
+    // murmur3's finaliser
+    static ulong Final(ulong h)
+    {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
@@ -5,13 +5,14 @@
 #include "linker.hpp"
 
 #include "commands/branch_command.hpp"
+#include "commands/inline_command.hpp"
 #include "commands/patch_exit_command.hpp"
 #include "commands/write_command.hpp"
 
 struct Hook
 {
 public:
-    static Hook *Create(Linker::HookData data, AddressMapper *mapper);
+    static Hook *Create(const Linker::HookData &data, AddressMapper *mapper, Arena *arena);
 
     std::vector<Command *> Commands;
 
@@ -22,35 +23,51 @@ public:
 
 struct BranchHook : Hook
 {
-    BranchHook(bool isLink, Word *args, int argc, AddressMapper *mapper);
+    BranchHook(bool isLink, Word *args, int argc, AddressMapper *mapper, Arena *arena);
+};
+
+// kmInlineBranch (6) and kmInlineCall (7): like kmBranch and kmCall, with a
+// third argument giving how many bytes at the source the function may be
+// copied over. For kmInlineCall those bytes are the region the hook replaces,
+// inlined or not: the body or a bl goes at the start and the rest becomes
+// nops, so none of the game's instructions in it are left to run. For
+// kmInlineBranch only the start of the game function is overwritten, as the
+// rest is never reached either way. See InlineCommand.
+struct InlineHook : Hook
+{
+    InlineHook(bool isLink, Word *args, int argc, AddressMapper *mapper, Arena *arena);
 };
 
 struct PatchExitHook : Hook
 {
 
-    PatchExitHook(Word *args, int argc, AddressMapper *mapper);
+    PatchExitHook(Word *args, int argc, AddressMapper *mapper, Arena *arena);
 };
 
 struct WriteHook : Hook
 {
 
-    WriteHook(bool isConditional, Word *args, int argc, AddressMapper *mapper);
+    WriteHook(bool isConditional, Word *args, int argc, AddressMapper *mapper, Arena *arena);
 };
 
-Hook *Hook::Create(Linker::HookData data, AddressMapper *mapper)
+Hook *Hook::Create(const Linker::HookData &data, AddressMapper *mapper, Arena *arena)
 {
     switch (data.type)
     {
     case 1:
-        return new WriteHook(false, data.args, data.argc, mapper);
+        return arena->New<WriteHook>(false, data.args, data.argc, mapper, arena);
     case 2:
-        return new WriteHook(true, data.args, data.argc, mapper);
+        return arena->New<WriteHook>(true, data.args, data.argc, mapper, arena);
     case 3:
-        return new BranchHook(false, data.args, data.argc, mapper);
+        return arena->New<BranchHook>(false, data.args, data.argc, mapper, arena);
     case 4:
-        return new BranchHook(true, data.args, data.argc, mapper);
+        return arena->New<BranchHook>(true, data.args, data.argc, mapper, arena);
     case 5:
-        return new PatchExitHook(data.args, data.argc, mapper);
+        return arena->New<PatchExitHook>(data.args, data.argc, mapper, arena);
+    case 6:
+        return arena->New<InlineHook>(false, data.args, data.argc, mapper, arena);
+    case 7:
+        return arena->New<InlineHook>(true, data.args, data.argc, mapper, arena);
     default:
         return nullptr;
     }
@@ -94,7 +111,7 @@ Word Hook::GetAnyPointerArg(Word word, AddressMapper *mapper)
     }
 }
 
-BranchHook::BranchHook(bool isLink, Word *args, int argc, AddressMapper *mapper)
+BranchHook::BranchHook(bool isLink, Word *args, int argc, AddressMapper *mapper, Arena *arena)
 {
     if (argc != 2)
         writeline("wrong arg count for BranchCommand");
@@ -105,10 +122,26 @@ BranchHook::BranchHook(bool isLink, Word *args, int argc, AddressMapper *mapper)
     auto source = GetAbsoluteArg(args[0], mapper);
     auto dest = GetAnyPointerArg(args[1], mapper);
 
-    Commands.push_back(new BranchCommand(source, dest, isLink));
+    Commands.push_back(arena->New<BranchCommand>(source, dest, isLink));
+}
+
+InlineHook::InlineHook(bool isLink, Word *args, int argc, AddressMapper *mapper, Arena *arena)
+{
+    if (argc != 3)
+        writeline("wrong arg count for InlineCommand");
+
+    // expected args:
+    //   source   : pointer to game code
+    //   dest     : pointer to Kamek code
+    //   maxBytes : value, how much game code the function may replace
+    auto source = GetAbsoluteArg(args[0], mapper);
+    auto dest = GetAnyPointerArg(args[1], mapper);
+    auto maxBytes = GetValueArg(args[2]);
+
+    Commands.push_back(arena->New<InlineCommand>(source, dest, isLink, maxBytes.Value));
 }
 
-PatchExitHook::PatchExitHook(Word *args, int argc, AddressMapper *mapper)
+PatchExitHook::PatchExitHook(Word *args, int argc, AddressMapper *mapper, Arena *arena)
 {
     if (argc != 2)
         writeline("PatchExitCommand requires two arguments");
@@ -118,11 +151,11 @@ PatchExitHook::PatchExitHook(Word *args, int argc, AddressMapper *mapper)
 
     if (!args[1].IsValue() || args[1].Value != 0)
     {
-        Commands.push_back(new PatchExitCommand(function, dest));
+        Commands.push_back(arena->New<PatchExitCommand>(function, dest));
     }
 }
 
-WriteHook::WriteHook(bool isConditional, Word *args, int argc, AddressMapper *mapper)
+WriteHook::WriteHook(bool isConditional, Word *args, int argc, AddressMapper *mapper, Arena *arena)
 {
     if (argc != (isConditional ? 4 : 3))
         writeline("wrong arg count for WriteCommand");
@@ -133,7 +166,7 @@ WriteHook::WriteHook(bool isConditional, Word *args, int argc, AddressMapper *ma
     //   original : value, OR pointer to game code or to Kamek code
     auto type = (WriteCommand::Type)GetValueArg(args[0]).Value;
     Word address, value;
-    Word original;
+    Word original = {WordType::Value, 0};
 
     address = GetAbsoluteArg(args[1], mapper);
     if (type == WriteCommand::Type::Pointer)
@@ -149,5 +182,5 @@ WriteHook::WriteHook(bool isConditional, Word *args, int argc, AddressMapper *ma
             original = GetValueArg(args[3]);
     }
 
-    Commands.push_back(new WriteCommand(address, value, type, original));
+    Commands.push_back(arena->New<WriteCommand>(address, value, type, original));
 }
\ No newline at end of file
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <string.h>
+#include "common.hpp"
+
+// Just enough JSON for manifests: objects, arrays, strings, numbers, booleans
+// and null. Parse failures come back as a message with the offending offset.
+class Json
+{
+public:
+    enum Type
+    {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object
+    };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> items;
+    std::vector<std::pair<std::string, Json>> members;
+
+    bool IsNull() const { return type == Type::Null; }
+
+    // Looks up an object member; missing members (and non-objects) give Null
+    const Json &operator[](const std::string &key) const
+    {
+        static const Json missing;
+        if (type != Type::Object)
+            return missing;
+        for (auto &member : members)
+        {
+            if (member.first == key)
+                return member.second;
+        }
+        return missing;
+    }
+
+    static bool Parse(const std::string &text, Json *result, std::string *error)
+    {
+        Parser parser{.text = text};
+        parser.SkipSpace();
+        if (!parser.ParseValue(result))
+        {
+            *error = std::format("{0} at offset {1}", parser.error, parser.position);
+            return false;
+        }
+        parser.SkipSpace();
+        if (parser.position != text.length())
+        {
+            *error = std::format("unexpected trailing data at offset {0}", parser.position);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Parser
+    {
+        const std::string &text;
+        size_t position = 0;
+        std::string error;
+
+        bool Fail(const char *message)
+        {
+            error = message;
+            return false;
+        }
+
+        void SkipSpace()
+        {
+            while (position < text.length() && (text[position] == ' ' || text[position] == '\t' || text[position] == '\r' || text[position] == '\n'))
+                position++;
+        }
+
+        bool Consume(const char *literal)
+        {
+            size_t length = strlen(literal);
+            if (text.compare(position, length, literal) != 0)
+                return false;
+            position += length;
+            return true;
+        }
+
+        bool ParseValue(Json *value)
+        {
+            if (position >= text.length())
+                return Fail("unexpected end of input");
+
+            switch (text[position])
+            {
+            case '{':
+                return ParseObject(value);
+            case '[':
+                return ParseArray(value);
+            case '"':
+                value->type = Type::String;
+                return ParseString(&value->string);
+            case 't':
+            case 'f':
+                value->type = Type::Bool;
+                value->boolean = (text[position] == 't');
+                return Consume(value->boolean ? "true" : "false") || Fail("invalid literal");
+            case 'n':
+                value->type = Type::Null;
+                return Consume("null") || Fail("invalid literal");
+            default:
+                return ParseNumber(value);
+            }
+        }
+
+        bool ParseObject(Json *value)
+        {
+            value->type = Type::Object;
+            position++;
+            SkipSpace();
+            if (Consume("}"))
+                return true;
+
+            while (true)
+            {
+                SkipSpace();
+                std::string key;
+                if (position >= text.length() || text[position] != '"')
+                    return Fail("expected a member name");
+                if (!ParseString(&key))
+                    return false;
+
+                SkipSpace();
+                if (!Consume(":"))
+                    return Fail("expected ':'");
+                SkipSpace();
+
+                value->members.push_back({key, Json()});
+                if (!ParseValue(&value->members.back().second))
+                    return false;
+
+                SkipSpace();
+                if (Consume("}"))
+                    return true;
+                if (!Consume(","))
+                    return Fail("expected ',' or '}'");
+            }
+        }
+
+        bool ParseArray(Json *value)
+        {
+            value->type = Type::Array;
+            position++;
+            SkipSpace();
+            if (Consume("]"))
+                return true;
+
+            while (true)
+            {
+                SkipSpace();
+                value->items.push_back(Json());
+                if (!ParseValue(&value->items.back()))
+                    return false;
+
+                SkipSpace();
+                if (Consume("]"))
+                    return true;
+                if (!Consume(","))
+                    return Fail("expected ',' or ']'");
+            }
+        }
+
+        bool ParseString(std::string *output)
+        {
+            position++;
+            while (position < text.length())
+            {
+                char c = text[position++];
+                if (c == '"')
+                    return true;
+                if (c != '\\')
+                {
+                    *output += c;
+                    continue;
+                }
+
+                if (position >= text.length())
+                    break;
+                switch (text[position++])
+                {
+                case '"':
+                    *output += '"';
+                    break;
+                case '\\':
+                    *output += '\\';
+                    break;
+                case '/':
+                    *output += '/';
+                    break;
+                case 'b':
+                    *output += '\b';
+                    break;
+                case 'f':
+                    *output += '\f';
+                    break;
+                case 'n':
+                    *output += '\n';
+                    break;
+                case 'r':
+                    *output += '\r';
+                    break;
+                case 't':
+                    *output += '\t';
+                    break;
+                case 'u':
+                {
+                    std::string hex = text.substr(position, 4);
+                    if (hex.length() != 4 || hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+                        return Fail("invalid \\u escape");
+                    uint code = std::stoul(hex, 0, 16);
+                    position += 4;
+
+                    // paths and symbol names are expected to be ASCII, but keep anything else as UTF-8
+                    if (code < 0x80)
+                        *output += (char)code;
+                    else if (code < 0x800)
+                    {
+                        *output += (char)(0xC0 | (code >> 6));
+                        *output += (char)(0x80 | (code & 0x3F));
+                    }
+                    else
+                    {
+                        *output += (char)(0xE0 | (code >> 12));
+                        *output += (char)(0x80 | ((code >> 6) & 0x3F));
+                        *output += (char)(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default:
+                    return Fail("invalid escape");
+                }
+            }
+            return Fail("unterminated string");
+        }
+
+        bool ParseNumber(Json *value)
+        {
+            size_t start = position;
+            while (position < text.length() && strchr("+-0123456789.eE", text[position]) != nullptr)
+                position++;
+            if (position == start)
+                return Fail("unexpected character");
+
+            std::string digits = text.substr(start, position - start);
+            char *end;
+            value->type = Type::Number;
+            value->number = strtod(digits.c_str(), &end);
+            return (*end == '\0') || Fail("invalid number");
+        }
+    };
+};
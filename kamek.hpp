@@ -0,0 +1,392 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <deque>
+#include <span>
+#include <sstream>
+#include <charconv>
+#include "common.hpp"
+#include "elf.hpp"
+#include "archive.hpp"
+#include "version_info.hpp"
+#include "linker.hpp"
+#include "kamek_file.hpp"
+#include "dol.hpp"
+#include "multi_version_packer.hpp"
+#include "stats.hpp"
+
+// Kamek as a library. Objects, archives, externals and versions can all be
+// handed over from memory, and every output can be packed into a buffer the
+// caller owns, so a tool can link as many variants as it likes without
+// touching the filesystem. The command line and manifest builds (build.hpp)
+// are a layer on top of this that reads and writes files.
+//
+//     Kamek kamek;
+//     kamek.AddObject("mod.o", objectBytes);
+//     kamek.AddExternals(externalsText);
+//     auto result = kamek.Link("default", Kamek::LinkOptions{.baseAddress = 0x80001900});
+//     result->file.PackText(KamekFile::TextOutputs{.riivolution = &xml});
+//     result->PatchDol(dolBytes, &patchedDol);
+//
+// Inputs are parsed when they are added and are only read while linking, so
+// Link can be called from several threads at once, as long as no inputs are
+// added in the meantime.
+class Kamek
+{
+public:
+    struct LinkOptions
+    {
+        uint baseAddress = 0;                // 0 for a dynamically linked binary
+        std::optional<uint> prelinkAddress; // dynamic only, see KamekFile::Prelink
+        uint threads = 1;                    // for the per-module linker phases, see Linker::Threads
+        bool alignTextToCacheLines = false; // see Linker::AlignTextToCacheLines
+        const std::vector<std::string> *symbolOrder = nullptr; // see ParseSymbolOrder
+        bool relax = false;                                    // see Linker::RelaxFixups
+        bool instrumentHooks = false;                          // see Linker::InstrumentHookTargets
+        bool loaderBlockWrites = false;                        // see KamekFile::_loaderBlockWrites
+    };
+
+    // One linked version. Everything the KamekFile points into lives in the
+    // arena, so a result stays valid after the linker is gone; it does refer
+    // to the version's address mapper, which belongs to the Kamek.
+    class Result
+    {
+    public:
+        std::string version;
+        Arena arena;
+        KamekFile file;
+
+        Result() {}
+        Result(const Result &) = delete;
+        Result &operator=(const Result &) = delete;
+
+        // The binary for the Kamek loader (dynamic links only)
+        void PackKamek(std::vector<byte> *output)
+        {
+            file.Pack(output);
+        }
+
+        // The combined code and data segment, as it would be loaded
+        void PackCode(std::vector<byte> *output)
+        {
+            output->assign(file._codeBlob->data, file._codeBlob->data + file._codeBlob->length);
+        }
+
+        // Applies this (static) link to a copy of the input DOL; the input is left alone
+        bool PatchDol(std::span<const byte> input, std::vector<byte> *output)
+        {
+            if (!Dol::IsValid(input.data(), input.size()))
+            {
+                writeline("not a valid DOL file");
+                return false;
+            }
+
+            std::vector<byte> image(input.begin(), input.end());
+            Dol dol(image.data());
+            file.InjectIntoDol(&dol);
+
+            output->resize(dol.Size());
+            dol.Write(output->data());
+            return true;
+        }
+    };
+
+    std::mutex _lock;
+
+    // inputs that were handed over as bytes, and are owned here
+    std::vector<std::unique_ptr<Elf>> _ownedModules;
+    std::vector<std::unique_ptr<Archive>> _ownedArchives;
+    std::deque<std::map<std::string, uint>> _ownedExternals;
+    std::unique_ptr<VersionInfo> _ownedVersions;
+
+    std::vector<Elf *> _modules;
+    std::vector<Archive *> _archives;
+    std::vector<const std::map<std::string, uint> *> _externals;
+    VersionInfo *_versions = nullptr;
+
+    // what actually gets linked, worked out by the first Link after the inputs change
+    bool _resolved = false;
+    bool _resolveFailed = false;
+    std::vector<Elf *> _linkModules;
+    std::map<std::string, uint> _mergedExternals;
+    const std::map<std::string, uint> *_linkExternals = nullptr;
+
+    Kamek()
+    {
+        _ownedVersions = std::make_unique<VersionInfo>();
+        _versions = _ownedVersions.get();
+    }
+    Kamek(const Kamek &) = delete;
+    Kamek &operator=(const Kamek &) = delete;
+
+    // A relocatable object held in memory; the bytes have to outlive the Kamek.
+    // nullptr if they aren't an ELF object.
+    Elf *AddObject(const std::string &name, std::span<const byte> bytes)
+    {
+        if (bytes.size() < sizeof(Elf::Elf32_Ehdr) || Util::ExtractUInt32(bytes.data(), 0) != 0x7F454C46) // "\x7F" "ELF"
+        {
+            writeline("%s is not an ELF object", name.c_str());
+            return nullptr;
+        }
+
+        Stats::Scope scope("ParseElf", name);
+        auto elf = std::make_unique<Elf>((byte *)bytes.data());
+        elf->_name = name;
+        AddModule(elf.get());
+
+        _ownedModules.push_back(std::move(elf));
+        return _ownedModules.back().get();
+    }
+
+    // An ar archive held in memory; the bytes have to outlive the Kamek
+    Archive *AddArchive(const std::string &name, std::span<const byte> bytes)
+    {
+        Stats::Scope scope("ReadArchive", name);
+        auto archive = std::make_unique<Archive>();
+        if (!archive->Open(name, (byte *)bytes.data(), bytes.size()))
+            return nullptr;
+        AddArchive(archive.get());
+
+        _ownedArchives.push_back(std::move(archive));
+        return _ownedArchives.back().get();
+    }
+
+    // An object parsed elsewhere, which can be shared between several Kameks
+    void AddModule(Elf *module)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _modules.push_back(module);
+        _resolved = false;
+    }
+
+    void AddArchive(Archive *archive)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _archives.push_back(archive);
+        _resolved = false;
+    }
+
+    // Externals in the same text format as an externals file. Symbols in
+    // externals added later override the ones added earlier.
+    void AddExternals(std::string_view text)
+    {
+        _ownedExternals.emplace_back();
+        ParseExternals(File::SplitLines(text), &_ownedExternals.back());
+        AddExternals(&_ownedExternals.back());
+    }
+
+    void AddExternals(const std::map<std::string, uint> *symbols)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _externals.push_back(symbols);
+        _resolved = false;
+    }
+
+    // Versions in the same text format as a versions file; without any, there
+    // is only the "default" version with no address remapping
+    void SetVersions(std::string_view text)
+    {
+        _ownedVersions = std::make_unique<VersionInfo>(File::SplitLines(text));
+        SetVersions(_ownedVersions.get());
+    }
+
+    void SetVersions(VersionInfo *versions)
+    {
+        _versions = versions;
+    }
+
+    VersionInfo *Versions()
+    {
+        return _versions;
+    }
+
+    static void ParseExternals(const std::vector<std::string> &lines, std::map<std::string, uint> *dict)
+    {
+        std::regex commentRegex("^\\s*#");
+        std::regex emptyLineRegex("^\\s*$");
+        std::regex assignmentRegex("^\\s*([a-zA-Z0-9_<>@,-\\\\$]+)\\s*=\\s*0x([a-fA-F0-9]+)\\s*(#.*)?$");
+
+        for (const std::string &line : lines)
+        {
+            if (std::regex_match(line, emptyLineRegex))
+                continue;
+            if (std::regex_match(line, commentRegex))
+                continue;
+
+            std::smatch matches;
+            if (std::regex_search(line, matches, assignmentRegex))
+            {
+                (*dict)[matches[1]] = std::stoul(matches[2], 0, 16);
+            }
+            else
+            {
+                writeline("unrecognised line in externals file: %s\n", line.c_str());
+            }
+        }
+    }
+
+    // A function hit list, for laying out .text (see Linker::OrderTextSections):
+    // one function name per line, hottest first. A count after the name (as a
+    // profiler exports them) puts the lines in order of count instead, highest
+    // first. Blank lines and lines starting with # are ignored.
+    static void ParseSymbolOrder(const std::vector<std::string> &lines, std::vector<std::string> *order)
+    {
+        std::vector<std::pair<std::string, ulong>> entries;
+        bool counted = false;
+        for (const std::string &line : lines)
+        {
+            std::istringstream tokens(line);
+            std::string name, count;
+            if (!(tokens >> name) || name.starts_with("#"))
+                continue;
+
+            ulong hits = 0;
+            if (tokens >> count)
+            {
+                auto parsed = std::from_chars(count.data(), count.data() + count.size(), hits);
+                counted |= (parsed.ec == std::errc() && parsed.ptr == count.data() + count.size());
+            }
+            entries.push_back({name, hits});
+        }
+
+        if (counted)
+        {
+            std::stable_sort(entries.begin(), entries.end(), [](const auto &a, const auto &b)
+                             { return a.second > b.second; });
+        }
+        for (auto &entry : entries)
+            order->push_back(std::move(entry.first));
+    }
+
+    // Adds the archive members that define symbols the link still needs, then
+    // the members those need in turn, until nothing new turns up. Every archive
+    // is searched (in order) for every symbol, no matter where it was listed.
+    static bool AddArchiveMembers(std::vector<Elf *> &modules, const std::vector<Archive *> &archives, const std::map<std::string, uint> &externals)
+    {
+        std::set<std::string> defined;
+        std::deque<std::string> pending;
+        std::set<Elf *> added(modules.begin(), modules.end());
+
+        auto scan = [&](Elf *module)
+        {
+            std::vector<std::string> definitions, references;
+            module->ListGlobalSymbols(&definitions, &references);
+            defined.insert(definitions.begin(), definitions.end());
+            pending.insert(pending.end(), references.begin(), references.end());
+        };
+        for (Elf *module : modules)
+            scan(module);
+
+        while (!pending.empty())
+        {
+            std::string symbol = std::move(pending.front());
+            pending.pop_front();
+            if (defined.contains(symbol) || externals.contains(symbol))
+                continue;
+            // whether or not an archive has it, there's no need to look again
+            defined.insert(symbol);
+
+            for (Archive *archive : archives)
+            {
+                long index = archive->FindDefinition(symbol);
+                if (index < 0)
+                    continue;
+
+                Elf *member = archive->GetMember(index);
+                if (member == nullptr)
+                {
+                    writeline("%s(%s) defines %s but is not an ELF object", archive->_path.c_str(), archive->_members[index].name.c_str(), symbol.c_str());
+                    return false;
+                }
+                if (added.insert(member).second)
+                {
+                    modules.push_back(member);
+                    scan(member);
+                    Stats::Count("archive.members");
+                }
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Merges the externals and pulls in the archive members the objects need;
+    // done once for however many versions get linked
+    bool Resolve()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_resolved)
+            return !_resolveFailed;
+
+        // a single externals map is used as it is
+        _mergedExternals.clear();
+        _linkExternals = &_mergedExternals;
+        if (_externals.size() == 1)
+            _linkExternals = _externals[0];
+        else
+        {
+            for (const std::map<std::string, uint> *symbols : _externals)
+            {
+                for (auto &pair : *symbols)
+                    _mergedExternals[pair.first] = pair.second;
+            }
+        }
+
+        _linkModules = _modules;
+        _resolveFailed = (_archives.size() > 0 && !AddArchiveMembers(_linkModules, _archives, *_linkExternals));
+        _resolved = true;
+        return !_resolveFailed;
+    }
+
+    // Links every input for one version; nullptr if that isn't possible
+    std::unique_ptr<Result> Link(const std::string &version, const LinkOptions &options)
+    {
+        if (options.prelinkAddress.has_value() && options.baseAddress != 0)
+        {
+            writeline("-prelink only applies to dynamically linked binaries");
+            return nullptr;
+        }
+
+        auto mapper = _versions->_mappers.find(version);
+        if (mapper == _versions->_mappers.end())
+        {
+            writeline("unknown version %s", version.c_str());
+            return nullptr;
+        }
+
+        if (!Resolve())
+            return nullptr;
+        if (_linkModules.size() == 0)
+        {
+            writeline("no input files specified");
+            return nullptr;
+        }
+
+        auto result = std::make_unique<Result>();
+        result->version = version;
+
+        Linker linker(mapper->second, &result->arena);
+        linker.Threads = options.threads;
+        linker.AlignTextToCacheLines = options.alignTextToCacheLines;
+        linker.SymbolOrder = options.symbolOrder;
+        linker.Relax = options.relax;
+        linker.InstrumentHooks = options.instrumentHooks;
+        for (Elf *module : _linkModules)
+            linker.AddModule(module);
+
+        if (options.baseAddress != 0)
+            linker.LinkStatic(options.baseAddress, *_linkExternals);
+        else
+            linker.LinkDynamic(*_linkExternals);
+
+        result->file.LoadFromLinker(&linker);
+        result->file._loaderBlockWrites = options.loaderBlockWrites;
+        if (options.prelinkAddress.has_value())
+            result->file.Prelink(*options.prelinkAddress);
+
+        return result;
+    }
+};
@@ -6,12 +6,14 @@
 
 #include "commands/write_command.hpp"
 #include "commands/reloc_command.hpp"
+#include "commands/block_write_command.hpp"
+#include "stats.hpp"
 
-sized_array *KamekFile::PackFrom(Linker *linker)
+void KamekFile::PackFrom(Linker *linker, std::vector<byte> *output)
 {
-    KamekFile *kf = new KamekFile();
-    kf->LoadFromLinker(linker);
-    return kf->Pack();
+    KamekFile kf;
+    kf.LoadFromLinker(linker);
+    kf.Pack(output);
 }
 
 ushort KamekFile::ReadUInt16(Word addr)
@@ -38,52 +40,81 @@ bool KamekFile::Contains(Word addr)
 
 uint KamekFile::QuerySymbolSize(Word addr)
 {
-    return _symbolSizes[addr];
+    return _symbolIndex->SizeAt(addr);
 }
 
 void KamekFile::LoadFromLinker(Linker *linker)
 {
+    Stats::Scope scope("LoadFromLinker");
+
     if (_codeBlob != nullptr)
         writeline("this KamekFile already has stuff : it");
 
     _mapper = linker->Mapper;
+    _arena = linker->_arena;
 
-    // Extract _just_ the code/data sections
-    _codeBlob = new sized_array(linker->_outputEnd - linker->_outputStart);
-
-    memcpy(_codeBlob, linker->_memory + (linker->_outputStart - linker->_baseAddress), _codeBlob->length);
+    // Extract _just_ the code/data sections (as a view into the linker's memory)
+    _codeBlob = _arena->New<sized_array>(linker->_memory + linker->MemoryOffset(linker->_outputStart), linker->_outputEnd - linker->_outputStart);
 
     _baseAddress = linker->_baseAddress;
     _bssSize = linker->_bssEnd - linker->_bssStart;
     _ctorStart = linker->_ctorStart - linker->_outputStart;
     _ctorEnd = linker->_ctorEnd - linker->_outputStart;
 
-    for (auto pair : linker->_symbolSizes)
-        _symbolSizes[pair.first] = pair.second;
+    _symbolIndex = linker->_symbolIndex;
+    _instrumented = linker->_instrumented;
+
+    std::map<Elf::ElfSection *, const std::string *> owners;
+    for (Elf *elf : linker->_modules)
+    {
+        for (Elf::ElfSection *s : elf->_sections)
+            owners[s] = &elf->_name;
+    }
+    for (const Linker::SectionPlacement &placement : linker->_placements)
+    {
+        // the hook data is read by the linker and never loaded
+        if (placement.section->name.starts_with(".kamek"))
+            continue;
+        _layout.push_back(Placement{.module = *owners.at(placement.section), .section = placement.section->name, .base = placement.base, .size = placement.section->sh_size, .isBss = placement.base.Value >= linker->_bssStart.Value});
+    }
+    if (linker->_instrumentSlots > 0)
+    {
+        _layout.push_back(Placement{.module = "(instrument-hooks)", .section = ".text", .base = linker->_instrumentStubs, .size = linker->_instrumentSlots * (uint)sizeof(Linker::InstrumentStub)});
+        _layout.push_back(Placement{.module = "(instrument-hooks)", .section = ".bss", .base = linker->_instrumentCounters, .size = linker->_instrumentSlots * Linker::InstrumentSlotSize, .isBss = true});
+    }
+    _layoutPadding = linker->_layoutPadding;
 
     AddRelocsAsCommands(linker->_fixups);
 
-    for (auto cmd : linker->_hooks)
+    for (auto &cmd : linker->_hooks)
         ApplyHook(cmd);
     ApplyStaticCommands();
+    CoalesceWrites();
+    ResolveInlines();
+
+    if (Stats::Enabled)
+    {
+        for (auto &pair : _commands)
+            Stats::Count(std::string("commands.") + Command::IdName(pair.second->Id));
+    }
 }
 
-void KamekFile::AddRelocsAsCommands(std::vector<Linker::Fixup *> relocs)
+void KamekFile::AddRelocsAsCommands(const std::vector<Linker::Fixup *> &relocs)
 {
     for (auto rel : relocs)
     {
         if (_commands.contains(rel->source))
             writeline("duplicate commands for address {0}", rel->source);
-        Command *cmd = new RelocCommand(rel->source, rel->dest, rel->type);
+        Command *cmd = _arena->New<RelocCommand>(rel->source, rel->dest, rel->type);
         cmd->CalculateAddress(this);
         cmd->AssertAddressNonNull();
         _commands[rel->source] = cmd;
     }
 }
 
-void KamekFile::ApplyHook(Linker::HookData hookData)
+void KamekFile::ApplyHook(const Linker::HookData &hookData)
 {
-    auto hook = Hook::Create(hookData, _mapper);
+    auto hook = Hook::Create(hookData, _mapper, _arena);
     for (auto cmd : hook->Commands)
     {
         cmd->CalculateAddress(this);
@@ -97,147 +128,374 @@ void KamekFile::ApplyHook(Linker::HookData hookData)
 
 void KamekFile::ApplyStaticCommands()
 {
+    Stats::Scope scope("ApplyStaticCommands");
+
     // leave _commands containing just the ones we couldn't apply here
-    std::map<Word, Command *> original = _commands;
+    std::erase_if(_commands, [this](const std::pair<const Word, Command *> &cmd)
+                  { return cmd.second->Apply(this); });
+}
+
+void KamekFile::CoalesceWrites()
+{
+    Stats::Scope scope("CoalesceWrites");
 
-    for (std::pair<const Word, Command *> cmd : original)
+    // _commands is ordered by address, so a run is a sequence of entries where
+    // each write starts exactly where the previous one ended. Anything else in
+    // between (a branch, a conditional write, an overlap) ends the run, which
+    // keeps every write in the order it would have been applied in.
+    for (auto it = _commands.begin(); it != _commands.end();)
     {
-        Command *value = cmd.second;
-        if (!value->Apply(this))
+        auto first = dynamic_cast<WriteCommand *>(it->second);
+        if (first == nullptr || !BlockWriteCommand::CanMerge(first))
+        {
+            ++it;
+            continue;
+        }
+
+        auto end = std::next(it);
+        Word next = first->_Address + (long)first->PatchSize();
+        for (; end != _commands.end(); ++end)
+        {
+            auto cmd = dynamic_cast<WriteCommand *>(end->second);
+            if (cmd == nullptr || !BlockWriteCommand::CanMerge(cmd) || cmd->_Address.Type != next.Type || cmd->_Address.Value != next.Value)
+                break;
+            next += cmd->PatchSize();
+        }
+
+        if (std::distance(it, end) < 2)
         {
-            _commands[value->_Address] = value;
+            it = end;
+            continue;
         }
+
+        auto block = _arena->New<BlockWriteCommand>(first->_Address);
+        for (auto merged = it; merged != end; ++merged)
+            block->Append((WriteCommand *)merged->second);
+
+        Stats::Count("writes.coalesced", std::distance(it, end));
+        Stats::Count("writes.blocks");
+        it = _commands.erase(it, end);
+        _commands[block->_Address] = block;
     }
 }
 
-sized_array *KamekFile::Pack()
+void KamekFile::ResolveInlines()
 {
-    sized_array *ms = new sized_array(32 * 1024 * 1024);
-    BinaryWriter *bw = new BinaryWriter(ms->data);
+    Stats::Scope scope("ResolveInlines");
+
+    for (auto &pair : _commands)
+    {
+        if (auto inlined = dynamic_cast<InlineCommand *>(pair.second))
+            inlined->Resolve(this);
+    }
+}
+
+void KamekFile::Prelink(uint preferredBase)
+{
+    Stats::Scope scope("Prelink");
+
+    if (_baseAddress.Type != WordType::RelativeAddr)
+        writeline("only dynamically linked binaries can be prelinked");
+
+    _prelinked = true;
+    _preferredBase = preferredBase;
+
+    // Pre-apply every intra-blob pointer as if the blob was loaded at the
+    // preferred address, remembering where they are instead of keeping them
+    // around as loader commands
+    struct Entry
+    {
+        uint offset;
+        RebaseType type;
+        ushort low;
+    };
+    std::vector<Entry> entries;
+
+    std::erase_if(_commands, [&](const std::pair<const Word, Command *> &pair)
+                  {
+        auto reloc = dynamic_cast<RelocCommand *>(pair.second);
+        if (reloc == nullptr || !reloc->_Address.IsRelative() || !reloc->Target.IsRelative())
+            return false;
+
+        uint value = preferredBase + reloc->Target.Value;
+        ushort high = (ushort)(value >> 16);
+        switch (reloc->Id)
+        {
+        case Command::Ids::Addr32:
+            WriteUInt32(reloc->_Address, value);
+            entries.push_back(Entry{.offset = reloc->_Address.Value, .type = RebaseHighLow});
+            return true;
+        case Command::Ids::Addr16Lo:
+            WriteUInt16(reloc->_Address, (ushort)(value & 0xFFFF));
+            entries.push_back(Entry{.offset = reloc->_Address.Value, .type = RebaseLow});
+            return true;
+        case Command::Ids::Addr16Hi:
+            WriteUInt16(reloc->_Address, high);
+            entries.push_back(Entry{.offset = reloc->_Address.Value, .type = RebaseHigh, .low = (ushort)(value & 0xFFFF)});
+            return true;
+        case Command::Ids::Addr16Ha:
+            if ((value & 0x8000) == 0x8000)
+                high++;
+            WriteUInt16(reloc->_Address, high);
+            entries.push_back(Entry{.offset = reloc->_Address.Value, .type = RebaseHighAdj, .low = (ushort)(value & 0xFFFF)});
+            return true;
+        default:
+            return false;
+        } });
+
+    // _commands is ordered by address, so the entries already are too.
+    // Each 4 KiB page gets a block: page offset, block size, then one
+    // (type << 12 | offset in page) halfword per entry, padded to 4 bytes.
+    _rebaseTable.clear();
+    for (size_t i = 0; i < entries.size();)
+    {
+        uint page = entries[i].offset & ~0xFFFU;
+        size_t blockStart = _rebaseTable.size();
+        _rebaseTable.resize(blockStart + 8);
+
+        for (; i < entries.size() && (entries[i].offset & ~0xFFFU) == page; i++)
+        {
+            ushort entry = (ushort)((entries[i].type << 12) | (entries[i].offset & 0xFFF));
+            _rebaseTable.push_back((byte)(entry >> 8));
+            _rebaseTable.push_back((byte)entry);
+            if (entries[i].type == RebaseHigh || entries[i].type == RebaseHighAdj)
+            {
+                _rebaseTable.push_back((byte)(entries[i].low >> 8));
+                _rebaseTable.push_back((byte)entries[i].low);
+            }
+        }
+        if ((_rebaseTable.size() % 4) != 0)
+        {
+            _rebaseTable.push_back(0);
+            _rebaseTable.push_back(RebasePadding);
+        }
 
-    bw->WriteBE((uint)0x4B616D65); // 'Kamek\0\0\2'
-    bw->WriteBE((uint)0x6B000002);
+        Util::InjectUInt32(_rebaseTable.data(), blockStart, page);
+        Util::InjectUInt32(_rebaseTable.data(), blockStart + 4, (uint)(_rebaseTable.size() - blockStart));
+    }
+
+    Stats::Count("rebase.entries", entries.size());
+    Stats::Count("rebase.bytes", _rebaseTable.size());
+}
+
+void KamekFile::Pack(std::vector<byte> *output)
+{
+    Stats::Scope scope("Pack");
+
+    output->resize(PackedSize());
+    BinaryWriter writer(output->data());
+    BinaryWriter *bw = &writer;
+
+    // Prelinked binaries are version 3: the last two header words hold the
+    // preferred load address and the size of the rebase table that follows
+    // the blob. The loader only walks that table if it had to load the
+    // blob anywhere else.
+    bw->WriteBE((uint)0x4B616D65); // 'Kamek\0\0\2' (or 3)
+    bw->WriteBE((uint)(_prelinked ? 0x6B000003 : 0x6B000002));
     bw->WriteBE((uint)_bssSize);
     bw->WriteBE((uint)_codeBlob->length);
     bw->WriteBE((uint)_ctorStart);
     bw->WriteBE((uint)_ctorEnd);
-    bw->WriteBE((uint)0);
-    bw->WriteBE((uint)0);
+    bw->WriteBE((uint)_preferredBase);
+    bw->WriteBE((uint)_rebaseTable.size());
 
     bw->Write(_codeBlob);
 
-    for (auto pair : _commands)
+    if (_prelinked)
+    {
+        sized_array table(_rebaseTable.data(), _rebaseTable.size());
+        bw->Write(&table);
+    }
+
+    for (auto &pair : _commands)
     {
         pair.second->AssertAddressNonNull();
-        uint cmdID = (uint)pair.second->Id << 24;
-        if (pair.second->_Address.IsRelative())
-        {
-            if (pair.second->_Address.Value > 0xFFFFFF)
-                writeline("Address too high for packed command");
 
-            cmdID |= pair.second->_Address.Value;
-            bw->WriteBE(cmdID);
-        }
-        else
+        auto block = dynamic_cast<BlockWriteCommand *>(pair.second);
+        if (block != nullptr && !_loaderBlockWrites)
         {
-            cmdID |= 0xFFFFFE;
-            bw->WriteBE(cmdID);
-            bw->WriteBE(pair.second->_Address.Value);
+            block->ForEachPiece([&](uint address, uint size, uint value)
+                                {
+                auto id = (size == 4) ? Command::Ids::Write32 : (size == 2) ? Command::Ids::Write16 : Command::Ids::Write8;
+                WriteCommandHeader(bw, id, {block->_Address.Type, address});
+                bw->WriteBE(value); });
+            continue;
         }
+
+        WriteCommandHeader(bw, pair.second->Id, pair.second->_Address);
         pair.second->WriteArguments(bw);
+
+        // an inline call that fell back to a bl still replaces its region
+        if (auto inlined = dynamic_cast<InlineCommand *>(pair.second))
+        {
+            inlined->ForEachFill([&](uint address)
+                                 {
+                WriteCommandHeader(bw, Command::Ids::Write32, {WordType::AbsoluteAddr, address});
+                bw->WriteBE(InlineCommand::Nop); });
+        }
     }
 
-    return ms;
+    output->resize(writer.position);
 }
 
-std::string join(const std::vector<std::string> &sequence, const std::string &separator)
+size_t KamekFile::PackedSize()
 {
-    std::string result;
-    for (size_t i = 0; i < sequence.size(); ++i)
-        result += sequence[i] + ((i != sequence.size() - 1) ? separator : "");
-    return result;
+    size_t size = 32 + _codeBlob->length + (_prelinked ? _rebaseTable.size() : 0);
+    for (auto &pair : _commands)
+        size += PackedSize(pair.second);
+    return size;
 }
 
-std::string KamekFile::PackRiivolution()
+uint KamekFile::PackedSize(Command *cmd)
 {
-    if (_baseAddress.Type == WordType::RelativeAddr)
-        writeline("cannot pack a dynamically linked binary as a Riivolution patch");
+    uint header = cmd->_Address.IsRelative() ? 4 : 8;
 
-    std::vector<std::string> elements;
+    auto block = dynamic_cast<BlockWriteCommand *>(cmd);
+    if (block != nullptr && !_loaderBlockWrites)
+    {
+        uint size = 0;
+        block->ForEachPiece([&](uint, uint, uint)
+                            { size += header + 4; });
+        return size;
+    }
+    uint size = header + cmd->ArgumentsSize();
+    if (auto inlined = dynamic_cast<InlineCommand *>(cmd))
+        size += (inlined->_fillBytes / 4) * 12;
+    return size;
+}
 
-    if (_codeBlob->length > 0)
+// A command starts with its id in the top byte, then either a 24-bit offset
+// into the blob, or 0xFFFFFE and a word holding the absolute address
+void KamekFile::WriteCommandHeader(BinaryWriter *bw, byte id, Word address)
+{
+    uint cmdID = (uint)id << 24;
+    if (address.IsRelative())
     {
-        // add the big patch
-        // (todo: valuefile support)
-        std::string sb = "";
-        for (int i = 0; i < _codeBlob->length; i++)
-            sb += std::format("{0:2X}", _codeBlob->data[i]);
+        if (address.Value > 0xFFFFFF)
+            writeline("Address too high for packed command");
 
-        elements.push_back(std::format("<memory offset='0x{0:8X}' value='{1}' />", _baseAddress.Value, sb));
+        cmdID |= address.Value;
+        bw->WriteBE(cmdID);
     }
+    else
+    {
+        cmdID |= 0xFFFFFE;
+        bw->WriteBE(cmdID);
+        bw->WriteBE(address.Value);
+    }
+}
 
-    // add individual patches
-    for (auto pair : _commands)
-        elements.push_back(pair.second->PackForRiivolution());
+static const char HexDigits[] = "0123456789ABCDEF";
 
-    return join(elements, "\n");
+static void AppendHex(std::string &output, ulong value, int digits)
+{
+    char buffer[16];
+    for (int i = digits - 1; i >= 0; i--, value >>= 4)
+        buffer[i] = HexDigits[value & 0xF];
+    output.append(buffer, digits);
 }
 
-std::string KamekFile::PackDolphin()
+static void AppendCode(std::string &output, ulong code)
 {
-    if (_baseAddress.Type == WordType::RelativeAddr)
-        writeline("cannot pack a dynamically linked binary as a Dolphin patch");
+    AppendHex(output, code >> 32, 8);
+    output += ' ';
+    AppendHex(output, code & 0xFFFFFFFF, 8);
+    output += '\n';
+}
 
-    std::vector<std::string> elements;
+void KamekFile::PackText(const TextOutputs &outputs)
+{
+    Stats::Scope scope("PackText");
+
+    if (_baseAddress.Type == WordType::RelativeAddr)
+        writeline("cannot pack a dynamically linked binary as a Riivolution, Dolphin, Gecko or Action Replay patch");
 
     // add the big patch
-    int i = 0;
-    while (i < _codeBlob->length)
+    if (outputs.riivolution != nullptr && _codeBlob->length > 0)
     {
-        std::string sb = "";
-        sb += std::format("0x{0:8X}:", _baseAddress.Value + i);
-
-        int lineLength;
-        switch (_codeBlob->length - i)
+        // (todo: valuefile support)
+        std::string &sb = *outputs.riivolution;
+        sb.reserve(sb.size() + 48 + (_codeBlob->length * 2));
+        sb += "<memory offset='0x";
+        AppendHex(sb, _baseAddress.Value, 8);
+        sb += "' value='";
+        size_t hexStart = sb.size();
+        sb.resize(hexStart + (_codeBlob->length * 2));
+        for (uint i = 0; i < _codeBlob->length; i++)
         {
-        case 1:
-            lineLength = 1;
-            sb += ("byte:0x000000");
-            break;
-        case 2:
-        case 3:
-            lineLength = 2;
-            sb += ("word:0x0000");
-            break;
-        default:
-            lineLength = 4;
-            sb += ("dword:0x");
-            break;
+            sb[hexStart + (i * 2)] = HexDigits[_codeBlob->data[i] >> 4];
+            sb[hexStart + (i * 2) + 1] = HexDigits[_codeBlob->data[i] & 0xF];
         }
+        sb += "' />\n";
+    }
 
-        for (int j = 0; j < lineLength; j++, i++)
-            sb+=std::format("{0:2X}", _codeBlob->data[i]);
+    if (outputs.dolphin != nullptr)
+    {
+        std::string &sb = *outputs.dolphin;
+        sb.reserve(sb.size() + (_codeBlob->length / 4) * 28);
 
-        elements.push_back(sb);
-    }
+        uint i = 0;
+        while (i < _codeBlob->length)
+        {
+            sb += "0x";
+            AppendHex(sb, _baseAddress.Value + i, 8);
 
-    // add individual patches
-    for (auto pair : _commands)
-        elements.push_back(pair.second->PackForDolphin());
+            int lineLength;
+            switch (_codeBlob->length - i)
+            {
+            case 1:
+                lineLength = 1;
+                sb += (":byte:0x000000");
+                break;
+            case 2:
+            case 3:
+                lineLength = 2;
+                sb += (":word:0x0000");
+                break;
+            default:
+                lineLength = 4;
+                sb += (":dword:0x");
+                break;
+            }
 
-    return join(elements, "\n");
-}
+            for (int j = 0; j < lineLength; j++, i++)
+                AppendHex(sb, _codeBlob->data[i], 2);
+            sb += '\n';
+        }
+    }
 
-std::string KamekFile::PackGeckoCodes()
-{
-    if (_baseAddress.Type == WordType::RelativeAddr)
-        writeline("cannot pack a dynamically linked binary as a Gecko code");
+    // The codehandler runs the whole list every frame. For run-once codes,
+    // everything sits behind an "if not equal" (22) on the first nonzero word
+    // of the blob: on the first frame it doesn't match yet, so the blob is
+    // copied and the patches applied, and from then on that one check is all
+    // that runs. If the game ever overwrites the blob, it just gets put back.
+    // Patches are only applied that one time, though: anything the game
+    // loads or reinitialises afterwards (REL modules, heap tables) keeps its
+    // original contents.
+    bool geckoRunOnce = false;
+    if (outputs.gecko != nullptr && outputs.geckoRunOnce)
+    {
+        uint guard = 0;
+        while (guard + 4 <= _codeBlob->length && Util::ExtractUInt32(_codeBlob->data, guard) == 0)
+            guard += 4;
 
-    std::vector<ulong> codes;
+        if (guard + 4 <= _codeBlob->length)
+        {
+            ulong check = 0x22000000ULL << 32;
+            check |= (ulong)((_baseAddress.Value + guard) & 0x1FFFFFF) << 32;
+            check |= Util::ExtractUInt32(_codeBlob->data, guard);
+            AppendCode(*outputs.gecko, check);
+            geckoRunOnce = true;
+        }
+        else
+            writeline("warning: the code blob has no nonzero word to guard run-once Gecko codes with; they will run every frame");
+    }
 
-    if (_codeBlob->length > 0)
+    if (outputs.gecko != nullptr && _codeBlob->length > 0)
     {
-        // add the big patch
+        std::string &sb = *outputs.gecko;
+        sb.reserve(sb.size() + 18 + (_codeBlob->length / 8) * 18);
+
         long paddingSize = 0;
         if ((_codeBlob->length % 8) != 0)
             paddingSize = 8 - (_codeBlob->length % 8);
@@ -245,99 +503,232 @@ std::string KamekFile::PackGeckoCodes()
         ulong header = 0x06000000ULL << 32;
         header |= (ulong)(_baseAddress.Value & 0x1FFFFFF) << 32;
         header |= (ulong)(_codeBlob->length + paddingSize) & 0xFFFFFFFF;
-        codes.push_back(header);
+        AppendCode(sb, header);
 
-        for (int i = 0; i < _codeBlob->length; i += 8)
+        for (uint i = 0; i < _codeBlob->length; i += 8)
         {
             ulong bits = 0;
-            if (i < _codeBlob->length)
-                bits |= (ulong)_codeBlob->data[i] << 56;
-            if ((i + 1) < _codeBlob->length)
-                bits |= (ulong)_codeBlob->data[i + 1] << 48;
-            if ((i + 2) < _codeBlob->length)
-                bits |= (ulong)_codeBlob->data[i + 2] << 40;
-            if ((i + 3) < _codeBlob->length)
-                bits |= (ulong)_codeBlob->data[i + 3] << 32;
-            if ((i + 4) < _codeBlob->length)
-                bits |= (ulong)_codeBlob->data[i + 4] << 24;
-            if ((i + 5) < _codeBlob->length)
-                bits |= (ulong)_codeBlob->data[i + 5] << 16;
-            if ((i + 6) < _codeBlob->length)
-                bits |= (ulong)_codeBlob->data[i + 6] << 8;
-            if ((i + 7) < _codeBlob->length)
-                bits |= (ulong)_codeBlob->data[i + 7];
-            codes.push_back(bits);
+            for (int j = 0; j < 8; j++)
+            {
+                if ((i + j) < _codeBlob->length)
+                    bits |= (ulong)_codeBlob->data[i + j] << (56 - (j * 8));
+            }
+            AppendCode(sb, bits);
         }
     }
 
-    // // add individual patches
-    // for (auto pair : _commands)
-    //     codes.AddRange(pair.second->PackGeckoCodes());
+    if (outputs.actionReplay != nullptr)
+    {
+        std::string &sb = *outputs.actionReplay;
+        sb.reserve(sb.size() + (_codeBlob->length / 4) * 18);
 
-    // // convert everything
-    // auto elements = new string[codes.Count];
-    // for (int i = 0; i < codes.Count; i++)
-    //     elements[i] = string.Format("{0:X8} {1:X8}", codes[i] >> 32, codes[i] & 0xFFFFFFFF);
+        for (uint i = 0; i < _codeBlob->length; i += 4)
+        {
+            ulong bits = 0x04000000ULL << 32;
+            bits |= (ulong)((_baseAddress.Value + i) & 0x1FFFFFF) << 32;
+            for (int j = 0; j < 4; j++)
+            {
+                if ((i + j) < _codeBlob->length)
+                    bits |= (ulong)_codeBlob->data[i + j] << (24 - (j * 8));
+            }
+            AppendCode(sb, bits);
+        }
+    }
 
-    // return string.Join("\n", elements);
+    // add individual patches, feeding every requested format from one walk
+    std::vector<ulong> codes;
+    for (auto &pair : _commands)
+    {
+        Command *cmd = pair.second;
 
-    
-    // add individual patches
-    for (auto pair : _commands)
-        for (auto code : pair.second->PackGeckoCodes())
+        if (outputs.riivolution != nullptr)
+            cmd->PackForRiivolution(*outputs.riivolution);
+        if (outputs.dolphin != nullptr)
+            cmd->PackForDolphin(*outputs.dolphin);
+        if (outputs.gecko != nullptr)
+        {
+            codes.clear();
+            cmd->PackGeckoCodes(codes);
+            for (ulong code : codes)
+                AppendCode(*outputs.gecko, code);
+        }
+        if (outputs.actionReplay != nullptr)
         {
-            codes.push_back(code);
+            codes.clear();
+            cmd->PackActionReplayCodes(codes);
+            for (ulong code : codes)
+                AppendCode(*outputs.actionReplay, code);
         }
+    }
+
+    // full terminator: closes the run-once block (and anything still open in it)
+    if (geckoRunOnce)
+        AppendCode(*outputs.gecko, 0xE000000080008000ULL);
+}
+
+std::string KamekFile::PackRiivolution()
+{
+    std::string text;
+    PackText(TextOutputs{.riivolution = &text});
+    return text;
+}
 
-    // convert everything
-    std::vector<std::string> elements;
-    for (int i = 0; i < codes.size(); i++)
-        elements.push_back(std::format("{0:8X} {1:8X}", codes[i] >> 32, codes[i] & 0xFFFFFFFF));
+std::string KamekFile::PackDolphin()
+{
+    std::string text;
+    PackText(TextOutputs{.dolphin = &text});
+    return text;
+}
 
-    return join(elements, "\n");
+std::string KamekFile::PackGeckoCodes()
+{
+    std::string text;
+    PackText(TextOutputs{.gecko = &text});
+    return text;
 }
 
 std::string KamekFile::PackActionReplayCodes()
 {
+    std::string text;
+    PackText(TextOutputs{.actionReplay = &text});
+    return text;
+}
+
+std::string KamekFile::PackSymbolMap()
+{
+    Stats::Scope scope("PackSymbolMap");
+
     if (_baseAddress.Type == WordType::RelativeAddr)
-        writeline("cannot pack a dynamically linked binary as an Action Replay code");
+        writeline("cannot write a symbol map for a dynamically linked binary");
 
-    std::vector<ulong> codes;
+    // Dolphin treats everything listed under a "text" layout as code; the
+    // code ends where the constructor table (and the data after it) starts
+    uint codeEnd = _baseAddress.Value + _ctorStart;
 
-    // add the big patch
-    for (int i = 0; i < _codeBlob->length; i += 4)
+    std::string text = ".text section layout\n";
+    std::string data = ".data section layout\n";
+
+    auto inBlob = [this](const SymbolIndex::Entry *symbol)
+    {
+        return symbol->type == _baseAddress.Type && symbol->start - _baseAddress.Value < _codeBlob->length + _bssSize;
+    };
+
+    // Mark the game code we patched, named after the hook and where it leads;
+    // these are listed with our own code, in address order
+    std::vector<std::pair<uint, std::string>> hookSites;
+    for (Hook *hook : _hooks)
     {
-        ulong bits = 0x04000000ULL << 32;
-        bits |= (ulong)((_baseAddress.Value + i) & 0x1FFFFFF) << 32;
-        if (i < _codeBlob->length)
-            bits |= (ulong)_codeBlob->data[i] << 24;
-        if ((i + 1) < _codeBlob->length)
-            bits |= (ulong)_codeBlob->data[i + 1] << 16;
-        if ((i + 2) < _codeBlob->length)
-            bits |= (ulong)_codeBlob->data[i + 2] << 8;
-        if ((i + 3) < _codeBlob->length)
-            bits |= (ulong)_codeBlob->data[i + 3];
-        codes.push_back(bits);
+        for (Command *cmd : hook->Commands)
+        {
+            if (!cmd->_Address.IsAbsolute() || Contains(cmd->_Address))
+                continue;
+
+            std::string kind = "kmWrite";
+            Word target = {WordType::Value, 0};
+            uint size = 4;
+            if (auto inlined = dynamic_cast<InlineCommand *>(cmd); inlined != nullptr && !inlined->Words().empty())
+            {
+                kind = "kmInline";
+                target = inlined->Target;
+                size = (uint)inlined->Words().size() * 4;
+            }
+            else if (auto branch = dynamic_cast<BranchCommand *>(cmd))
+            {
+                kind = (branch->Id == Command::Ids::BranchLink) ? "kmCall" : "kmBranch";
+                target = branch->Target;
+                size = branch->PatchSize();
+            }
+            else if (auto patchExit = dynamic_cast<PatchExitCommand *>(cmd))
+            {
+                kind = "kmPatchExit";
+                target = patchExit->Target;
+            }
+
+            std::string name = std::format("__{0}_{1:08x}", kind, cmd->_Address.Value);
+            if (target.IsAbsolute())
+            {
+                const SymbolIndex::Entry *dest = _symbolIndex->At(target);
+                name += (dest != nullptr && inBlob(dest)) ? "_to_" + _symbolIndex->Name(dest) : std::format("_to_{0:08x}", target.Value);
+            }
+
+            hookSites.emplace_back(cmd->_Address.Value, std::format("{0:08x} {1:08x} {0:08x} 0 {2}\n", cmd->_Address.Value, size, name));
+        }
     }
+    std::sort(hookSites.begin(), hookSites.end());
 
-    // add individual patches
-    for (auto pair : _commands)
-        // codes.AddRange(pair.second->PackActionReplayCodes());
-        for (auto code : pair.second->PackActionReplayCodes())
+    // One name per address (the primary symbol there), for what ended up in
+    // the code blob or .bss
+    size_t nextSite = 0;
+    for (const SymbolIndex::Entry &symbol : _symbolIndex->_entries)
+    {
+        if (!symbol.isPrimary || !inBlob(&symbol))
+            continue;
+
+        std::string line = std::format("{0:08x} {1:08x} {0:08x} 0 {2}\n", symbol.start, symbol.size, _symbolIndex->Name(&symbol));
+        if (symbol.start < codeEnd)
         {
-            codes.push_back(code);
+            for (; nextSite < hookSites.size() && hookSites[nextSite].first < symbol.start; nextSite++)
+                text += hookSites[nextSite].second;
+            text += line;
         }
+        else
+            data += line;
+    }
+    for (; nextSite < hookSites.size(); nextSite++)
+        text += hookSites[nextSite].second;
 
-    // convert everything
-    std::vector<std::string> elements;
-    for (int i = 0; i < codes.size(); i++)
-        elements.push_back(std::format("{0:8X} {1:8X}", codes[i] >> 32, codes[i] & 0xFFFFFFFF));
+    return text + "\n" + data;
+}
 
-    return join(elements, "\n");
+// Describes the counter table an instrumented build keeps in .bss, so a dump
+// of it can be turned into a cost per hook. One line per slot: its number,
+// where its counter is, the kind of hook, the game address it patches and the
+// function it times. In a dynamic link, addresses are offsets into the blob.
+std::string KamekFile::PackHookCounters()
+{
+    Stats::Scope scope("PackHookCounters");
+
+    auto address = [](Word word)
+    {
+        return word.IsRelative() ? std::format("+{0:08X}", word.Value) : std::format("{0:08X}", word.Value);
+    };
+
+    std::string text = "# Kamek hook counters\n";
+    text += "# each slot is 16 bytes, big-endian: time base ticks (64 bits), calls (32 bits), unused (32 bits)\n";
+    text += "# the time base runs at a quarter of the bus clock: 60.75 MHz on Wii, 40.5 MHz on GameCube\n";
+    text += "# slot counter kind site function\n";
+
+    for (const Linker::InstrumentedHook &instrumented : _instrumented)
+    {
+        // find the hook that now leads to this slot's stub
+        std::string kind = "kmBranch";
+        Word site = {WordType::Value, 0};
+        for (Hook *hook : _hooks)
+        {
+            for (Command *cmd : hook->Commands)
+            {
+                if (auto branch = dynamic_cast<BranchCommand *>(cmd); branch != nullptr && branch->Target.Type == instrumented.stub.Type && branch->Target.Value == instrumented.stub.Value)
+                {
+                    kind = (branch->Id == Command::Ids::BranchLink) ? "kmCall" : "kmBranch";
+                    site = branch->_Address;
+                }
+                else if (auto patchExit = dynamic_cast<PatchExitCommand *>(cmd); patchExit != nullptr && patchExit->Target.Type == instrumented.stub.Type && patchExit->Target.Value == instrumented.stub.Value)
+                {
+                    kind = "kmPatchExit";
+                    site = patchExit->_Address;
+                }
+            }
+        }
+
+        text += std::format("{0} {1} {2} {3} {4}\n", instrumented.slot, address(instrumented.counter), kind, address(site), _symbolIndex->Describe(instrumented.target));
+    }
+    return text;
 }
 
 void KamekFile::InjectIntoDol(Dol *dol)
 {
+    Stats::Scope scope("InjectIntoDol");
+
     if (_baseAddress.Type == WordType::RelativeAddr)
         writeline("cannot pack a dynamically linked binary into a DOL");
 
@@ -359,10 +750,10 @@ void KamekFile::InjectIntoDol(Dol *dol)
 
         // throw the code blob into it
         dol->Sections[victimSection].LoadAddress = _baseAddress.Value;
-        dol->Sections[victimSection].Data = _codeBlob;
+        *dol->Sections[victimSection].Data = sized_array(_codeBlob->data, _codeBlob->length);
     }
 
     // apply all patches
-    for (auto pair : _commands)
+    for (auto &pair : _commands)
         pair.second->ApplyToDol(dol);
 }
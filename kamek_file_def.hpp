@@ -3,6 +3,7 @@
 #include "common.hpp"
 #include "word.hpp"
 #include "linker.hpp"
+#include "symbol_index.hpp"
 #include "dol.hpp"
 
 class Command;
@@ -12,10 +13,13 @@ class AddressMapper;
 class KamekFile
 {
 public:
-    static sized_array *PackFrom(Linker *linker);
+    static void PackFrom(Linker *linker, std::vector<byte> *output);
+
+    // the linker's arena; everything this file allocates lives in it too
+    Arena *_arena = nullptr;
 
     Word _baseAddress;
-    sized_array *_codeBlob;
+    sized_array *_codeBlob = nullptr;
     long _bssSize;
     long _ctorStart;
     long _ctorEnd;
@@ -31,29 +35,89 @@ public:
 
     std::map<Word, Command *> _commands;
     std::vector<Hook *> _hooks;
-    std::map<Word, uint> _symbolSizes;
+
+    // the linker's symbols, which live in the same arena
+    const SymbolIndex *_symbolIndex = nullptr;
     AddressMapper *_mapper;
 
+    // the counter slots of the hooks the linker instrumented, if it did
+    std::vector<Linker::InstrumentedHook> _instrumented;
+
+    // Every section the linker placed in the blob or .bss, and what it spent
+    // on alignment; only read by the size report
+    struct Placement
+    {
+        std::string module, section;
+        Word base;
+        uint size;
+        bool isBss;
+    };
+    std::vector<Placement> _layout;
+    uint _layoutPadding = 0;
+
     void LoadFromLinker(Linker *linker);
 
-    void AddRelocsAsCommands(std::vector<Linker::Fixup *> relocs);
+    void AddRelocsAsCommands(const std::vector<Linker::Fixup *> &relocs);
 
-    void ApplyHook(Linker::HookData hookData);
+    void ApplyHook(const Linker::HookData &hookData);
 
     void ApplyStaticCommands();
-    sized_array *Pack();
 
-    std::string PackRiivolution();
+    // Merges unconditional writes to consecutive addresses into block writes
+    void CoalesceWrites();
+
+    // Decides, once, which inline hooks really get inlined; the packers only
+    // read the outcome
+    void ResolveInlines();
+
+    // Set by Prelink: the load address the blob was prelinked for, and the
+    // page-grouped table the loader uses when it has to put it elsewhere
+    bool _prelinked = false;
+    uint _preferredBase = 0;
+    std::vector<byte> _rebaseTable;
 
+    enum RebaseType : ushort
+    {
+        RebasePadding = 0,
+        RebaseHigh = 1,    // ADDR16_HI, followed by the low half of the prelinked value
+        RebaseLow = 2,     // ADDR16_LO
+        RebaseHighLow = 3, // ADDR32
+        RebaseHighAdj = 4, // ADDR16_HA, followed by the low half of the prelinked value
+    };
+
+    void Prelink(uint preferredBase);
+    // Whether Pack may emit block writes (command 39); loaders that predate
+    // it get each block as separate Write32/16/8 commands instead
+    bool _loaderBlockWrites = false;
+
+    // Packs the binary for the Kamek loader into output, replacing what was there
+    void Pack(std::vector<byte> *output);
+    static void WriteCommandHeader(BinaryWriter *bw, byte id, Word address);
+    // What Pack would produce, in bytes, in total or for one command
+    size_t PackedSize();
+    uint PackedSize(Command *cmd);
+
+    // Text formats for a static link; only the non-null ones are generated,
+    // all of them from a single walk over the commands
+    struct TextOutputs
+    {
+        std::string *riivolution = nullptr;
+        std::string *dolphin = nullptr;
+        std::string *gecko = nullptr;
+        std::string *actionReplay = nullptr;
+
+        // Wrap the Gecko codes in a block that only runs until the blob is in
+        // place, instead of redoing every write on every frame
+        bool geckoRunOnce = false;
+    };
+    void PackText(const TextOutputs &outputs);
+
+    std::string PackRiivolution();
     std::string PackDolphin();
     std::string PackGeckoCodes();
     std::string PackActionReplayCodes();
+    std::string PackSymbolMap();
+    std::string PackHookCounters();
 
     void InjectIntoDol(Dol *dol);
-
-    ~KamekFile()
-    {
-        delete _codeBlob;
-        delete _mapper;
-    }
 };
\ No newline at end of file
@@ -1,9 +1,18 @@
 #pragma once
 
+#include <bit>
+#include <deque>
+#include <set>
+#include <mutex>
+#include <unordered_map>
 #include "common.hpp"
 #include "address_mapper.hpp"
 #include "Elf.hpp"
 #include "word.hpp"
+#include "arena.hpp"
+#include "stats.hpp"
+#include "symbol_index.hpp"
+#include "thread_pool.hpp"
 
 class Linker
 {
@@ -11,19 +20,45 @@ public:
     bool _linked = false;
     std::vector<Elf *> _modules;
     AddressMapper *Mapper;
+    // owns everything allocated for this link, including what KamekFile builds from it
+    Arena *_arena;
 
     inline static std::vector<std::string> FixedUndefinedSymbols = std::vector<std::string>();
 
+    // Threads for the per-module parts of each phase; with 1, everything runs
+    // on the calling thread. The output doesn't depend on it.
+    uint Threads = 1;
+
+    // Broadway's cache lines are 32 bytes. With this set, every .text section
+    // starts on one, so a function doesn't share a line with the end of the
+    // one before it; it costs up to 28 bytes of padding per section.
+    static constexpr uint CacheLineSize = 32;
+    bool AlignTextToCacheLines = false;
+
+    // Rewrite long instruction sequences whose targets turn out to be in
+    // reach of a shorter form; see RelaxFixups
+    bool Relax = false;
+
+    // Time every kmBranch, kmCall and kmPatchExit target through a stub that
+    // counts calls and time base ticks; see InstrumentHookTargets
+    bool InstrumentHooks = false;
+
+    // Function names, hottest first; see OrderTextSections
+    const std::vector<std::string> *SymbolOrder = nullptr;
+    std::map<Elf::ElfSection *, uint> _textRanks;
+
     Word _baseAddress;
     Word _ctorStart, _ctorEnd;
     Word _outputStart, _outputEnd;
     Word _bssStart, _bssEnd;
     Word _kamekStart, _kamekEnd;
     byte *_memory = nullptr;
+    long _memorySize = 0;
 
-    Linker(AddressMapper *mapper)
+    Linker(AddressMapper *mapper, Arena *arena)
     {
         Mapper = mapper;
+        _arena = arena;
     }
 
     void AddModule(Elf *elf)
@@ -36,119 +71,359 @@ public:
         _modules.push_back(elf);
     }
 
-    void DoLink(std::map<std::string, uint> externalSymbols)
+    void DoLink(const std::map<std::string, uint> &externalSymbols)
     {
         if (_linked)
             writeline("This linker has already been linked");
         _linked = true;
 
-        // _externalSymbols = new std::map<std::string, uint>();
-        for (auto pair : externalSymbols)
-            _externalSymbols[pair.first] = Mapper->Remap(pair.second);
+        _externalSymbols = &externalSymbols;
 
         CollectSections();
         BuildSymbolTables();
         ProcessRelocations();
+        if (Relax)
+            RelaxFixups();
         ProcessHooks();
+        if (InstrumentHooks)
+            InstrumentHookTargets();
     }
 
-    void LinkStatic(uint baseAddress, std::map<std::string, uint> externalSymbols)
+    void LinkStatic(uint baseAddress, const std::map<std::string, uint> &externalSymbols)
     {
         _baseAddress = {WordType::AbsoluteAddr, Mapper->Remap(baseAddress)};
         DoLink(externalSymbols);
     }
-    void LinkDynamic(std::map<std::string, uint> externalSymbols)
+    void LinkDynamic(const std::map<std::string, uint> &externalSymbols)
     {
         _baseAddress = {WordType::RelativeAddr, 0};
         DoLink(externalSymbols);
     }
 
-    std::vector<sized_array *> _binaryBlobs;
+    struct SectionPlacement
+    {
+        Elf::ElfSection *section;
+        Word base;
+    };
+    std::vector<SectionPlacement> _placements;
     std::map<Elf::ElfSection *, Word> _sectionBases;
 
     Word _location;
+    // bytes spent aligning sections and groups, for the size report
+    uint _layoutPadding = 0;
+
+    // Runs work(i) for every module i on up to Threads threads. Shared tables
+    // may only be read by the work; anything it produces goes into the
+    // module's own slot and is merged afterwards, in module order, so the
+    // result is the same as running the modules one after another.
+    void ForEachModule(const std::function<void(size_t)> &work)
+    {
+        std::string version = Stats::CurrentVersion;
+        std::vector<std::function<void()>> tasks;
+        for (size_t i = 0; i < _modules.size(); i++)
+        {
+            tasks.push_back([&, i]()
+                            {
+                Stats::CurrentVersion = version;
+                work(i); });
+        }
+        ThreadPool::Run(tasks, Threads);
+    }
+
+    // What a section asks for in sh_addralign, and at least 4 bytes. In a
+    // dynamic link this is relative to the start of the blob, so the loader
+    // has to place it at least as aligned as the most aligned section.
+    uint SectionAlignment(Elf::ElfSection *s)
+    {
+        uint alignment = s->sh_addralign;
+        if (!std::has_single_bit(alignment))
+        {
+            if (alignment != 0)
+                writeline("warning: section %s has an alignment of %u, which isn't a power of two", s->name.c_str(), alignment);
+            alignment = 1;
+        }
+
+        alignment = std::max(alignment, 4U);
+        if (AlignTextToCacheLines && s->name.starts_with(".text"))
+            alignment = std::max(alignment, CacheLineSize);
+        return alignment;
+    }
 
-    void ImportSections(std::string prefix)
+    static uint PaddingFor(uint location, uint alignment)
     {
+        return (alignment - (location % alignment)) % alignment;
+    }
+
+    // The padding it takes to lay these sections out in this order from location
+    uint PaddingForLayout(const std::vector<Elf::ElfSection *> &sections, uint location)
+    {
+        uint padding = 0;
+        for (Elf::ElfSection *s : sections)
+        {
+            uint gap = PaddingFor(location, SectionAlignment(s));
+            padding += gap;
+            location += gap + s->sh_size;
+        }
+        return padding + PaddingFor(location, 4);
+    }
+
+    void ImportSections(const std::string &prefix)
+    {
+        std::vector<Elf::ElfSection *> sections;
         for (Elf *elf : _modules)
         {
-            // for (auto s :(from s : elf->_sections
-            //                       where s.name.starts_with(prefix)
-            //                           select s))
+            for (Elf::ElfSection *s : elf->_sections)
+            {
+                if (s->name.starts_with(prefix))
+                    sections.push_back(s);
+            }
+        }
+        if (sections.size() == 0)
+            return;
+
+        // The most aligned sections go first, so the gaps they'd leave are
+        // mostly filled with less aligned ones. Sections that are equally
+        // aligned stay in module order.
+        // A profile overrides that for .text, where keeping hot code together
+        // matters more than a few bytes of padding.
+        uint unsortedPadding = PaddingForLayout(sections, _location.Value);
+        if (prefix == ".text" && _textRanks.size() > 0)
+        {
+            auto rank = [this](Elf::ElfSection *s)
+            {
+                auto found = _textRanks.find(s);
+                return (found == _textRanks.end()) ? UINT32_MAX : found->second;
+            };
+            std::stable_sort(sections.begin(), sections.end(), [&](Elf::ElfSection *a, Elf::ElfSection *b)
+                             { return rank(a) < rank(b); });
+        }
+        else
+        {
+            std::stable_sort(sections.begin(), sections.end(), [this](Elf::ElfSection *a, Elf::ElfSection *b)
+                             { return SectionAlignment(a) > SectionAlignment(b); });
+        }
+        uint padding = PaddingForLayout(sections, _location.Value);
+
+        Stats::Count("layout.padding", padding);
+        if (unsortedPadding > padding)
+            Stats::Count("layout.padding.saved", unsortedPadding - padding);
+
+        _layoutPadding += padding;
+        for (Elf::ElfSection *s : sections)
+        {
+            _location += PaddingFor(_location.Value, SectionAlignment(s));
+
+            // Only decide where the section goes here; the bytes are
+            // copied once the final size of the arena is known
+            _placements.push_back(SectionPlacement{.section = s, .base = _location});
+            _sectionBases[s] = _location;
+            _location += s->sh_size;
+        }
+
+        // the next group starts at least word aligned
+        uint tail = PaddingFor(_location.Value, 4);
+        _layoutPadding += tail;
+        _location += tail;
+    }
+
+    // Ranks the .text sections for ImportSections from SymbolOrder: first the
+    // sections defining the listed functions, in that order, then whatever
+    // those call (directly or not, nearest first), so the hot path ends up in
+    // as few cache lines and pages as possible. Everything else is cold, and
+    // keeps module order behind them. Functions can only move as whole
+    // sections, so this needs objects built with -ffunction-sections.
+    void OrderTextSections()
+    {
+        Stats::Scope scope("OrderTextSections");
+
+        // which section defines each named function, and each symbol table's symbols
+        std::map<std::string, Elf::ElfSection *> definedIn;
+        std::map<Elf::ElfSection *, std::vector<Elf::Symbol>> symbolTables;
+        for (Elf *elf : _modules)
+        {
+            for (Elf::ElfSection *symtab : elf->_sections)
+            {
+                if (symtab->sh_type != Elf::ElfSection::Type::SHT_SYMTAB || symtab->data == nullptr)
+                    continue;
+                if (symtab->sh_link <= 0 || symtab->sh_link >= elf->_sections.size() || elf->_sections[symtab->sh_link]->data == nullptr)
+                    continue;
 
+                sized_array *strtab = elf->_sections[symtab->sh_link]->data;
+                std::vector<Elf::Symbol> &symbols = symbolTables[symtab] = Elf::DecodeSymbols(symtab->data);
+                for (size_t i = 1; i < symbols.size(); i++)
+                {
+                    if (symbols[i].st_shndx == 0 || symbols[i].st_shndx >= elf->_sections.size())
+                        continue;
+                    Elf::ElfSection *section = elf->_sections[symbols[i].st_shndx];
+                    if (!section->name.starts_with(".text"))
+                        continue;
+
+                    std::string name = Util::ExtractNullTerminatedString(strtab->data, strtab->length, (int)symbols[i].st_name);
+                    if (name.length() > 0)
+                        definedIn.try_emplace(name, section);
+                }
+            }
+        }
+
+        // the call graph, from the branches between .text sections
+        std::map<Elf::ElfSection *, std::vector<Elf::ElfSection *>> calls;
+        for (Elf *elf : _modules)
+        {
             for (Elf::ElfSection *s : elf->_sections)
             {
-                if (!s->name.starts_with(prefix))
+                if (s->sh_type != Elf::ElfSection::Type::SHT_RELA || s->data == nullptr)
+                    continue;
+                if (s->sh_info <= 0 || s->sh_info >= elf->_sections.size() || s->sh_link >= elf->_sections.size() || !symbolTables.contains(elf->_sections[s->sh_link]))
                     continue;
 
-                if (s->data != nullptr)
-                    _binaryBlobs.push_back(s->data);
-                else
-                    _binaryBlobs.push_back(new sized_array(s->sh_size));
+                Elf::ElfSection *caller = elf->_sections[s->sh_info];
+                if (!caller->name.starts_with(".text"))
+                    continue;
+
+                sized_array *strtab = elf->_sections[elf->_sections[s->sh_link]->sh_link]->data;
+                const std::vector<Elf::Symbol> &symbols = symbolTables.at(elf->_sections[s->sh_link]);
+                for (const Elf::Rela &rela : Elf::DecodeRelas(s->data))
+                {
+                    uint index = rela.r_info >> 8;
+                    if ((rela.r_info & 0xFF) != Elf::Reloc::R_PPC_REL24 || index >= symbols.size())
+                        continue;
+
+                    Elf::ElfSection *callee = nullptr;
+                    if (symbols[index].st_shndx != 0 && symbols[index].st_shndx < elf->_sections.size())
+                        callee = elf->_sections[symbols[index].st_shndx];
+                    else
+                    {
+                        auto found = definedIn.find(Util::ExtractNullTerminatedString(strtab->data, strtab->length, (int)symbols[index].st_name));
+                        if (found != definedIn.end())
+                            callee = found->second;
+                    }
 
-                _sectionBases[s] = _location;
-                _location += s->sh_size;
+                    if (callee != nullptr && callee != caller && callee->name.starts_with(".text"))
+                        calls[caller].push_back(callee);
+                }
+            }
+        }
 
-                // Align to 4 bytes
-                if ((_location.Value % 4) != 0)
+        uint next = 0;
+        std::deque<Elf::ElfSection *> pending;
+        for (const std::string &name : *SymbolOrder)
+        {
+            auto found = definedIn.find(name);
+            if (found == definedIn.end())
+                Stats::Count("order.missing");
+            else if (_textRanks.try_emplace(found->second, next).second)
+            {
+                next++;
+                pending.push_back(found->second);
+            }
+        }
+        uint hot = next;
+
+        while (!pending.empty())
+        {
+            Elf::ElfSection *caller = pending.front();
+            pending.pop_front();
+            for (Elf::ElfSection *callee : calls[caller])
+            {
+                if (_textRanks.try_emplace(callee, next).second)
                 {
-                    long alignment = 4 - (_location.Value % 4);
-                    _binaryBlobs.push_back(new sized_array(alignment));
-                    _location += alignment;
+                    next++;
+                    pending.push_back(callee);
                 }
             }
         }
+
+        Stats::Count("order.hot", hot);
+        Stats::Count("order.called", next - hot);
     }
 
     void CollectSections()
     {
+        Stats::Scope scope("CollectSections");
+
+        if (SymbolOrder != nullptr && SymbolOrder->size() > 0)
+            OrderTextSections();
+
         _location = _baseAddress;
 
         _outputStart = _location;
         ImportSections(".init");
         ImportSections(".fini");
         ImportSections(".text");
+        if (InstrumentHooks)
+        {
+            // room for a stub per hook that might be instrumented, and a
+            // counter slot each in .bss further down
+            _instrumentSlots = CountInstrumentableHooks();
+            _instrumentStubs = _location;
+            _location += _instrumentSlots * sizeof(InstrumentStub);
+        }
         _ctorStart = _location;
         ImportSections(".ctors");
         _ctorEnd = _location;
         ImportSections(".dtors");
         ImportSections(".rodata");
         ImportSections(".data");
+        // small data (.sdata and .sdata2, then .sbss and .sbss2) goes in one
+        // run, so it can all fit in the same 32 KiB as the base it's used from
+        ImportSections(".sdata");
         _outputEnd = _location;
 
         // TODO: maybe should align to 0x20 here?
         _bssStart = _location;
+        ImportSections(".sbss");
         ImportSections(".bss");
+        if (_instrumentSlots > 0)
+        {
+            uint padding = PaddingFor(_location.Value, 8);
+            _layoutPadding += padding;
+            _location += padding;
+            _instrumentCounters = _location;
+            _location += _instrumentSlots * InstrumentSlotSize;
+        }
         _bssEnd = _location;
 
         _kamekStart = _location;
         ImportSections(".kamek");
         _kamekEnd = _location;
 
-        // Create one big blob from this
-        _memory = new byte[_location - _baseAddress];
-        int position = 0;
-        for (sized_array *blob : _binaryBlobs)
+        // One zeroed arena holds the output range followed directly by the
+        // hook data; .bss only has a size and takes up no space in it
+        _memorySize = (_outputEnd - _outputStart) + (_kamekEnd - _kamekStart);
+        _memory = _arena->Allocate(_memorySize);
+
+        for (SectionPlacement &placement : _placements)
         {
-            memcpy(_memory, blob + position, blob->length);
-            position += blob->length;
+            Elf::ElfSection *s = placement.section;
+            if (s->sh_type == Elf::ElfSection::Type::SHT_NOBITS || s->data == nullptr)
+                continue;
+
+            memcpy(_memory + MemoryOffset(placement.base), s->data->data, s->data->length);
         }
     }
+
+    long MemoryOffset(Word addr)
+    {
+        if (addr >= _kamekStart && addr < _kamekEnd)
+            return (_outputEnd - _baseAddress) + (addr - _kamekStart);
+        return addr - _baseAddress;
+    }
+
     ushort ReadUInt16(Word addr)
     {
-        return Util::ExtractUInt16(_memory, addr - _baseAddress);
+        return Util::ExtractUInt16(_memory, MemoryOffset(addr));
     }
     uint ReadUInt32(Word addr)
     {
-        return Util::ExtractUInt32(_memory, addr - _baseAddress);
+        return Util::ExtractUInt32(_memory, MemoryOffset(addr));
     }
     void WriteUInt16(Word addr, ushort value)
     {
-        Util::InjectUInt16(_memory, addr - _baseAddress, value);
+        Util::InjectUInt16(_memory, MemoryOffset(addr), value);
     }
     void WriteUInt32(Word addr, uint value)
     {
-        Util::InjectUInt32(_memory, addr - _baseAddress, value);
+        Util::InjectUInt32(_memory, MemoryOffset(addr), value);
     }
 
     struct Symbol
@@ -164,22 +439,50 @@ public:
     };
     std::map<std::string, Symbol> _globalSymbols;
     std::map<Elf *, std::map<std::string, Symbol>> _localSymbols;
-    std::map<Elf::ElfSection *, sized_array *> _symbolTableContents; // sized array of type SymbolName[]
-    std::map<std::string, uint> _externalSymbols;
-    std::map<Word, uint> _symbolSizes;
+    std::map<Elf::ElfSection *, std::vector<SymbolName>> _symbolTableContents;
+    // The game's symbols as the caller gave them, before remapping; the map
+    // has to outlive the link. See ResolveExternal.
+    const std::map<std::string, uint> *_externalSymbols = nullptr;
+    std::mutex _externalsLock;
+    std::unordered_map<const std::string *, uint> _remappedExternals;
+    // everything above that this link defined, by address; lives in the arena
+    // so the KamekFile can keep using it after the linker is gone
+    SymbolIndex *_symbolIndex = nullptr;
+
+    // A global or weak definition found by ParseSymbolTable, for the shared table
+    struct Definition
+    {
+        std::string name;
+        Symbol symbol;
+        uint bind;
+    };
 
     void BuildSymbolTables()
     {
+        Stats::Scope scope("BuildSymbolTables");
+
         _globalSymbols["__ctor_loc"] = Symbol{.address = _ctorStart};
         _globalSymbols["__ctor_end"] = Symbol{.address = _ctorEnd};
 
+        // every table a module writes to exists before the modules are parsed
         for (Elf *elf : _modules)
         {
-            std::map<std::string, Symbol> locals;
-            _localSymbols[elf] = locals;
-
+            _localSymbols[elf];
             for (Elf::ElfSection *s : elf->_sections)
+            {
+                if (s->sh_type == Elf::ElfSection::Type::SHT_SYMTAB)
+                    _symbolTableContents[s];
+            }
+        }
+
+        std::vector<std::vector<Definition>> definitions(_modules.size());
+        ForEachModule([&](size_t i)
+                      {
+            Elf *elf = _modules[i];
+            Stats::Scope moduleScope("ParseSymbolTable", elf->_name);
+            std::map<std::string, Symbol> &locals = _localSymbols.at(elf);
 
+            for (Elf::ElfSection *s : elf->_sections)
             {
                 if (s->sh_type != Elf::ElfSection::Type::SHT_SYMTAB)
                     continue;
@@ -190,12 +493,59 @@ public:
 
                 auto strtab = elf->_sections[(int)strTabIdx];
 
-                _symbolTableContents[s] = ParseSymbolTable(elf, s, strtab, locals);
+                _symbolTableContents.at(s) = ParseSymbolTable(elf, s, strtab, locals, &definitions[i]);
+            }
+
+            Stats::Count("symbols.local", locals.size()); });
+
+        for (std::vector<Definition> &moduleDefinitions : definitions)
+        {
+            for (Definition &definition : moduleDefinitions)
+                Define(definition);
+        }
+
+        Stats::Count("symbols.global", _globalSymbols.size());
+        BuildSymbolIndex();
+    }
+
+    void BuildSymbolIndex()
+    {
+        _symbolIndex = _arena->New<SymbolIndex>();
+        for (auto &pair : _globalSymbols)
+            _symbolIndex->Add(pair.first, pair.second.address, pair.second.size, true);
+        for (auto &module : _localSymbols)
+        {
+            for (auto &pair : module.second)
+                _symbolIndex->Add(pair.first, pair.second.address, pair.second.size, false);
+        }
+        _symbolIndex->Finish();
+    }
+
+    // Strong definitions replace weak ones, and weak ones never replace anything
+    void Define(Definition &definition)
+    {
+        const Symbol &symbol = definition.symbol;
+        switch (definition.bind)
+        {
+        case Elf::SymBind::STB_GLOBAL:
+        {
+            auto existing = _globalSymbols.find(definition.name);
+            if (existing != _globalSymbols.end() && !existing->second.isWeak)
+            {
+                writeline("redefinition of global symbol %s\n", definition.name.c_str());
             }
+            _globalSymbols[std::move(definition.name)] = symbol;
+            break;
+        }
+
+        case Elf::SymBind::STB_WEAK:
+            _globalSymbols.try_emplace(std::move(definition.name), symbol);
+            break;
         }
     }
 
-    sized_array *ParseSymbolTable(Elf *elf, Elf::ElfSection *symtab, Elf::ElfSection *strtab, std::map<std::string, Symbol> locals)
+    // Fills in the module's locals; everything else is added to definitions, in table order
+    std::vector<SymbolName> ParseSymbolTable(Elf *elf, Elf::ElfSection *symtab, Elf::ElfSection *strtab, std::map<std::string, Symbol> &locals, std::vector<Definition> *definitions)
     {
         if (symtab->sh_entsize != 16)
             writeline("Invalid symbol table format (sh_entsize != 16)");
@@ -203,27 +553,26 @@ public:
             writeline("std::string table does not have type SHT_STRTAB");
 
         std::vector<SymbolName> symbolNames;
-        auto reader = new BinaryReader(symtab->data->data);
-        int count = symtab->data->length / 16;
+        std::vector<Elf::Symbol> symbols = Elf::DecodeSymbols(symtab->data);
+        int count = (int)symbols.size();
+        symbolNames.reserve(count);
 
         // always ignore the first symbol
         symbolNames.push_back({});
-        reader->position = 16;
 
         for (int i = 1; i < count; i++)
         {
             // Read info from the ELF
-            uint st_name = reader->ReadBigUInt32();
-            uint st_value = reader->ReadBigUInt32();
-            uint st_size = reader->ReadBigUInt32();
-            byte st_info = reader->ReadByte();
-            byte st_other = reader->ReadByte();
-            ushort st_shndx = reader->ReadBigUInt16();
+            uint st_name = symbols[i].st_name;
+            uint st_value = symbols[i].st_value;
+            uint st_size = symbols[i].st_size;
+            byte st_info = symbols[i].st_info;
+            ushort st_shndx = symbols[i].st_shndx;
 
             uint bind = st_info >> 4;
             uint type = st_info & 0xF;
 
-            std::string name = Util::ExtractNullTerminatedString(strtab->data->data, (int)st_name, 0);
+            std::string name = Util::ExtractNullTerminatedString(strtab->data->data, strtab->data->length, (int)st_name);
 
             symbolNames.push_back(SymbolName{.name = name, .shndx = st_shndx});
             if (name.length() == 0 || st_shndx == 0)
@@ -238,10 +587,10 @@ public:
             else if (st_shndx < 0xFF00)
             {
                 // Part of a section
-                auto section = elf->_sections[st_shndx];
-                if (!_sectionBases.contains(section))
+                auto base = _sectionBases.find(elf->_sections[st_shndx]);
+                if (base == _sectionBases.end())
                     continue; // skips past symbols we don't care about, like DWARF junk
-                addr = _sectionBases[section] + st_value;
+                addr = base->second + st_value;
             }
             else
                 writeline("unknown section index found : symbol table");
@@ -250,56 +599,73 @@ public:
             {
             case Elf::SymBind::STB_LOCAL:
                 if (locals.contains(name))
-                    writeline("redefinition of local symbol %s\n", name);
+                    writeline("redefinition of local symbol %s\n", name.c_str());
                 locals[name] = Symbol{.address = addr, .size = st_size};
-                _symbolSizes[addr] = st_size;
                 break;
 
             case Elf::SymBind::STB_GLOBAL:
-                if (_globalSymbols.contains(name) && !_globalSymbols[name].isWeak)
-                {
-                    writeline("redefinition of global symbol %s\n", name);
-                }
-                _globalSymbols[name] = Symbol{.address = addr, .size = st_size};
-                _symbolSizes[addr] = st_size;
+                definitions->push_back(Definition{.name = std::move(name), .symbol = Symbol{.address = addr, .size = st_size}, .bind = bind});
                 break;
 
             case Elf::SymBind::STB_WEAK:
-                if (!_globalSymbols.contains(name))
-                {
-                    _globalSymbols[name] = Symbol{.address = addr, .size = st_size, .isWeak = true};
-                    _symbolSizes[addr] = st_size;
-                }
+                definitions->push_back(Definition{.name = std::move(name), .symbol = Symbol{.address = addr, .size = st_size, .isWeak = true}, .bind = bind});
                 break;
             }
         }
-        return new sized_array((byte *)symbolNames.data(), symbolNames.size() * sizeof(SymbolName));
+        return symbolNames;
     };
 
-    Symbol ResolveSymbol(Elf *elf, std::string name)
+    // An external's address for this version. Externals files list far more
+    // symbols than a mod uses, so each one is only remapped the first time it
+    // is referenced, and remembered after that; false if there's no such external
+    bool ResolveExternal(const std::string &name, uint *address)
+    {
+        if (_externalSymbols == nullptr)
+            return false;
+        auto external = _externalSymbols->find(name);
+        if (external == _externalSymbols->end())
+            return false;
+
+        std::lock_guard<std::mutex> guard(_externalsLock);
+        auto remapped = _remappedExternals.try_emplace(&external->first, 0);
+        if (remapped.second)
+        {
+            remapped.first->second = Mapper->Remap(external->second);
+            Stats::Count("externals.remapped");
+        }
+        *address = remapped.first->second;
+        return true;
+    }
+
+    // Only reads the symbol tables (ResolveExternal takes a lock for the
+    // externals it remaps), so modules can resolve at the same time
+    Symbol ResolveSymbol(Elf *elf, const std::string &name)
     {
-        auto locals = _localSymbols[elf];
+        const auto &locals = _localSymbols.at(elf);
 
         std::string name_wo_end = name;
 
-        for (std::string item : FixedUndefinedSymbols)
+        for (const std::string &item : FixedUndefinedSymbols)
         {
             name_wo_end = std::regex_replace(name_wo_end, std::regex(item), "");
         }
 
-        if (locals.contains(name))
+        auto local = locals.find(name);
+        if (local != locals.end())
         {
-            return locals[name];
+            return local->second;
         }
 
-        if (_globalSymbols.contains(name))
+        auto global = _globalSymbols.find(name);
+        if (global != _globalSymbols.end())
         {
-            return _globalSymbols[name];
+            return global->second;
         }
 
-        if (_externalSymbols.contains(name_wo_end))
+        uint external;
+        if (ResolveExternal(name_wo_end, &external))
         {
-            return Symbol{.address = {WordType::AbsoluteAddr, _externalSymbols[name_wo_end]}};
+            return Symbol{.address = {WordType::AbsoluteAddr, external}};
         }
 
         if (name.starts_with("__kAutoMap_"))
@@ -307,12 +673,12 @@ public:
             auto addr = name.substr(11);
             if (addr.starts_with("0x") || addr.starts_with("0X"))
                 addr = addr.substr(2);
-            auto parsedAddr = std::stoi(addr, 0, 16);
+            auto parsedAddr = std::stoul(addr, 0, 16);
             auto mappedAddr = Mapper->Remap(parsedAddr);
             return Symbol{.address = {WordType::AbsoluteAddr, mappedAddr}};
         }
 
-        writeline("undefined symbol %s\n", name);
+        writeline("undefined symbol %s\n", name.c_str());
         return Symbol {WordType::Value, 0, 0};
     }
     struct Fixup
@@ -322,10 +688,25 @@ public:
     };
     std::vector<Fixup *> _fixups;
 
+    // What one module's relocations produced, before it's merged into the link
+    struct ModuleRelocations
+    {
+        std::vector<Fixup> fixups;
+        std::vector<std::pair<Word, Word>> kamekRelocations;
+    };
+
     void ProcessRelocations()
     {
-        for (Elf *elf : _modules)
-        {
+        Stats::Scope scope("ProcessRelocations");
+
+        FindSmallDataBases();
+
+        std::vector<ModuleRelocations> results(_modules.size());
+        ForEachModule([&](size_t i)
+                      {
+            Elf *elf = _modules[i];
+            Stats::Scope moduleScope("ProcessRelaSections", elf->_name);
+
             for (auto s : elf->_sections)
             {
                 if (s->sh_type != Elf::ElfSection::Type::SHT_REL)
@@ -346,61 +727,282 @@ public:
                 auto affected = elf->_sections[(int)s->sh_info];
                 auto symtab = elf->_sections[(int)s->sh_link];
 
-                ProcessRelaSection(elf, s, affected, symtab);
-            }
+                ProcessRelaSection(elf, s, affected, symtab, &results[i]);
+            } });
+
+        for (ModuleRelocations &result : results)
+        {
+            for (auto &pair : result.kamekRelocations)
+                _kamekRelocations[pair.first] = pair.second;
+            for (const Fixup &fixup : result.fixups)
+                _fixups.push_back(_arena->New<Fixup>(fixup));
         }
+
+        Stats::Count("fixups", _fixups.size());
+        Stats::Count("relocs.kamek", _kamekRelocations.size());
     }
 
-    void ProcessRelaSection(Elf *elf, Elf::ElfSection *relocs, Elf::ElfSection *section, Elf::ElfSection *symtab)
+    void ProcessRelaSection(Elf *elf, Elf::ElfSection *relocs, Elf::ElfSection *section, Elf::ElfSection *symtab, ModuleRelocations *output)
     {
         if (relocs->sh_entsize != 12)
             writeline("Invalid relocs format (sh_entsize != 12)");
         if (symtab->sh_type != Elf::ElfSection::Type::SHT_SYMTAB)
             writeline("Symbol table does not have type SHT_SYMTAB");
 
-        auto reader = new BinaryReader(relocs->data->data);
-        int count = relocs->data->length / 12;
+        std::vector<Elf::Rela> relas = Elf::DecodeRelas(relocs->data);
+        Stats::Count("relocs", relas.size());
 
-        for (int i = 0; i < count; i++)
+        auto sectionBase = _sectionBases.find(section);
+        const std::vector<SymbolName> &symbols = _symbolTableContents.at(symtab);
+
+        for (const Elf::Rela &rela : relas)
         {
-            uint r_offset = reader->ReadBigUInt32();
-            uint r_info = reader->ReadBigUInt32();
-            int r_addend = reader->ReadBigInt32();
+            uint r_offset = rela.r_offset;
+            uint r_info = rela.r_info;
+            int r_addend = rela.r_addend;
 
             Elf::Reloc reloc = (Elf::Reloc)(r_info & 0xFF);
             int symIndex = (int)(r_info >> 8);
 
             if (symIndex == 0)
                 writeline("linking to undefined symbol");
-            if (!_sectionBases.contains(section))
+            if (sectionBase == _sectionBases.end())
                 continue; // we don't care about this
 
-            SymbolName symbol = ((SymbolName *)_symbolTableContents[symtab]->data)[symIndex];
-            std::string symName = symbol.name;
+            const SymbolName &symbol = symbols[symIndex];
+            const std::string &symName = symbol.name;
             // Console.WriteLine("{0,-30} {1}", symName, reloc);
 
-            Word source = _sectionBases[section] + r_offset;
-            Word dest = (symName == "" ? _sectionBases[elf->_sections[symbol.shndx]] : ResolveSymbol(elf, symName).address) + r_addend;
+            Word source = sectionBase->second + r_offset;
+            Word dest = (symName == "" ? SectionBase(elf->_sections[symbol.shndx]) : ResolveSymbol(elf, symName).address) + r_addend;
 
             // Console.WriteLine("Linking from 0x{0:X8} to 0x{1:X8}", source.Value, dest.Value);
 
-            if (!KamekUseReloc(reloc, source, dest))
-                _fixups.push_back(new Fixup{.type = reloc, .source = source, .dest = dest});
+            if (reloc == Elf::Reloc::R_PPC_SDAREL16 || reloc == Elf::Reloc::R_PPC_EMB_SDA2REL || reloc == Elf::Reloc::R_PPC_EMB_SDA21)
+                ApplySmallDataReloc(reloc, source, dest, symName != "" ? symName : elf->_sections[symbol.shndx]->name);
+            else if (!KamekUseReloc(reloc, source, dest, output))
+                output->fixups.push_back(Fixup{.type = reloc, .source = source, .dest = dest});
         }
     }
     std::map<Word, Word> _kamekRelocations;
 
-    bool KamekUseReloc(Elf::Reloc type, Word source, Word dest)
+    // Where a section was placed; sections that weren't imported read as 0
+    Word SectionBase(Elf::ElfSection *section)
+    {
+        auto base = _sectionBases.find(section);
+        return (base == _sectionBases.end()) ? Word{} : base->second;
+    }
+
+    // The bases the game keeps in r13 (.sdata and .sbss) and r2 (.sdata2 and
+    // .sbss2). They come from the externals like any other game address, so
+    // they are remapped for each version; a module may define them instead.
+    struct SmallDataBase
+    {
+        const char *symbol;
+        uint reg;
+        bool found = false;
+        Word address;
+    };
+    SmallDataBase _smallDataBases[2] = {{.symbol = "_SDA_BASE_", .reg = 13}, {.symbol = "_SDA2_BASE_", .reg = 2}};
+
+    void FindSmallDataBases()
+    {
+        for (SmallDataBase &base : _smallDataBases)
+        {
+            auto global = _globalSymbols.find(base.symbol);
+            uint external;
+            base.found = true;
+            if (global != _globalSymbols.end())
+                base.address = global->second.address;
+            else if (ResolveExternal(base.symbol, &external))
+                base.address = {WordType::AbsoluteAddr, external};
+            else
+                base.found = false;
+        }
+    }
+
+    // Small data is reached with a 16-bit offset from r13 or r2, which point
+    // into the game, so these are resolved here rather than left to the
+    // loader. That only works for targets within 32 KiB of a base: the game's
+    // own small data, or ours if the blob is linked inside the window.
+    bool ApplySmallDataReloc(Elf::Reloc type, Word source, Word dest, const std::string &name)
+    {
+        Stats::Count("relocs.sda");
+
+        auto offsetFrom = [&](const SmallDataBase &base, ushort *offset)
+        {
+            if (!base.found || dest.Type != base.address.Type)
+                return false;
+            int delta = (int)(dest.Value - base.address.Value);
+            if (delta < -0x8000 || delta > 0x7FFF)
+                return false;
+            *offset = (ushort)delta;
+            return true;
+        };
+
+        ushort offset;
+        if (type == Elf::Reloc::R_PPC_EMB_SDA21)
+        {
+            // the offset and the base register both go in the instruction,
+            // whichever base is in reach
+            Word insnAddr = {source.Type, source.Value & ~3U};
+            for (const SmallDataBase &base : _smallDataBases)
+            {
+                if (!offsetFrom(base, &offset))
+                    continue;
+                uint insn = ReadUInt32(insnAddr) & 0xFFE00000;
+                WriteUInt32(insnAddr, insn | (base.reg << 16) | offset);
+                return true;
+            }
+        }
+        else
+        {
+            const SmallDataBase &base = _smallDataBases[type == Elf::Reloc::R_PPC_SDAREL16 ? 0 : 1];
+            if (offsetFrom(base, &offset))
+            {
+                WriteUInt16(source, offset);
+                return true;
+            }
+        }
+
+        writeline("small data reference to %s cannot be resolved: it is not within 32 KiB of %s (from the externals)",
+                  name.c_str(), type == Elf::Reloc::R_PPC_EMB_SDA21 ? "_SDA_BASE_ or _SDA2_BASE_" : _smallDataBases[type == Elf::Reloc::R_PPC_SDAREL16 ? 0 : 1].symbol);
+        return false;
+    }
+
+    bool KamekUseReloc(Elf::Reloc type, Word source, Word dest, ModuleRelocations *output)
     {
         if (source < _kamekStart || source >= _kamekEnd)
             return false;
         if (type != Elf::Reloc::R_PPC_ADDR32)
             writeline("Unsupported relocation type : the Kamek hook data section");
 
-        _kamekRelocations[source] = dest;
+        output->kamekRelocations.push_back({source, dest});
         return true;
     }
 
+    // Instructions the relaxation pass looks for and writes
+    static const uint Nop = 0x60000000;
+    static const uint MtctrMask = 0xFC1FFFFF, Mtctr = 0x7C0903A6; // mtctr rS
+    static const uint Bctr = 0x4E800420, Bctrl = 0x4E800421;
+
+    static bool CanBranch(Word from, Word to)
+    {
+        if (from.Type != to.Type || to.Type == WordType::Value)
+            return false;
+        int delta = (int)(to.Value - from.Value);
+        return delta >= -0x2000000 && delta < 0x2000000;
+    }
+
+    // How an address can be reached with one 16-bit displacement: from r0
+    // (that is, absolutely) if it sign-extends from 16 bits, otherwise from
+    // whichever small data base it's within 32 KiB of. false if neither.
+    bool ShortForm(Word dest, uint *reg, ushort *offset)
+    {
+        if (dest.Type != WordType::RelativeAddr && (int)dest.Value >= -0x8000 && (int)dest.Value < 0x8000)
+        {
+            *reg = 0;
+            *offset = (ushort)dest.Value;
+            return true;
+        }
+        for (const SmallDataBase &base : _smallDataBases)
+        {
+            int delta = (int)(dest.Value - base.address.Value);
+            if (base.found && dest.Type == base.address.Type && delta >= -0x8000 && delta < 0x8000)
+            {
+                *reg = base.reg;
+                *offset = (ushort)delta;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Looks for the two sequences the compiler has to emit when it can't know
+    // where a symbol will end up, where it turns out a shorter one would do:
+    //
+    //   lis rX, sym@ha; addi rX, rX, sym@l; mtctr rX; bctr(l)
+    //     -> nop; nop; nop; b(l) sym          (if sym is within 32 MiB)
+    //   lis rX, sym@ha; addi/lwz/lhz/lha/lbz rX, sym@l(rX)
+    //     -> nop; addi/lwz/... rX, off(base)  (base is r0, r13 or r2)
+    //
+    // Both need the @ha and @l halves to be next to each other and the second
+    // instruction to overwrite rX, so nothing after them can see the missing
+    // lis. The branch form also drops the addi, leaving rX without the
+    // address code after the call might still use (a function pointer kept
+    // in r14-r31 across a loop, say), so it is only relaxed when rX is r0,
+    // r11 or r12: scratch registers that never hold a value across a call.
+    // Instructions are replaced with nops rather than taken out, so no other
+    // address moves, and a single pass is enough.
+    void RelaxFixups()
+    {
+        Stats::Scope scope("Relax");
+
+        std::map<Word, Fixup *> fixupsAt;
+        for (Fixup *fixup : _fixups)
+            fixupsAt[fixup->source] = fixup;
+
+        std::set<Fixup *> removed;
+        std::vector<Fixup *> added;
+        for (Fixup *high : _fixups)
+        {
+            if (high->type != Elf::Reloc::R_PPC_ADDR16_HA || removed.contains(high))
+                continue;
+
+            // the relocations point at the low halves of the instructions
+            Word first = {high->source.Type, high->source.Value & ~3U};
+            auto found = fixupsAt.find(first + 6);
+            if (found == fixupsAt.end() || found->second->type != Elf::Reloc::R_PPC_ADDR16_LO)
+                continue;
+            Fixup *low = found->second;
+            Word dest = high->dest;
+            if (low->dest.Type != dest.Type || low->dest.Value != dest.Value || removed.contains(low))
+                continue;
+
+            uint lis = ReadUInt32(first);
+            uint second = ReadUInt32(first + 4);
+            uint reg = (lis >> 21) & 0x1F;
+            uint opcode = second >> 26;
+            if ((lis & 0xFC1F0000) != 0x3C000000 || ((second >> 21) & 0x1F) != reg || ((second >> 16) & 0x1F) != reg)
+                continue;
+
+            if (opcode == 14 && (ReadUInt32(first + 8) & MtctrMask) == Mtctr && ((ReadUInt32(first + 8) >> 21) & 0x1F) == reg)
+            {
+                uint branch = ReadUInt32(first + 12);
+                bool scratch = (reg == 0 || reg == 11 || reg == 12);
+                if (!scratch || (branch != Bctr && branch != Bctrl) || !CanBranch(first + 12, dest))
+                    continue;
+
+                WriteUInt32(first, Nop);
+                WriteUInt32(first + 4, Nop);
+                WriteUInt32(first + 8, Nop);
+                WriteUInt32(first + 12, 0x48000000 | (branch & 1));
+                added.push_back(_arena->New<Fixup>(Fixup{.type = Elf::Reloc::R_PPC_REL24, .source = first + 12, .dest = dest}));
+                Stats::Count("relax.branch");
+            }
+            else
+            {
+                // addi, lwz, lbz, lhz, lha; the update forms would change rX
+                bool loads = (opcode == 14 || opcode == 32 || opcode == 34 || opcode == 40 || opcode == 42);
+                uint base;
+                ushort offset;
+                if (!loads || !ShortForm(dest, &base, &offset))
+                    continue;
+
+                WriteUInt32(first, Nop);
+                WriteUInt32(first + 4, (second & 0xFFE00000) | (base << 16) | offset);
+                Stats::Count("relax.address");
+            }
+
+            removed.insert(high);
+            removed.insert(low);
+        }
+
+        std::erase_if(_fixups, [&](Fixup *fixup)
+                      { return removed.contains(fixup); });
+        _fixups.insert(_fixups.end(), added.begin(), added.end());
+    }
+
     struct HookData
     {
         uint type;
@@ -412,9 +1014,18 @@ public:
 
     void ProcessHooks()
     {
-        for (auto elf : _modules)
+        Stats::Scope scope("ProcessHooks");
+
+        struct ParsedHook
         {
-            for (auto pair : _localSymbols[elf])
+            uint type;
+            std::vector<Word> args;
+        };
+        std::vector<std::vector<ParsedHook>> parsed(_modules.size());
+
+        ForEachModule([&](size_t m)
+                      {
+            for (auto &pair : _localSymbols.at(_modules[m]))
             {
                 if (pair.first.starts_with("_kHook"))
                 {
@@ -422,20 +1033,178 @@ public:
 
                     auto argCount = ReadUInt32(cmdAddr);
                     auto type = ReadUInt32(cmdAddr + 4);
-                    auto args = new Word[argCount];
+                    std::vector<Word> args(argCount);
 
                     for (int i = 0; i < argCount; i++)
                     {
                         auto argAddr = cmdAddr + (8 + (i * 4));
-                        if (_kamekRelocations.contains(argAddr))
-                            args[i] = _kamekRelocations[argAddr];
+                        auto reloc = _kamekRelocations.find(argAddr);
+                        if (reloc != _kamekRelocations.end())
+                            args[i] = reloc->second;
                         else
                             args[i] = {WordType::Value, ReadUInt32(argAddr)};
                     }
 
-                    _hooks.push_back(HookData{.type = type, .args = args, .argc = argCount});
+                    parsed[m].push_back(ParsedHook{.type = type, .args = std::move(args)});
+                }
+            } });
+
+        for (auto &hooks : parsed)
+        {
+            for (ParsedHook &hook : hooks)
+            {
+                auto args = _arena->NewArray<Word>(hook.args.size());
+                std::copy(hook.args.begin(), hook.args.end(), args);
+                _hooks.push_back(HookData{.type = hook.type, .args = args, .argc = (uint)hook.args.size()});
+            }
+        }
+
+        Stats::Count("hooks", _hooks.size());
+    }
+
+    // kmBranch, kmCall and kmPatchExit; their second argument is the function
+    // the game ends up in
+    static bool IsInstrumentable(uint hookType)
+    {
+        return hookType == 3 || hookType == 4 || hookType == 5;
+    }
+
+    // Wraps a hook target: saves the caller's LR and r31, reads the time base
+    // before and after calling the target, and adds the ticks and one call to
+    // the target's counter slot. Arguments in r3-r10 and f1-f8 and the return
+    // values pass straight through; arguments passed on the stack would not,
+    // since the stub pushes a frame of its own.
+    static constexpr uint InstrumentStub[] = {
+        0x9421FFF0, // stwu r1, -16(r1)
+        0x7C0802A6, // mflr r0
+        0x90010014, // stw r0, 20(r1)
+        0x93E1000C, // stw r31, 12(r1)
+        0x7FEC42E6, // mftb r31
+        0x48000001, // bl target
+        0x7D8C42E6, // mftb r12
+        0x7D9F6050, // subf r12, r31, r12
+        0x3D600000, // lis r11, counter@ha
+        0x396B0000, // addi r11, r11, counter@l
+        0x800B0004, // lwz r0, 4(r11)
+        0x7C006014, // addc r0, r0, r12
+        0x900B0004, // stw r0, 4(r11)
+        0x800B0000, // lwz r0, 0(r11)
+        0x7C000194, // addze r0, r0
+        0x900B0000, // stw r0, 0(r11)
+        0x818B0008, // lwz r12, 8(r11)
+        0x398C0001, // addi r12, r12, 1
+        0x918B0008, // stw r12, 8(r11)
+        0x83E1000C, // lwz r31, 12(r1)
+        0x80010014, // lwz r0, 20(r1)
+        0x7C0803A6, // mtlr r0
+        0x38210010, // addi r1, r1, 16
+        0x4E800020, // blr
+    };
+    static constexpr uint InstrumentCallOffset = 5 * 4, InstrumentCounterOffset = 8 * 4;
+
+    // A counter slot: the ticks as a 64-bit count, the calls as a 32-bit
+    // count, then a spare word, all big-endian
+    static constexpr uint InstrumentSlotSize = 16;
+
+    struct InstrumentedHook
+    {
+        uint slot;
+        Word stub, counter, target;
+    };
+    uint _instrumentSlots = 0;
+    Word _instrumentStubs, _instrumentCounters;
+    std::vector<InstrumentedHook> _instrumented;
+
+    // Hooks are only parsed once everything is placed, but the stubs have to be
+    // placed along with the code. This reads the hook types straight out of
+    // the .kamek sections to find how many there can be.
+    uint CountInstrumentableHooks()
+    {
+        uint count = 0;
+        for (Elf *elf : _modules)
+        {
+            for (Elf::ElfSection *symtab : elf->_sections)
+            {
+                if (symtab->sh_type != Elf::ElfSection::Type::SHT_SYMTAB || symtab->sh_link <= 0 || symtab->sh_link >= elf->_sections.size())
+                    continue;
+
+                Elf::ElfSection *strtab = elf->_sections[symtab->sh_link];
+                for (const Elf::Symbol &symbol : Elf::DecodeSymbols(symtab->data))
+                {
+                    if (symbol.st_shndx == 0 || symbol.st_shndx >= elf->_sections.size())
+                        continue;
+
+                    Elf::ElfSection *section = elf->_sections[symbol.st_shndx];
+                    if (!section->name.starts_with(".kamek") || section->data == nullptr || symbol.st_value + 8 > section->data->length)
+                        continue;
+                    if (!Util::ExtractNullTerminatedString(strtab->data->data, strtab->data->length, (int)symbol.st_name).starts_with("_kHook"))
+                        continue;
+
+                    if (IsInstrumentable(Util::ExtractUInt32(section->data->data, symbol.st_value + 4)))
+                        count++;
                 }
             }
         }
+        return count;
+    }
+
+    // Points every kmBranch, kmCall and kmPatchExit hook that leads to one of
+    // our functions at a stub that times it instead. Only functions that
+    // return with blr can be wrapped: one that branches back into the game
+    // would leave the stub's frame behind. Counting needs nothing from the
+    // loader, and a memory dump plus PackHookCounters' table gives the cost of
+    // each hook; ticks include whatever the function itself calls.
+    void InstrumentHookTargets()
+    {
+        Stats::Scope scope("InstrumentHookTargets");
+
+        for (HookData &hook : _hooks)
+        {
+            if (!IsInstrumentable(hook.type) || hook.argc != 2)
+                continue;
+
+            // only our own code is worth timing; anything else is the game's
+            Word target = hook.args[1];
+            if (target.Type != _baseAddress.Type || target < _outputStart || target >= _outputEnd)
+                continue;
+
+            uint size = _symbolIndex->SizeAt(target);
+            if (size < 4 || (size % 4) != 0 || ReadUInt32(target + (size - 4)) != 0x4E800020)
+            {
+                writeline("warning: not instrumenting the hook to %s: it has no size or does not end in blr", _symbolIndex->Describe(target).c_str());
+                continue;
+            }
+            if (_instrumented.size() == _instrumentSlots)
+            {
+                writeline("more hooks to instrument than were counted; the rest are left alone");
+                break;
+            }
+
+            uint slot = (uint)_instrumented.size();
+            Word stub = _instrumentStubs + (slot * sizeof(InstrumentStub));
+            Word counter = _instrumentCounters + (slot * InstrumentSlotSize);
+            for (uint i = 0; i < std::size(InstrumentStub); i++)
+                WriteUInt32(stub + (i * 4), InstrumentStub[i]);
+
+            _fixups.push_back(_arena->New<Fixup>(Fixup{.type = Elf::Reloc::R_PPC_REL24, .source = stub + InstrumentCallOffset, .dest = target}));
+            _fixups.push_back(_arena->New<Fixup>(Fixup{.type = Elf::Reloc::R_PPC_ADDR16_HA, .source = stub + (InstrumentCounterOffset + 2), .dest = counter}));
+            _fixups.push_back(_arena->New<Fixup>(Fixup{.type = Elf::Reloc::R_PPC_ADDR16_LO, .source = stub + (InstrumentCounterOffset + 6), .dest = counter}));
+
+            _instrumented.push_back(InstrumentedHook{.slot = slot, .stub = stub, .counter = counter, .target = target});
+            hook.args[1] = stub;
+        }
+
+        // Slots are reserved for every hook that might qualify, but only the
+        // ones filled in get a name; the rest stay zeroed and out of the map
+        if (_instrumented.size() > 0)
+        {
+            _symbolIndex->Reopen();
+            for (const InstrumentedHook &instrumented : _instrumented)
+                _symbolIndex->Add(std::format("__kmInstrument_{0}", instrumented.slot), instrumented.stub, sizeof(InstrumentStub), false);
+            _symbolIndex->Add("__kmInstrumentCounters", _instrumentCounters, (uint)_instrumented.size() * InstrumentSlotSize, false);
+            _symbolIndex->Finish();
+        }
+
+        Stats::Count("hooks.instrumented", _instrumented.size());
     }
-};
\ No newline at end of file
+};
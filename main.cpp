@@ -1,15 +1,17 @@
+#include <chrono>
 #include "common.hpp"
-#include "elf.hpp"
-#include "version_info.hpp"
-#include "linker.hpp"
-#include "kamek_file.hpp"
-
-#define reterr return -__COUNTER__
+#include "build.hpp"
+#include "manifest.hpp"
+#include "thread_pool.hpp"
 
 void ShowHelp()
 {
     writeline("Syntax:");
-    writeline("  Kamek file1.o [file2.o...] [options]");
+    writeline("  Kamek file1.o [file2.o...] [library.a...] [options]");
+    writeline("  Kamek -manifest=build.json [-jobs=N] [diagnostic options]");
+    writeline("");
+    writeline("  Archives (.a) only contribute the members that define symbols the link still needs,");
+    writeline("  plus whatever those members need in turn.");
     writeline("");
     writeline("Options:");
     writeline("  Build Mode (select one; defaults to -dynamic):");
@@ -17,6 +19,22 @@ void ShowHelp()
     writeline("      generate a dynamically linked Kamek binary for use with the loader");
     writeline("    -static=0x80001900");
     writeline("      generate a blob of code which must be loaded at the specified Wii RAM address");
+    writeline("    -prelink=0x80E00000");
+    writeline("      with -dynamic, pre-apply the blob's internal pointers for this load address; the loader");
+    writeline("      only has to walk the rebase table if the blob ends up somewhere else");
+    writeline("    -align-text-to-cache-lines");
+    writeline("      start every .text section on a 32-byte cache line (sections are always placed at the");
+    writeline("      alignment their object asks for; -stats reports the padding this costs)");
+    writeline("    -relax");
+    writeline("      replace lis/addi and lis/load pairs that can reach their target from r0, r13 or r2 with");
+    writeline("      one instruction, and lis/addi/mtctr/bctr(l) calls through r0, r11 or r12 to targets in");
+    writeline("      branch range with b(l)");
+    writeline("    -instrument-hooks");
+    writeline("      send every kmBranch, kmCall and kmPatchExit into our code through a stub that counts the");
+    writeline("      calls and time base ticks in a table in .bss (see -output-hook-counters)");
+    writeline("    -symbol-order=profile.txt");
+    writeline("      lay out .text from a function hit list: the listed functions first, hottest first, then");
+    writeline("      what they call, then everything else (one name per line, optionally followed by a count)");
     writeline("");
     writeline("  Game Configuration:");
     writeline("    -externals=file.txt");
@@ -27,47 +45,66 @@ void ShowHelp()
     writeline("      build only one version from the versions file, and ignore the rest");
     writeline("      (can be specified multiple times)");
     writeline("");
-    writeline("  Outputs (at least one is required; \\$KV\\$ will be replaced with the version name):");
-    writeline("    -output-kamek=file.\\$KV\\$.bin");
+    writeline("  Outputs (at least one is required; $KV$ will be replaced with the version name):");
+    writeline("    -output-kamek=file.$KV$.bin");
 
     writeline("      write a Kamek binary to for use with the loader (-dynamic only)");
-    writeline("    -output-riiv=file.\\$KV\\$.xml");
+    writeline("    -output-kamek-multi=file.bin");
+    writeline("      write the Kamek binaries for every version into one file: the first version in full, and");
+    writeline("      the words where each of the others differs from it (-dynamic only; no $KV$ needed)");
+    writeline("    -loader-block-writes");
+    writeline("      pack runs of writes to consecutive addresses into the Kamek binary as single block-write");
+    writeline("      commands (39); only for loaders that support them");
+    writeline("    -output-riiv=file.$KV$.xml");
     writeline("      write a Riivolution XML fragment (-static only)");
-    writeline("    -output-dolphin=file.\\$KV\\$.ini");
+    writeline("    -output-dolphin=file.$KV$.ini");
     writeline("      write a Dolphin INI fragment (-static only)");
-    writeline("    -output-gecko=file.\\$KV\\$.xml");
+    writeline("    -output-gecko=file.$KV$.xml");
     writeline("      write a list of Gecko codes (-static only)");
-    writeline("    -output-ar=file.\\$KV\\$.xml");
+    writeline("    -gecko-run-once");
+    writeline("      guard the Gecko codes so the blob is copied and the patches applied once, rather than on");
+    writeline("      every frame. Patches to anything the game loads or resets later (REL modules, tables it");
+    writeline("      rebuilds on the heap) are then lost, so only use it when every hook targets the DOL");
+    writeline("    -output-ar=file.$KV$.xml");
     writeline("      write a list of Action Replay codes (-static only)");
-    writeline("    -input-dol=file.\\$KV\\$.dol -output-dol=file2.\\$KV\\$.dol");
+    writeline("    -input-dol=file.$KV$.dol -output-dol=file2.$KV$.dol");
     writeline("      apply these patches and generate a modified DOL (-static only)");
-    writeline("    -output-code=file.\\$KV\\$.bin");
+    writeline("    -output-code=file.$KV$.bin");
     writeline("      write the combined code+data segment to file.bin (for manual injection or debugging)");
-};
-
-void ReadExternals(std::map<std::string, uint> dict, std::string path)
-{
-    std::regex commentRegex("^\\s*#");
-    std::regex emptyLineRegex("^\\s*$");
-    std::regex assignmentRegex("^\\s*([a-zA-Z0-9_<>@,-\\$]+)\\s*=\\s*0x([a-fA-F0-9]+)\\s*(#.*)?$");
-
-    for (std::string line : File::ReadAllLines(path))
-    {
-        if (std::regex_match(line, emptyLineRegex))
-            continue;
-        if (std::regex_match(line, commentRegex))
-            continue;
-
-        std::smatch matches;
-        if (std::regex_search(line, matches, assignmentRegex))
-        {
-            dict[matches[1]] = std::stoi(matches[2], 0, 16);
-        }
-        else
-        {
-            writeline("unrecognised line in externals file: %s\n", line);
-        }
-    }
+    writeline("    -output-map=file.$KV$.map");
+    writeline("      write a Dolphin symbol map covering the code blob and the patched game addresses (-static only)");
+    writeline("    -output-hook-counters=file.$KV$.txt");
+    writeline("      with -instrument-hooks, list each counter slot with the hook and function it belongs to");
+    writeline("    -output-size-report=file.$KV$.json");
+    writeline("      write where the blob, .bss and command stream bytes go, by module, section, symbol and hook,");
+    writeline("      with the alignment padding and the size of every output format");
+    writeline("    -size-baseline=old.$KV$.json");
+    writeline("      compare the size report with an earlier one and print what grew");
+    writeline("    -size-budget=budget.json");
+    writeline("      fail the build if the size report is over any limit in budget.json (see size_report.hpp)");
+    writeline("");
+    writeline("  Incremental Builds:");
+    writeline("    -cache-dir=dir");
+    writeline("      keep each version's outputs in dir, keyed by a hash of the inputs' contents and the options;");
+    writeline("      versions whose key is already there aren't linked again. Either way, outputs that come out");
+    writeline("      the same as the files already on disk are not rewritten (use restat = 1 in Ninja). Old");
+    writeline("      entries are never removed from dir");
+    writeline("    -depfile=file.d");
+    writeline("      write a Make/Ninja depfile listing every output against every input it was built from");
+    writeline("");
+    writeline("  Batch Mode and Threading:");
+    writeline("    -manifest=build.json");
+    writeline("      run every build listed in a JSON manifest (see manifest.hpp for the format) in one process,");
+    writeline("      sharing parsed objects, externals and version files between the builds that use them");
+    writeline("    -jobs=N");
+    writeline("      number of builds to run at once in batch mode, or threads for a single link to use");
+    writeline("      (defaults to the number of CPU threads)");
+    writeline("");
+    writeline("  Diagnostics:");
+    writeline("    -stats");
+    writeline("      print the time spent in each phase and per-version symbol/reloc/command counts");
+    writeline("    -trace=out.json");
+    writeline("      write per-version and per-module spans as Chrome trace-event JSON");
 };
 
 std::vector<std::string> split(std::string input, std::string delimiter)
@@ -89,21 +126,62 @@ std::vector<std::string> split(std::string input, std::string delimiter)
     return tokens;
 }
 
-int main(int argc, char *argv[])
+// Runs every job in the manifest and reports how each one went; 0 if all succeeded
+int RunManifest(const std::string &path, uint threads)
 {
-    writeline("Kamek 2.0 by Ninji/Ash Wolf - https://github.com/Treeki/Kamek, ported to C++ by zednik-lovro - https://github.com/zednik-lovro");
+    std::vector<BuildOptions> jobs;
+    if (!Manifest::Read(path, &jobs))
+        reterr;
 
-    std::vector<Elf *> modules;
+    struct Result
+    {
+        int code;
+        double milliseconds;
+    };
+    std::vector<Result> results(jobs.size());
+
+    BuildCache cache;
+    std::vector<std::function<void()>> tasks;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        // spare threads go to the links themselves
+        jobs[i].threads = std::max(1U, threads / (uint)jobs.size());
+
+        tasks.push_back([&, i]()
+                        {
+            auto start = std::chrono::steady_clock::now();
+            results[i].code = RunBuild(jobs[i], &cache);
+            results[i].milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); });
+    }
+    ThreadPool::Run(tasks, threads);
 
-    uint baseAddress = 0;
+    uint failed = 0;
+    writeline("");
+    writeline("results:");
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        if (results[i].code == 0)
+            writeline("  ok      %-32s %10.1f ms", jobs[i].name.c_str(), results[i].milliseconds);
+        else
+        {
+            writeline("  FAILED  %-32s %10.1f ms  (error %d)", jobs[i].name.c_str(), results[i].milliseconds, results[i].code);
+            failed++;
+        }
+    }
+    writeline("%zu of %zu builds succeeded", jobs.size() - failed, jobs.size());
 
-    std::string outputKamekPath = "", outputRiivPath = "", outputDolphinPath = "", outputGeckoPath = "", outputARPath = "", outputCodePath = "";
-    std::string inputDolPath = "", outputDolPath = "";
+    if (failed > 0)
+        reterr;
+    return 0;
+}
 
-    std::map<std::string, uint> externals;
+int main(int argc, char *argv[])
+{
+    writeline("Kamek 2.0 by Ninji/Ash Wolf - https://github.com/Treeki/Kamek, ported to C++ by zednik-lovro - https://github.com/zednik-lovro");
 
-    VersionInfo *versions = nullptr;
-    std::vector<std::string> selectedVersions;
+    BuildOptions options;
+    std::string manifestPath = "", tracePath = "";
+    uint threads = ThreadPool::DefaultThreads();
 
     for (int i = 1; i < argc; i++)
     {
@@ -116,137 +194,102 @@ int main(int argc, char *argv[])
                 reterr;
             }
             if (arg == "-dynamic")
-                baseAddress = 0;
+                options.baseAddress = 0;
             else if (arg.starts_with("-static=0x"))
-                baseAddress = std::stoi(arg.substr(10), 0, 16);
+                options.baseAddress = std::stoul(arg.substr(10), 0, 16);
+            else if (arg.starts_with("-prelink=0x"))
+                options.prelinkAddress = (uint)std::stoul(arg.substr(11), 0, 16);
+            else if (arg == "-align-text-to-cache-lines")
+                options.alignTextToCacheLines = true;
+            else if (arg == "-relax")
+                options.relax = true;
+            else if (arg == "-instrument-hooks")
+                options.instrumentHooks = true;
+            else if (arg == "-loader-block-writes")
+                options.loaderBlockWrites = true;
+            else if (arg.starts_with("-symbol-order="))
+                options.symbolOrderPath = arg.substr(14);
             else if (arg.starts_with("-output-kamek="))
-                outputKamekPath = arg.substr(14);
+                options.outputKamekPath = arg.substr(14);
+            else if (arg.starts_with("-output-kamek-multi="))
+                options.outputKamekMultiPath = arg.substr(20);
             else if (arg.starts_with("-output-riiv="))
-                outputRiivPath = arg.substr(13);
+                options.outputRiivPath = arg.substr(13);
             else if (arg.starts_with("-output-dolphin="))
-                outputDolphinPath = arg.substr(16);
+                options.outputDolphinPath = arg.substr(16);
             else if (arg.starts_with("-output-gecko="))
-                outputGeckoPath = arg.substr(14);
+                options.outputGeckoPath = arg.substr(14);
+            else if (arg == "-gecko-run-once")
+                options.geckoRunOnce = true;
             else if (arg.starts_with("-output-ar="))
-                outputARPath = arg.substr(11);
+                options.outputARPath = arg.substr(11);
             else if (arg.starts_with("-output-code="))
-                outputCodePath = arg.substr(13);
+                options.outputCodePath = arg.substr(13);
+            else if (arg.starts_with("-output-map="))
+                options.outputMapPath = arg.substr(12);
+            else if (arg.starts_with("-output-hook-counters="))
+                options.outputHookCountersPath = arg.substr(22);
+            else if (arg.starts_with("-output-size-report="))
+                options.outputSizeReportPath = arg.substr(20);
+            else if (arg.starts_with("-size-baseline="))
+                options.sizeBaselinePath = arg.substr(15);
+            else if (arg.starts_with("-size-budget="))
+                options.sizeBudgetPath = arg.substr(13);
             else if (arg.starts_with("-input-dol="))
-                inputDolPath = arg.substr(11);
+                options.inputDolPath = arg.substr(11);
             else if (arg.starts_with("-output-dol="))
-                outputDolPath = arg.substr(12);
+                options.outputDolPath = arg.substr(12);
+            else if (arg.starts_with("-cache-dir="))
+                options.cacheDir = arg.substr(11);
+            else if (arg.starts_with("-depfile="))
+                options.depfilePath = arg.substr(9);
             else if (arg.starts_with("-externals="))
-                ReadExternals(externals, arg.substr(11));
+                options.externalsPaths.push_back(arg.substr(11));
             else if (arg.starts_with("-versions="))
-                versions = new VersionInfo(arg.substr(10));
+                options.versionsPath = arg.substr(10);
             else if (arg.starts_with("-select-version="))
-                selectedVersions.push_back(arg.substr(16));
+                options.selectedVersions.push_back(arg.substr(16));
             else if (arg.starts_with("-under-sym-mask="))
                 Linker::FixedUndefinedSymbols = split(arg.substr(16), ",");
+            else if (arg.starts_with("-manifest="))
+                manifestPath = arg.substr(10);
+            else if (arg.starts_with("-jobs="))
+                threads = std::max(1UL, std::stoul(arg.substr(6)));
+            else if (arg == "-stats")
+                Stats::Enabled = true;
+            else if (arg.starts_with("-trace="))
+            {
+                tracePath = arg.substr(7);
+                Stats::Tracing = true;
+            }
             else
-                writeline("warning: unrecognised argument: {0}", arg);
+                writeline("warning: unrecognised argument: %s", arg.c_str());
         }
         else
-        {
-            FILE *fp = fopen(arg.c_str(), "r");
-            byte *stream = new byte[std::filesystem::file_size(arg.c_str())];
-            fclose(fp);
-
-            writeline("adding %s as object..\n", arg);
-            modules.push_back(new Elf(stream));
-
-            delete stream;
-        }
-    }
-
-    // We need a default VersionList for the loop later
-    if (versions == nullptr)
-        versions = new VersionInfo();
-
-    // Can we build a thing?
-    if (modules.size() == 0)
-    {
-        writeline("no input files specified");
-        reterr;
-    }
-    if (outputKamekPath == "" && outputRiivPath == "" && outputDolphinPath == "" && outputGeckoPath == "" && outputARPath == "" && outputCodePath == "" && outputDolPath == "")
-    {
-        writeline("no output path(s) specified");
-        reterr;
-    }
-    if (outputDolPath != "" && inputDolPath == "")
-    {
-        writeline("input dol path not specified");
-        reterr;
+            options.inputPaths.push_back(arg);
     }
 
-    // Do safety checks
-    if (versions->_mappers.size() > 1 && selectedVersions.size() != 1)
+    int result;
+    if (manifestPath != "")
     {
-        bool ambiguousOutputPath = false;
-        ambiguousOutputPath |= (outputKamekPath != "" && !outputKamekPath.contains("\\$KV\\$"));
-        ambiguousOutputPath |= (outputRiivPath != "" && !outputRiivPath.contains("\\$KV\\$"));
-        ambiguousOutputPath |= (outputDolphinPath != "" && !outputDolphinPath.contains("\\$KV\\$"));
-        ambiguousOutputPath |= (outputGeckoPath != "" && !outputGeckoPath.contains("\\$KV\\$"));
-        ambiguousOutputPath |= (outputARPath != "" && !outputARPath.contains("\\$KV\\$"));
-        ambiguousOutputPath |= (outputCodePath != "" && !outputCodePath.contains("\\$KV\\$"));
-        ambiguousOutputPath |= (outputDolPath != "" && !outputDolPath.contains("\\$KV\\$"));
-        if (ambiguousOutputPath)
+        if (options.inputPaths.size() > 0)
         {
-            writeline("ERROR: this configuration builds for multiple game versions, and some of the outputs will be overwritten");
-            writeline("add the \\$KV\\$ placeholder to your output paths, or use -select-version=.. to only build one version");
+            writeline("input files cannot be combined with -manifest; list them in the manifest instead");
             reterr;
         }
+        result = RunManifest(manifestPath, threads);
     }
-
-    for (auto version : versions->_mappers)
+    else
     {
-        if (selectedVersions.size() > 0 && std::find(selectedVersions.begin(), selectedVersions.end(), version.first) == selectedVersions.end())
-        {
-            writeline("(skipping version {0} as it's not selected)", version.first);
-            continue;
-        }
-        writeline("linking version {0}...", version.first);
-
-        Linker *linker = new Linker(version.second);
-        for (auto module : modules)
-            linker->AddModule(module);
-
-        if (baseAddress != 0)
-            linker->LinkStatic(baseAddress, externals);
-        else
-            linker->LinkDynamic(externals);
-
-        KamekFile *kf = new KamekFile();
-        kf->LoadFromLinker(linker);
-        if (outputKamekPath != "")
-            File::WriteAllBytes(std::regex_replace(outputKamekPath, std::regex("\\$KV\\$"), version.first), kf->Pack());
-        if (outputRiivPath != "")
-            File::WriteAllText(std::regex_replace(outputRiivPath, std::regex("\\$KV\\$"), version.first), kf->PackRiivolution());
-        if (outputDolphinPath != "")
-            File::WriteAllText(std::regex_replace(outputDolphinPath, std::regex("\\$KV\\$"), version.first), kf->PackDolphin());
-        if (outputGeckoPath != "")
-            File::WriteAllText(std::regex_replace(outputGeckoPath, std::regex("\\$KV\\$"), version.first), kf->PackGeckoCodes());
-        if (outputARPath != "")
-            File::WriteAllText(std::regex_replace(outputARPath, std::regex("\\$KV\\$"), version.first), kf->PackActionReplayCodes());
-        if (outputCodePath != "")
-            File::WriteAllBytes(std::regex_replace(outputCodePath, std::regex("\\$KV\\$"), version.first), kf->_codeBlob);
-
-        if (outputDolPath != "")
-        {
-            sized_array *dolBytes = File::ReadAllBytes(std::regex_replace(inputDolPath, std::regex("\\$KV\\$"), version.first));
-
-            Dol *dol = new Dol(dolBytes->data);
-            kf->InjectIntoDol(dol);
-
-            std::string outpath = std::regex_replace(outputDolPath, std::regex("\\$KV\\$"), version.first);
-
-            sized_array *outStream = new sized_array(16 * 1024 * 1024);
+        BuildCache cache;
+        options.threads = threads;
+        result = RunBuild(options, &cache);
+    }
 
-            uint64_t dolSize = dol->Write(outStream->data);
-            File::WriteAllBytes(outpath, outStream);
+    if (Stats::Enabled)
+        Stats::Report();
+    if (Stats::Tracing)
+        Stats::WriteTrace(tracePath);
 
-            delete[] outStream;
-        }
-    }
-};
\ No newline at end of file
+    return result;
+};
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "common.hpp"
+#include "file.hpp"
+#include "json.hpp"
+#include "build.hpp"
+
+// A manifest describes several builds to run in one process:
+//
+// {
+//   "jobs": [
+//     {
+//       "name": "mymod",
+//       "inputs": ["mymod.o", "runtime.o"],
+//       "static": "0x80001900",          (leave out for a dynamic build)
+//       "prelink": "0x80E00000",          (dynamic builds only)
+//       "externals": ["externals.txt"],   (a single string works too)
+//       "versions": "versions.txt",
+//       "select-versions": ["PALv1"],
+//       "output-riiv": "out/mymod.$KV$.xml",
+//       "gecko-run-once": true,
+//       "input-dol": "main.$KV$.dol",
+//       "cache-dir": "build/cache",        (jobs can share one)
+//       ...
+//     }
+//   ]
+// }
+//
+// The output keys are the command line options without the leading dash.
+// Every job needs a unique name; it identifies the job in the results.
+class Manifest
+{
+public:
+    static bool ReadStrings(const Json &value, const char *key, std::vector<std::string> *output, const std::string &job)
+    {
+        const Json &field = value[key];
+        if (field.IsNull())
+            return true;
+
+        if (field.type == Json::Type::String)
+        {
+            output->push_back(field.string);
+            return true;
+        }
+        if (field.type == Json::Type::Array)
+        {
+            for (const Json &item : field.items)
+            {
+                if (item.type != Json::Type::String)
+                    break;
+                output->push_back(item.string);
+            }
+            if (output->size() == field.items.size())
+                return true;
+        }
+
+        writeline("manifest job %s: \"%s\" must be a string or a list of strings", job.c_str(), key);
+        return false;
+    }
+
+    static bool ReadAddress(const Json &value, const char *key, uint *output, const std::string &job)
+    {
+        const Json &field = value[key];
+        if (field.IsNull())
+            return true;
+
+        if (field.type == Json::Type::String && field.string.starts_with("0x") && field.string.length() > 2 &&
+            field.string.find_first_not_of("0123456789abcdefABCDEF", 2) == std::string::npos)
+        {
+            *output = std::stoul(field.string.substr(2), 0, 16);
+            return true;
+        }
+
+        writeline("manifest job %s: \"%s\" must be a hex address string such as \"0x80001900\"", job.c_str(), key);
+        return false;
+    }
+
+    static bool ReadAddress(const Json &value, const char *key, std::optional<uint> *output, const std::string &job)
+    {
+        uint address;
+        if (value[key].IsNull())
+            return true;
+        if (!ReadAddress(value, key, &address, job))
+            return false;
+        *output = address;
+        return true;
+    }
+
+    static bool ReadBool(const Json &value, const char *key, bool *output, const std::string &job)
+    {
+        const Json &field = value[key];
+        if (field.IsNull())
+            return true;
+
+        if (field.type == Json::Type::Bool)
+        {
+            *output = field.boolean;
+            return true;
+        }
+
+        writeline("manifest job %s: \"%s\" must be true or false", job.c_str(), key);
+        return false;
+    }
+
+    static bool Read(const std::string &path, std::vector<BuildOptions> *jobs)
+    {
+        if (!std::filesystem::is_regular_file(path))
+        {
+            writeline("cannot read manifest %s", path.c_str());
+            return false;
+        }
+
+        std::ifstream stream(path, std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+        Json root;
+        std::string error;
+        if (!Json::Parse(text, &root, &error))
+        {
+            writeline("cannot parse manifest %s: %s", path.c_str(), error.c_str());
+            return false;
+        }
+        if (root["jobs"].type != Json::Type::Array)
+        {
+            writeline("manifest %s has no \"jobs\" list", path.c_str());
+            return false;
+        }
+
+        static const std::vector<std::pair<const char *, std::string BuildOptions::*>> Paths = {
+            {"versions", &BuildOptions::versionsPath},
+            {"symbol-order", &BuildOptions::symbolOrderPath},
+            {"output-kamek", &BuildOptions::outputKamekPath},
+            {"output-kamek-multi", &BuildOptions::outputKamekMultiPath},
+            {"output-riiv", &BuildOptions::outputRiivPath},
+            {"output-dolphin", &BuildOptions::outputDolphinPath},
+            {"output-gecko", &BuildOptions::outputGeckoPath},
+            {"output-ar", &BuildOptions::outputARPath},
+            {"output-code", &BuildOptions::outputCodePath},
+            {"output-map", &BuildOptions::outputMapPath},
+            {"output-hook-counters", &BuildOptions::outputHookCountersPath},
+            {"output-size-report", &BuildOptions::outputSizeReportPath},
+            {"size-baseline", &BuildOptions::sizeBaselinePath},
+            {"size-budget", &BuildOptions::sizeBudgetPath},
+            {"input-dol", &BuildOptions::inputDolPath},
+            {"output-dol", &BuildOptions::outputDolPath},
+            {"cache-dir", &BuildOptions::cacheDir},
+            {"depfile", &BuildOptions::depfilePath},
+        };
+
+        for (const Json &entry : root["jobs"].items)
+        {
+            BuildOptions job;
+
+            if (entry["name"].type != Json::Type::String || entry["name"].string == "")
+            {
+                writeline("manifest %s: job %zu has no name", path.c_str(), jobs->size());
+                return false;
+            }
+            job.name = entry["name"].string;
+            for (const BuildOptions &other : *jobs)
+            {
+                if (other.name == job.name)
+                {
+                    writeline("manifest %s: more than one job is named %s", path.c_str(), job.name.c_str());
+                    return false;
+                }
+            }
+
+            for (const auto &member : entry.members)
+            {
+                const std::string &key = member.first;
+                bool known = (key == "name" || key == "inputs" || key == "externals" || key == "select-versions" || key == "static" || key == "prelink" || key == "gecko-run-once" || key == "align-text-to-cache-lines" || key == "relax" || key == "instrument-hooks" || key == "loader-block-writes");
+                for (const auto &field : Paths)
+                    known |= (key == field.first);
+                if (!known)
+                    writeline("warning: manifest job %s: unrecognised key \"%s\"", job.name.c_str(), key.c_str());
+            }
+
+            for (const auto &field : Paths)
+            {
+                const Json &value = entry[field.first];
+                if (value.IsNull())
+                    continue;
+                if (value.type != Json::Type::String)
+                {
+                    writeline("manifest job %s: \"%s\" must be a string", job.name.c_str(), field.first);
+                    return false;
+                }
+                job.*field.second = value.string;
+            }
+
+            if (!ReadStrings(entry, "inputs", &job.inputPaths, job.name) ||
+                !ReadStrings(entry, "externals", &job.externalsPaths, job.name) ||
+                !ReadStrings(entry, "select-versions", &job.selectedVersions, job.name) ||
+                !ReadAddress(entry, "static", &job.baseAddress, job.name) ||
+                !ReadAddress(entry, "prelink", &job.prelinkAddress, job.name) ||
+                !ReadBool(entry, "gecko-run-once", &job.geckoRunOnce, job.name) ||
+                !ReadBool(entry, "align-text-to-cache-lines", &job.alignTextToCacheLines, job.name) ||
+                !ReadBool(entry, "relax", &job.relax, job.name) ||
+                !ReadBool(entry, "instrument-hooks", &job.instrumentHooks, job.name) ||
+                !ReadBool(entry, "loader-block-writes", &job.loaderBlockWrites, job.name))
+                return false;
+
+            jobs->push_back(job);
+        }
+
+        return true;
+    }
+};
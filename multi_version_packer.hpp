@@ -0,0 +1,221 @@
+#pragma once
+
+#include <span>
+#include "common.hpp"
+#include "util.hpp"
+#include "stats.hpp"
+
+// Packs the same output built for several game versions into one container.
+// Those builds rarely differ anywhere but the words that point into the game,
+// so the first version is stored whole and every other one as the runs of
+// words where it differs from it.
+//
+// Layout (big-endian words):
+//   0x00  'Kame' 'kV\0\1'
+//   0x08  version count, base offset, base length in bytes
+//   0x14  per version: name offset, delta offset, delta length, output length
+//         then the names (NUL-terminated), the base, and the deltas, each
+//         padded to 4 bytes; offsets are from the start of the container
+//
+// A delta is a list of runs: word index, word count, then that many words.
+// Rebuilding a version means copying the base, resizing it to the version's
+// output length and overwriting each run. The first version's delta is empty.
+class MultiVersionPacker
+{
+public:
+    struct Version
+    {
+        std::string name;
+        std::vector<byte> bytes;
+    };
+    std::vector<Version> _versions;
+
+    // A run only costs its two header words, so differences closer together
+    // than this are stored as one run
+    static const uint MergeGap = 2;
+
+    void Add(const std::string &name, std::vector<byte> &&bytes)
+    {
+        _versions.push_back(Version{.name = name, .bytes = std::move(bytes)});
+    }
+
+    // Reads whole words past the end as zero, so lengths don't have to be multiples of 4
+    static uint WordAt(const std::vector<byte> &bytes, size_t index)
+    {
+        byte word[4] = {};
+        for (size_t i = 0; i < 4 && (index * 4) + i < bytes.size(); i++)
+            word[i] = bytes[(index * 4) + i];
+        return Util::ExtractUInt32(word, 0);
+    }
+
+    static void AppendWord(std::vector<byte> &output, uint value)
+    {
+        size_t offset = output.size();
+        output.resize(offset + 4);
+        Util::InjectUInt32(output.data(), offset, value);
+    }
+
+    static void Align(std::vector<byte> &output)
+    {
+        output.resize((output.size() + 3) & ~3);
+    }
+
+    static std::vector<byte> Diff(const std::vector<byte> &base, const std::vector<byte> &bytes)
+    {
+        std::vector<byte> delta;
+        size_t words = (bytes.size() + 3) / 4;
+        size_t baseWords = (base.size() + 3) / 4;
+
+        auto differs = [&](size_t i)
+        { return i >= baseWords || WordAt(base, i) != WordAt(bytes, i); };
+
+        for (size_t i = 0; i < words;)
+        {
+            if (!differs(i))
+            {
+                i++;
+                continue;
+            }
+
+            // extend the run for as long as the next difference is close enough
+            size_t end = i + 1;
+            for (size_t next = end; next < words && next <= end + MergeGap; next++)
+            {
+                if (differs(next))
+                    end = next + 1;
+            }
+
+            AppendWord(delta, (uint)i);
+            AppendWord(delta, (uint)(end - i));
+            for (; i < end; i++)
+                AppendWord(delta, WordAt(bytes, i));
+        }
+        return delta;
+    }
+
+    std::vector<byte> Pack()
+    {
+        Stats::Scope scope("PackMultiVersion");
+
+        std::vector<byte> output;
+        if (_versions.size() == 0)
+            return output;
+
+        const std::vector<byte> &base = _versions[0].bytes;
+        std::vector<std::vector<byte>> deltas;
+        for (Version &version : _versions)
+            deltas.push_back(Diff(base, version.bytes));
+
+        AppendWord(output, 0x4B616D65); // 'Kamek'
+        AppendWord(output, 0x6B560001); // 'kV', version 1
+        AppendWord(output, (uint)_versions.size());
+        AppendWord(output, 0); // base offset, once the names are in
+        AppendWord(output, (uint)base.size());
+
+        size_t index = output.size();
+        output.resize(index + (_versions.size() * 16));
+
+        std::vector<uint> nameOffsets;
+        for (Version &version : _versions)
+        {
+            nameOffsets.push_back((uint)output.size());
+            output.insert(output.end(), version.name.begin(), version.name.end());
+            output.push_back(0);
+        }
+        Align(output);
+
+        Util::InjectUInt32(output.data(), 12, (uint)output.size());
+        output.insert(output.end(), base.begin(), base.end());
+        Align(output);
+
+        for (size_t i = 0; i < _versions.size(); i++)
+        {
+            byte *entry = output.data() + index + (i * 16);
+            Util::InjectUInt32(entry, 0, nameOffsets[i]);
+            Util::InjectUInt32(entry, 4, (uint)output.size());
+            Util::InjectUInt32(entry, 8, (uint)deltas[i].size());
+            Util::InjectUInt32(entry, 12, (uint)_versions[i].bytes.size());
+
+            output.insert(output.end(), deltas[i].begin(), deltas[i].end());
+            Stats::Count("multiversion.delta", deltas[i].size());
+        }
+
+        Stats::Count("multiversion.base", base.size());
+        return output;
+    }
+
+    // The names of the versions in a container, in the order they were added
+    static bool ListVersions(std::span<const byte> container, std::vector<std::string> *names)
+    {
+        if (container.size() < 20 || Util::ExtractUInt32(container.data(), 0) != 0x4B616D65 || Util::ExtractUInt32(container.data(), 4) != 0x6B560001)
+            return false;
+
+        uint count = Util::ExtractUInt32(container.data(), 8);
+        if (20 + ((size_t)count * 16) > container.size())
+            return false;
+
+        for (uint i = 0; i < count; i++)
+        {
+            uint nameOffset = Util::ExtractUInt32(container.data(), 20 + (i * 16));
+            if (nameOffset >= container.size())
+                return false;
+            const char *name = (const char *)container.data() + nameOffset;
+            names->push_back(std::string(name, strnlen(name, container.size() - nameOffset)));
+        }
+        return true;
+    }
+
+    // Rebuilds one version's output from a container; false if it isn't in there
+    static bool Unpack(std::span<const byte> container, const std::string &version, std::vector<byte> *output)
+    {
+        std::vector<std::string> names;
+        if (!ListVersions(container, &names))
+        {
+            writeline("not a multi-version Kamek container");
+            return false;
+        }
+
+        auto found = std::find(names.begin(), names.end(), version);
+        if (found == names.end())
+        {
+            writeline("version %s is not in this container", version.c_str());
+            return false;
+        }
+
+        const byte *data = container.data();
+        size_t entry = 20 + ((found - names.begin()) * 16);
+        size_t baseOffset = Util::ExtractUInt32(data, 12);
+        size_t baseLength = Util::ExtractUInt32(data, 16);
+
+        size_t deltaOffset = Util::ExtractUInt32(data, entry + 4);
+        size_t deltaLength = Util::ExtractUInt32(data, entry + 8);
+        size_t length = Util::ExtractUInt32(data, entry + 12);
+        if (baseOffset + baseLength > container.size() || deltaOffset + deltaLength > container.size())
+        {
+            writeline("multi-version Kamek container is truncated");
+            return false;
+        }
+
+        // work in whole words, then cut back to the real length
+        output->assign(data + baseOffset, data + baseOffset + baseLength);
+        output->resize(std::max(output->size(), (length + 3) & ~(size_t)3));
+
+        for (size_t position = deltaOffset; position + 8 <= deltaOffset + deltaLength;)
+        {
+            size_t word = Util::ExtractUInt32(data, position);
+            size_t count = Util::ExtractUInt32(data, position + 4);
+            position += 8;
+
+            if (position + (count * 4) > deltaOffset + deltaLength || (word + count) * 4 > output->size())
+            {
+                writeline("multi-version Kamek container has a bad delta for %s", version.c_str());
+                return false;
+            }
+            memcpy(output->data() + (word * 4), data + position, count * 4);
+            position += count * 4;
+        }
+
+        output->resize(length);
+        return true;
+    }
+};
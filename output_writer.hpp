@@ -0,0 +1,148 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <string.h>
+#include "common.hpp"
+#include "stats.hpp"
+
+// Writes output files on a background thread, so the next version can be
+// linked and packed while the previous one's outputs are going to disk.
+// Each job owns its contents; nothing submitted may point into an arena.
+// Files that already hold exactly those contents are left alone, so their
+// timestamps don't make build systems redo everything downstream.
+class OutputWriter
+{
+public:
+    struct Job
+    {
+        std::string path;
+        std::string contents;
+        std::string version;
+    };
+
+    // Submit blocks while this much is still waiting to be written
+    static const size_t MaxQueuedBytes = 256 * 1024 * 1024;
+
+    std::mutex _lock;
+    std::condition_variable _wake, _drained;
+    std::deque<Job> _queue;
+    size_t _queuedBytes = 0;
+    bool _finishing = false;
+    uint _failures = 0;
+    std::thread _thread;
+
+    OutputWriter() : _thread([this]()
+                             { Run(); }) {}
+
+    OutputWriter(const OutputWriter &) = delete;
+    OutputWriter &operator=(const OutputWriter &) = delete;
+
+    ~OutputWriter() { Finish(); }
+
+    void Submit(const std::string &path, std::string &&contents)
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _drained.wait(guard, [this]()
+                      { return _queuedBytes < MaxQueuedBytes; });
+
+        _queuedBytes += contents.size();
+        _queue.push_back(Job{.path = path, .contents = std::move(contents), .version = Stats::CurrentVersion});
+        _wake.notify_one();
+    }
+
+    void SubmitText(const std::string &path, std::string &&text)
+    {
+        Submit(path, std::move(text));
+    }
+
+    void SubmitBytes(const std::string &path, const sized_array *bytes)
+    {
+        Submit(path, std::string((const char *)bytes->data, bytes->length));
+    }
+
+    // Waits for everything submitted so far; false if any of it could not be written
+    bool Finish()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _finishing = true;
+        }
+        _wake.notify_one();
+
+        if (_thread.joinable())
+            _thread.join();
+        return _failures == 0;
+    }
+
+    static bool Unchanged(const std::string &path, const std::string &contents)
+    {
+        std::error_code error;
+        if (std::filesystem::file_size(path, error) != contents.size() || error)
+            return false;
+
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr)
+            return false;
+
+        char buffer[64 * 1024];
+        bool same = true;
+        for (size_t offset = 0; same && offset < contents.size();)
+        {
+            size_t read = fread(buffer, 1, std::min(sizeof(buffer), contents.size() - offset), fp);
+            same = (read > 0) && memcmp(buffer, contents.data() + offset, read) == 0;
+            offset += read;
+        }
+        fclose(fp);
+        return same;
+    }
+
+    void Run()
+    {
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> guard(_lock);
+                _wake.wait(guard, [this]()
+                           { return _finishing || !_queue.empty(); });
+                if (_queue.empty())
+                    return;
+
+                job = std::move(_queue.front());
+                _queue.pop_front();
+            }
+
+            Stats::CurrentVersion = job.version;
+            {
+                Stats::Scope scope("write", job.path);
+
+                if (Unchanged(job.path, job.contents))
+                    Stats::Count("write.unchanged");
+                else
+                {
+                    // text goes out byte for byte too, so it compares equal
+                    // to itself next time on every platform
+                    FILE *fp = fopen(job.path.c_str(), "wb");
+                    bool ok = (fp != nullptr) && (fwrite(job.contents.data(), 1, job.contents.size(), fp) == job.contents.size());
+                    if (fp != nullptr && fclose(fp) != 0)
+                        ok = false;
+
+                    if (!ok)
+                    {
+                        writeline("cannot write %s", job.path.c_str());
+                        _failures++;
+                    }
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _queuedBytes -= job.contents.size();
+            }
+            _drained.notify_all();
+        }
+    }
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "common.hpp"
+#include "kamek.hpp"
+#include "json.hpp"
+#include "stats.hpp"
+
+// Where one version's bytes go, as JSON (-output-size-report): the code blob,
+// .bss and the loader's command stream, broken down by module, section,
+// symbol and hook, what section alignment cost, and how big each output
+// format comes out. Check compares a report with an earlier one and with a
+// budget, so a build can fail as soon as the mod outgrows the room it has.
+//
+// Sizes are in bytes. "commands" is the size of the command stream as the
+// loader would read it, in static links too, where the text formats carry
+// those patches instead. Writes merged into a block write (see CoalesceWrites)
+// only show up under "commandKinds", not under the hooks they came from.
+class SizeReport
+{
+public:
+    static std::string Address(Word word)
+    {
+        return word.IsRelative() ? std::format("+0x{0:X}", word.Value) : std::format("0x{0:08X}", word.Value);
+    }
+
+    static std::string Quote(const std::string &text)
+    {
+        return "\"" + Stats::EscapeJson(text) + "\"";
+    }
+
+    static size_t CountLines(const std::string &text)
+    {
+        return std::count(text.begin(), text.end(), '\n');
+    }
+
+    static std::string Build(KamekFile *file, const std::string &version)
+    {
+        Stats::Scope scope("SizeReport");
+
+        struct Totals
+        {
+            ulong code = 0, bss = 0, commands = 0;
+        };
+
+        // sections by address, to find which module an address belongs to
+        std::vector<const KamekFile::Placement *> placements;
+        for (const KamekFile::Placement &placement : file->_layout)
+            placements.push_back(&placement);
+        std::stable_sort(placements.begin(), placements.end(), [](const KamekFile::Placement *a, const KamekFile::Placement *b)
+                         { return a->base.Value < b->base.Value; });
+        auto moduleAt = [&](Word address) -> const std::string *
+        {
+            auto after = std::upper_bound(placements.begin(), placements.end(), address.Value, [](uint value, const KamekFile::Placement *p)
+                                          { return value < p->base.Value; });
+            if (after == placements.begin())
+                return nullptr;
+            const KamekFile::Placement *p = *(after - 1);
+            return (p->base.Type == address.Type && address.Value - p->base.Value < p->size) ? &p->module : nullptr;
+        };
+
+        std::map<std::string, Totals> modules;
+        std::string sections;
+        for (const KamekFile::Placement *p : placements)
+        {
+            Totals &totals = modules[p->module];
+            (p->isBss ? totals.bss : totals.code) += p->size;
+            sections += std::format("{0}    {{\"module\": {1}, \"name\": {2}, \"address\": \"{3}\", \"size\": {4}, \"bss\": {5}}}",
+                                    sections.empty() ? "" : ",\n", Quote(p->module), Quote(p->section), Address(p->base), p->size, p->isBss ? "true" : "false");
+        }
+
+        // The command stream, by kind and by where each command came from: a
+        // hook, or the module whose code needs the relocation
+        std::map<Command *, size_t> hookOf;
+        for (size_t i = 0; i < file->_hooks.size(); i++)
+        {
+            for (Command *cmd : file->_hooks[i]->Commands)
+                hookOf[cmd] = i;
+        }
+        std::vector<std::pair<uint, uint>> hookCommands(file->_hooks.size()); // count, bytes
+        std::map<std::string, std::pair<uint, uint>> kinds;
+        ulong commandBytes = 0;
+        for (auto &pair : file->_commands)
+        {
+            uint size = file->PackedSize(pair.second);
+            commandBytes += size;
+
+            auto &kind = kinds[Command::IdName(pair.second->Id)];
+            kind.first++;
+            kind.second += size;
+
+            if (auto hook = hookOf.find(pair.second); hook != hookOf.end())
+            {
+                hookCommands[hook->second].first++;
+                hookCommands[hook->second].second += size;
+            }
+            else if (const std::string *module = moduleAt(pair.second->_Address))
+                modules[*module].commands += size;
+        }
+
+        std::string json = "{\n";
+        json += std::format("  \"version\": {0},\n", Quote(version));
+        json += std::format("  \"base\": \"{0}\",\n", Address(file->_baseAddress));
+        json += std::format("  \"code\": {0},\n", file->_codeBlob->length);
+        json += std::format("  \"bss\": {0},\n", file->_bssSize);
+        json += std::format("  \"padding\": {0},\n", file->_layoutPadding);
+        json += std::format("  \"commands\": {0},\n", commandBytes);
+
+        json += "  \"commandKinds\": {";
+        for (auto it = kinds.begin(); it != kinds.end(); ++it)
+            json += std::format("{0}\n    {1}: {{\"count\": {2}, \"bytes\": {3}}}", it == kinds.begin() ? "" : ",", Quote(it->first), it->second.first, it->second.second);
+        json += "\n  },\n";
+
+        // every format this link can be packed as
+        json += "  \"formats\": {\n";
+        json += std::format("    \"code\": {{\"bytes\": {0}}}", file->_codeBlob->length);
+        if (file->_baseAddress.IsRelative())
+            json += std::format(",\n    \"kamek\": {{\"bytes\": {0}}}", file->PackedSize());
+        else
+        {
+            std::string riivolution, dolphin, gecko, actionReplay;
+            file->PackText(KamekFile::TextOutputs{.riivolution = &riivolution, .dolphin = &dolphin, .gecko = &gecko, .actionReplay = &actionReplay});
+            for (auto &format : std::initializer_list<std::pair<const char *, const std::string *>>{{"riivolution", &riivolution}, {"dolphin", &dolphin}, {"gecko", &gecko}, {"ar", &actionReplay}})
+                json += std::format(",\n    \"{0}\": {{\"bytes\": {1}, \"lines\": {2}}}", format.first, format.second->size(), CountLines(*format.second));
+        }
+        json += "\n  },\n";
+
+        json += "  \"modules\": {";
+        for (auto it = modules.begin(); it != modules.end(); ++it)
+            json += std::format("{0}\n    {1}: {{\"code\": {2}, \"bss\": {3}, \"commands\": {4}}}", it == modules.begin() ? "" : ",", Quote(it->first), it->second.code, it->second.bss, it->second.commands);
+        json += "\n  },\n";
+
+        json += "  \"sections\": [\n" + sections + "\n  ],\n";
+
+        json += "  \"symbols\": [";
+        bool first = true;
+        for (const SymbolIndex::Entry &symbol : file->_symbolIndex->_entries)
+        {
+            const std::string *module = moduleAt(symbol.Address());
+            if (!symbol.isPrimary || symbol.size == 0 || module == nullptr)
+                continue;
+            json += std::format("{0}\n    {{\"name\": {1}, \"module\": {2}, \"address\": \"{3}\", \"size\": {4}}}", first ? "" : ",", Quote(file->_symbolIndex->Name(&symbol)), Quote(*module), Address(symbol.Address()), symbol.size);
+            first = false;
+        }
+        json += "\n  ],\n";
+
+        json += "  \"hooks\": [";
+        first = true;
+        for (size_t i = 0; i < file->_hooks.size(); i++)
+        {
+            Hook *hook = file->_hooks[i];
+            if (hook->Commands.empty())
+                continue;
+
+            Command *cmd = hook->Commands[0];
+            std::string kind = "kmWrite";
+            Word target = {WordType::Value, 0};
+            if (auto inlined = dynamic_cast<InlineCommand *>(cmd); inlined != nullptr && !inlined->Words().empty())
+            {
+                kind = "kmInline";
+                target = inlined->Target;
+            }
+            else if (auto branch = dynamic_cast<BranchCommand *>(cmd))
+            {
+                kind = (branch->Id == Command::Ids::BranchLink) ? "kmCall" : "kmBranch";
+                target = branch->Target;
+            }
+            else if (auto patchExit = dynamic_cast<PatchExitCommand *>(cmd))
+            {
+                kind = "kmPatchExit";
+                target = patchExit->Target;
+            }
+
+            json += std::format("{0}\n    {{\"kind\": \"{1}\", \"site\": \"{2}\", \"target\": {3}, \"commands\": {4}, \"bytes\": {5}}}", first ? "" : ",", kind, Address(cmd->_Address),
+                                target.IsValue() ? "null" : Quote(file->_symbolIndex->Describe(target)), hookCommands[i].first, hookCommands[i].second);
+            first = false;
+        }
+        json += "\n  ]\n}\n";
+        return json;
+    }
+
+    static long Number(const Json &value)
+    {
+        return (value.type == Json::Type::Number) ? (long)value.number : 0;
+    }
+
+    // Per-symbol sizes keyed by module and name, summed over duplicates
+    static std::map<std::string, long> SymbolSizes(const Json &report)
+    {
+        std::map<std::string, long> sizes;
+        for (const Json &symbol : report["symbols"].items)
+            sizes[symbol["module"].string + ": " + symbol["name"].string] += Number(symbol["size"]);
+        return sizes;
+    }
+
+    // Prints how this report compares with the baseline, if there is one, and
+    // checks it against the budget, if there is one; false if anything is over.
+    //
+    // A budget is a JSON object of byte limits, all optional: "code", "bss",
+    // "total" (code + bss), "padding", "commands", "growth" (how much code +
+    // bss may grow past the baseline) and "modules" (code + bss per module),
+    // e.g. {"total": 65536, "growth": 512, "modules": {"boss.o": 4096}}.
+    static bool Check(const std::string &version, const Json &report, const Json *baseline, const Json *budget)
+    {
+        static const char *Totals[] = {"code", "bss", "padding", "commands"};
+
+        std::string summary = std::format("size of version {0}:", version);
+        for (const char *total : Totals)
+        {
+            summary += std::format(" {0} {1}", total, Number(report[total]));
+            if (baseline != nullptr)
+            {
+                long delta = Number(report[total]) - Number((*baseline)[total]);
+                summary += std::format(" ({0}{1})", delta >= 0 ? "+" : "", delta);
+            }
+        }
+        writeline("%s", summary.c_str());
+
+        if (baseline != nullptr)
+        {
+            for (const auto &module : report["modules"].members)
+            {
+                const Json &old = (*baseline)["modules"][module.first];
+                long code = Number(module.second["code"]) - Number(old["code"]);
+                long bss = Number(module.second["bss"]) - Number(old["bss"]);
+                if (code != 0 || bss != 0 || old.IsNull())
+                    writeline("  %s: code %+ld, bss %+ld%s", module.first.c_str(), code, bss, old.IsNull() ? " (new)" : "");
+            }
+            for (const auto &module : (*baseline)["modules"].members)
+            {
+                if (report["modules"][module.first].IsNull())
+                    writeline("  %s: removed", module.first.c_str());
+            }
+
+            // the symbols that changed the most
+            std::map<std::string, long> before = SymbolSizes(*baseline), after = SymbolSizes(report);
+            std::vector<std::pair<long, std::string>> changes;
+            for (auto &symbol : after)
+            {
+                auto old = before.find(symbol.first);
+                long delta = symbol.second - (old != before.end() ? old->second : 0);
+                if (delta != 0)
+                    changes.push_back({delta, symbol.first});
+            }
+            for (auto &symbol : before)
+            {
+                if (!after.contains(symbol.first))
+                    changes.push_back({-symbol.second, symbol.first});
+            }
+            std::stable_sort(changes.begin(), changes.end(), [](const auto &a, const auto &b)
+                             { return std::abs(a.first) > std::abs(b.first); });
+            for (size_t i = 0; i < changes.size() && i < 10; i++)
+                writeline("  %+6ld %s", changes[i].first, changes[i].second.c_str());
+        }
+
+        if (budget == nullptr)
+            return true;
+
+        bool ok = true;
+        auto limit = [&](const std::string &what, const Json &budgetValue, long size)
+        {
+            if (budgetValue.type != Json::Type::Number || size <= (long)budgetValue.number)
+                return;
+            writeline("size budget exceeded for version %s: %s is %ld bytes, over its budget of %ld", version.c_str(), what.c_str(), size, (long)budgetValue.number);
+            ok = false;
+        };
+
+        for (const char *total : Totals)
+            limit(total, (*budget)[total], Number(report[total]));
+        long total = Number(report["code"]) + Number(report["bss"]);
+        limit("total", (*budget)["total"], total);
+        if (baseline != nullptr)
+            limit("growth", (*budget)["growth"], total - Number((*baseline)["code"]) - Number((*baseline)["bss"]));
+        for (const auto &module : (*budget)["modules"].members)
+        {
+            const Json &sizes = report["modules"][module.first];
+            limit("module " + module.first, module.second, Number(sizes["code"]) + Number(sizes["bss"]));
+        }
+        return ok;
+    }
+};
@@ -5,6 +5,8 @@ class sized_array
 public:
     unsigned char *data = nullptr;
     unsigned int length;
+    // false when this is a view into memory owned by someone else
+    bool owned = false;
 
     sized_array(unsigned char *_data, unsigned int _length)
     {
@@ -21,10 +23,42 @@ public:
     sized_array(unsigned int _length)
     {
         length = _length;
-        data = new unsigned char[_length];
+        data = new unsigned char[_length]();
+        owned = true;
     }
+
+    sized_array(const sized_array &) = delete;
+    sized_array &operator=(const sized_array &) = delete;
+
+    sized_array(sized_array &&other)
+    {
+        data = other.data;
+        length = other.length;
+        owned = other.owned;
+        other.data = nullptr;
+        other.length = 0;
+        other.owned = false;
+    }
+
+    sized_array &operator=(sized_array &&other)
+    {
+        if (this != &other)
+        {
+            if (owned)
+                delete[] data;
+            data = other.data;
+            length = other.length;
+            owned = other.owned;
+            other.data = nullptr;
+            other.length = 0;
+            other.owned = false;
+        }
+        return *this;
+    }
+
     ~sized_array()
     {
-        delete data;
+        if (owned)
+            delete[] data;
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "common.hpp"
+#include "file.hpp"
+
+// Wall time per phase and per-version counters (-stats), plus the raw spans
+// written out as Chrome trace-event JSON (-trace=out.json).
+class Stats
+{
+public:
+    inline static bool Enabled = false;
+    inline static bool Tracing = false;
+
+    // Name of the version the current thread is working on; "" outside of a version
+    inline static thread_local std::string CurrentVersion;
+
+    struct Phase
+    {
+        std::string version;
+        std::string name;
+        uint calls;
+        long long microseconds;
+    };
+
+    struct Event
+    {
+        std::string name;
+        std::string version;
+        std::string detail;
+        long long start, duration;
+        uint thread;
+    };
+
+    inline static std::mutex _lock;
+    inline static std::vector<Phase> _phases;
+    inline static std::vector<Event> _events;
+    inline static std::vector<std::pair<std::string, std::map<std::string, ulong>>> _counters;
+    inline static std::map<std::thread::id, uint> _threads;
+    inline static std::chrono::steady_clock::time_point _epoch = std::chrono::steady_clock::now();
+
+    static bool Active() { return Enabled || Tracing; }
+
+    static long long Now()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _epoch).count();
+    }
+
+    static void Record(const std::string &name, const std::string &detail, long long start, long long duration)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+
+        if (Enabled)
+        {
+            auto phase = std::find_if(_phases.begin(), _phases.end(), [&](const Phase &p)
+                                      { return p.version == CurrentVersion && p.name == name; });
+            if (phase == _phases.end())
+                _phases.push_back(Phase{.version = CurrentVersion, .name = name, .calls = 1, .microseconds = duration});
+            else
+            {
+                phase->calls++;
+                phase->microseconds += duration;
+            }
+        }
+
+        if (Tracing)
+        {
+            auto thread = _threads.try_emplace(std::this_thread::get_id(), (uint)_threads.size() + 1).first->second;
+            _events.push_back(Event{.name = name, .version = CurrentVersion, .detail = detail, .start = start, .duration = duration, .thread = thread});
+        }
+    }
+
+    static void Count(const std::string &name, ulong amount = 1)
+    {
+        if (!Enabled)
+            return;
+
+        std::lock_guard<std::mutex> guard(_lock);
+
+        auto version = std::find_if(_counters.begin(), _counters.end(), [](const auto &c)
+                                    { return c.first == CurrentVersion; });
+        if (version == _counters.end())
+        {
+            _counters.push_back({CurrentVersion, {}});
+            version = _counters.end() - 1;
+        }
+        version->second[name] += amount;
+    }
+
+    // Times everything until the end of the enclosing block
+    class Scope
+    {
+    public:
+        const char *_name;
+        std::string _detail;
+        long long _start = -1;
+
+        Scope(const char *name, const std::string &detail = "")
+        {
+            if (!Active())
+                return;
+            _name = name;
+            _detail = detail;
+            _start = Now();
+        }
+
+        ~Scope()
+        {
+            if (_start >= 0)
+                Record(_name, _detail, _start, Now() - _start);
+        }
+    };
+
+    static void Report()
+    {
+        // versions in the order they first showed up; phases from other threads can interleave
+        std::vector<std::string> versions;
+        for (const Phase &phase : _phases)
+        {
+            if (std::find(versions.begin(), versions.end(), phase.version) == versions.end())
+                versions.push_back(phase.version);
+        }
+
+        writeline("timings:");
+        for (const std::string &version : versions)
+        {
+            writeline("  %s", version.empty() ? "(all versions)" : version.c_str());
+            for (const Phase &phase : _phases)
+            {
+                if (phase.version == version)
+                    writeline("    %-28s %6u call(s) %12.3f ms", phase.name.c_str(), phase.calls, phase.microseconds / 1000.0);
+            }
+        }
+
+        writeline("counts:");
+        for (const auto &version : _counters)
+        {
+            writeline("  %s", version.first.empty() ? "(all versions)" : version.first.c_str());
+            for (const auto &counter : version.second)
+                writeline("    %-28s %10llu", counter.first.c_str(), (unsigned long long)counter.second);
+        }
+    }
+
+    static std::string EscapeJson(const std::string &input)
+    {
+        std::string output;
+        for (char c : input)
+        {
+            if (c == '"' || c == '\\')
+                output += '\\';
+            if ((byte)c < 0x20)
+                output += std::format("\\u{0:04x}", (int)c);
+            else
+                output += c;
+        }
+        return output;
+    }
+
+    static void WriteTrace(const std::string &path)
+    {
+        std::string json = "{\"traceEvents\":[\n";
+
+        for (size_t i = 0; i < _events.size(); i++)
+        {
+            const Event &e = _events[i];
+            json += std::format("{{\"name\":\"{0}\",\"cat\":\"{1}\",\"ph\":\"X\",\"ts\":{2},\"dur\":{3},\"pid\":1,\"tid\":{4},\"args\":{{\"version\":\"{1}\",\"detail\":\"{5}\"}}}}",
+                                EscapeJson(e.name), EscapeJson(e.version), e.start, e.duration, e.thread, EscapeJson(e.detail));
+            json += (i != _events.size() - 1) ? ",\n" : "\n";
+        }
+
+        json += "],\"displayTimeUnit\":\"ms\"}\n";
+        File::WriteAllText(path, json);
+    }
+};
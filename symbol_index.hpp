@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include "common.hpp"
+#include "word.hpp"
+
+// Every symbol a link defined, sorted by address, built once at the end of
+// BuildSymbolTables and read-only after that (bar the instrumentation stubs,
+// which are only named once they are filled in). The linker, the commands,
+// the symbol map and diagnostics all query this one copy.
+//
+// Several symbols can start at the same address (a function and its section,
+// a weak alias...). Of those, the "primary" one is the one with a size, then
+// the global one, then the first one added; that is the one At() returns and
+// the one the symbol map lists.
+class SymbolIndex
+{
+public:
+    struct Entry
+    {
+        uint start;
+        uint size;
+        uint name; // index into _names
+        WordType type;
+        bool isGlobal;
+        bool isPrimary;
+
+        Word Address() const { return {type, start}; }
+        bool Contains(uint address) const { return address >= start && address - start < size; }
+    };
+
+    std::vector<std::string> _names;
+    std::vector<Entry> _entries;
+    bool _finished = false;
+
+    void Add(const std::string &name, Word address, uint size, bool isGlobal)
+    {
+        if (_finished)
+            writeline("symbols cannot be added to a finished index");
+
+        _entries.push_back(Entry{.start = address.Value, .size = size, .name = (uint)_names.size(), .type = address.Type, .isGlobal = isGlobal});
+        _names.push_back(name);
+    }
+
+    // Lets a finished index take more symbols; Finish has to run again before
+    // it is queried. Nothing may hold on to an Entry across this.
+    void Reopen()
+    {
+        for (Entry &entry : _entries)
+            entry.isPrimary = false;
+        _finished = false;
+    }
+
+    // Sorts the entries and picks the primary symbol at each address
+    void Finish()
+    {
+        std::stable_sort(_entries.begin(), _entries.end(), [](const Entry &a, const Entry &b)
+                         { return a.start < b.start; });
+
+        for (size_t group = 0; group < _entries.size();)
+        {
+            size_t end = group + 1;
+            size_t primary = group;
+            for (; end < _entries.size() && _entries[end].start == _entries[group].start; end++)
+            {
+                const Entry &entry = _entries[end], &best = _entries[primary];
+                if ((entry.size != 0 && best.size == 0) || (entry.size == best.size && entry.isGlobal && !best.isGlobal))
+                    primary = end;
+            }
+
+            // keep the primary one first in its group, so lookups find it straight away
+            std::rotate(_entries.begin() + group, _entries.begin() + primary, _entries.begin() + primary + 1);
+            _entries[group].isPrimary = true;
+            group = end;
+        }
+        _finished = true;
+    }
+
+    const std::string &Name(const Entry *entry) const
+    {
+        return _names[entry->name];
+    }
+
+    // The primary symbol starting exactly at address; nullptr if there is none
+    const Entry *At(Word address) const
+    {
+        auto found = std::lower_bound(_entries.begin(), _entries.end(), address.Value, [](const Entry &entry, uint value)
+                                      { return entry.start < value; });
+        return (found != _entries.end() && found->start == address.Value) ? &*found : nullptr;
+    }
+
+    // The size of the primary symbol at address, or 0; unlike a map lookup,
+    // this never adds anything
+    uint SizeAt(Word address) const
+    {
+        const Entry *entry = At(address);
+        return (entry != nullptr) ? entry->size : 0;
+    }
+
+    // The closest primary symbol starting at or before address; nullptr if there is none
+    const Entry *Nearest(Word address) const
+    {
+        auto after = std::upper_bound(_entries.begin(), _entries.end(), address.Value, [](uint value, const Entry &entry)
+                                      { return value < entry.start; });
+        if (after == _entries.begin())
+            return nullptr;
+
+        auto entry = after - 1;
+        while (!entry->isPrimary)
+            entry--;
+        return &*entry;
+    }
+
+    // The symbol whose extent covers address. Symbols don't nest, so only the
+    // ones starting at the nearest address below it can; the largest wins.
+    const Entry *Containing(Word address) const
+    {
+        const Entry *group = Nearest(address);
+        if (group == nullptr)
+            return nullptr;
+
+        const Entry *best = nullptr;
+        for (const Entry *entry = group; entry != _entries.data() + _entries.size() && entry->start == group->start; entry++)
+        {
+            if (entry->Contains(address.Value) && (best == nullptr || entry->size > best->size))
+                best = entry;
+        }
+        return best;
+    }
+
+    // "name+0x10" for diagnostics, or just the address if no symbol covers it
+    std::string Describe(Word address) const
+    {
+        const Entry *entry = Containing(address);
+        if (entry == nullptr)
+            return std::format("0x{0:08X}", address.Value);
+        if (entry->start == address.Value)
+            return Name(entry);
+        return std::format("{0}+0x{1:X}", Name(entry), address.Value - entry->start);
+    }
+};
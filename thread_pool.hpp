@@ -0,0 +1,85 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "common.hpp"
+
+// Runs a batch of independent tasks on a fixed number of threads. Each worker
+// starts on its own share of the batch and steals from the others once it
+// runs dry, so a couple of long tasks don't leave the other threads idle.
+class ThreadPool
+{
+public:
+    static uint DefaultThreads()
+    {
+        uint threads = std::thread::hardware_concurrency();
+        return (threads == 0) ? 1 : threads;
+    }
+
+    // Returns once every task has finished. Tasks may not add more tasks.
+    static void Run(const std::vector<std::function<void()>> &tasks, uint threads = DefaultThreads())
+    {
+        if (threads > tasks.size())
+            threads = (uint)tasks.size();
+        if (threads <= 1)
+        {
+            for (auto &task : tasks)
+                task();
+            return;
+        }
+
+        struct Queue
+        {
+            std::mutex lock;
+            std::deque<size_t> items;
+        };
+        std::vector<Queue> queues(threads);
+        for (size_t i = 0; i < tasks.size(); i++)
+            queues[i % threads].items.push_back(i);
+
+        auto work = [&](uint self)
+        {
+            while (true)
+            {
+                size_t task = 0;
+                bool found = false;
+
+                // own work from the back, stolen work from the front
+                for (uint k = 0; !found && k < threads; k++)
+                {
+                    Queue &queue = queues[(self + k) % threads];
+                    std::lock_guard<std::mutex> guard(queue.lock);
+                    if (queue.items.empty())
+                        continue;
+
+                    if (k == 0)
+                    {
+                        task = queue.items.back();
+                        queue.items.pop_back();
+                    }
+                    else
+                    {
+                        task = queue.items.front();
+                        queue.items.pop_front();
+                    }
+                    found = true;
+                }
+
+                // nothing adds tasks, so every queue being empty means we're done
+                if (!found)
+                    return;
+                tasks[task]();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (uint i = 1; i < threads; i++)
+            workers.emplace_back(work, i);
+        work(0);
+
+        for (auto &worker : workers)
+            worker.join();
+    }
+};
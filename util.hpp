@@ -39,29 +39,24 @@ public:
         bw->WriteBE((ushort)(value & 0xFFFF));
     }
 
-    static ushort ExtractUInt16(byte *array, long offset)
+    static ushort ExtractUInt16(const byte *array, long offset)
     {
-        return (ushort)((array[offset] << 8) | array[offset + 1]);
+        return Endian::Load<ushort>(array + offset);
     }
 
-    static uint ExtractUInt32(byte *array, long offset)
+    static uint ExtractUInt32(const byte *array, long offset)
     {
-        return (uint)((array[offset] << 24) | (array[offset + 1] << 16) |
-                      (array[offset + 2] << 8) | array[offset + 3]);
+        return Endian::Load<uint>(array + offset);
     }
 
     static void InjectUInt16(byte *array, long offset, ushort value)
     {
-        array[offset] = (byte)((value >> 8) & 0xFF);
-        array[offset + 1] = (byte)(value & 0xFF);
+        Endian::Store(array + offset, value);
     }
 
     static void InjectUInt32(byte *array, long offset, uint value)
     {
-        array[offset] = (byte)((value >> 24) & 0xFF);
-        array[offset + 1] = (byte)((value >> 16) & 0xFF);
-        array[offset + 2] = (byte)((value >> 8) & 0xFF);
-        array[offset + 3] = (byte)(value & 0xFF);
+        Endian::Store(array + offset, value);
     }
 
     static std::string ExtractNullTerminatedString(byte *table, unsigned int tableLength, int offset)
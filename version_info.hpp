@@ -1,18 +1,24 @@
 #include "common.hpp"
 #include "address_mapper.hpp"
 #include "file.hpp"
+#include "arena.hpp"
 
 class VersionInfo
 {
 public:
+    // owns every mapper, including the ones only used as a base
+    Arena _arena;
     std::map<std::string, AddressMapper *> _mappers;
 
     VersionInfo()
     {
-        _mappers["default"] = new AddressMapper();
+        _mappers["default"] = _arena.New<AddressMapper>();
     }
 
-    VersionInfo(std::string path)
+    VersionInfo(const std::string &path) : VersionInfo(File::ReadAllLines(path)) {}
+
+    // A versions file's contents, one line per entry
+    VersionInfo(const std::vector<std::string> &lines)
     {
         std::regex commentRegex("^\\s*#");
         std::regex emptyLineRegex("^\\s*$");
@@ -21,9 +27,9 @@ public:
         std::regex mappingRegex("^\\s*([a-fA-F0-9]{8})-((?:[a-fA-F0-9]{8})|\\*)\\s*:\\s*([-+])0x([a-fA-F0-9]+)\\s*(#.*)?$");
 
         std::string currentVersionName;
-        AddressMapper *currentVersion;
+        AddressMapper *currentVersion = nullptr;
 
-        for (std::string line : File::ReadAllLines(path))
+        for (const std::string &line : lines)
         {
             if (std::regex_match(line, emptyLineRegex))
                 continue;
@@ -35,9 +41,9 @@ public:
             {
                 currentVersionName = matches[1];
                 if (_mappers.contains(currentVersionName))
-                    writeline("versions file contains duplicate version name %s\n", currentVersionName);
+                    writeline("versions file contains duplicate version name %s\n", currentVersionName.c_str());
 
-                currentVersion = new AddressMapper();
+                currentVersion = _arena.New<AddressMapper>();
                 _mappers[currentVersionName] = currentVersion;
                 continue;
             }
@@ -48,9 +54,9 @@ public:
                 {
                     std::string baseName = matches[1];
                     if (!_mappers.contains(baseName))
-                        writeline("version %s extends unknown version %s\n", currentVersionName, baseName);
+                        writeline("version %s extends unknown version %s\n", currentVersionName.c_str(), baseName.c_str());
                     if (currentVersion->Base != nullptr)
-                        writeline("version %s already extends a version\n", currentVersionName);
+                        writeline("version %s already extends a version\n", currentVersionName.c_str());
 
                     currentVersion->Base = _mappers[baseName];
                     continue;
@@ -61,11 +67,11 @@ public:
                     uint startAddress, endAddress;
                     int delta;
 
-                    startAddress = std::stoi(matches[1], 0, 16);
+                    startAddress = std::stoul(matches[1], 0, 16);
                     if (matches[2] == "*")
                         endAddress = 0xFFFFFFFF;
                     else
-                        endAddress = std::stoi(matches[2], 0, 16);
+                        endAddress = std::stoul(matches[2], 0, 16);
 
                     delta = std::stoi(matches[4], 0, 16);
                     if (matches[3] == "-")
@@ -76,7 +82,7 @@ public:
                 }
             }
 
-            writeline("unrecognised line in versions file: %s\n", line);
+            writeline("unrecognised line in versions file: %s\n", line.c_str());
         }
     }
 };
@@ -72,17 +72,17 @@ public:
     void AssertAbsolute()
     {
         if (!IsAbsolute())
-            writeline("word %s must be an absolute address in this context\n", ToString());
+            writeline("word %s must be an absolute address in this context\n", ToString().c_str());
     }
     void AssertNotRelative()
     {
         if (IsRelative())
-            writeline("word %s cannot be a relative address in this context", ToString());
+            writeline("word %s cannot be a relative address in this context", ToString().c_str());
     }
     void AssertValue()
     {
         if (!IsValue())
-            writeline("word %s must be a value in this context", ToString());
+            writeline("word %s must be a value in this context", ToString().c_str());
     }
     void AssertNotAmbiguous()
     {